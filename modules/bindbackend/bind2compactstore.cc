@@ -0,0 +1,166 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2014  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    Additionally, the license of this program contains a special
+    exception which allows to distribute the program in binary form when
+    it is linked against OpenSSL.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "bindbackend2.hh"
+#include <algorithm>
+#include <limits>
+#include <boost/functional/hash.hpp>
+#include "pdns/pdnsexception.hh"
+
+uint32_t Bind2CompactStore::checkOffset(size_t offset)
+{
+  if(offset > std::numeric_limits<uint32_t>::max())
+    throw PDNSException("Zone too large for compact storage");
+  return offset;
+}
+
+void Bind2CompactStore::add(const Bind2DNSRecord& bdr)
+{
+  // recordstorage_t keeps all records of a name together, so we only need to compare with the previous one
+  if(d_names.empty() || d_arena.compare(d_names.back().key, string::npos, bdr.qname)) {
+    if(!d_names.empty())
+      finishName();
+    Name name;
+    name.key=checkOffset(d_arena.size());
+    name.hash=0;
+    name.firstRecord=checkOffset(d_records.size());
+    d_arena.append(bdr.qname);
+    d_names.push_back(name);
+  }
+  if(d_curhash.empty())
+    d_curhash=bdr.nsec3hash; // RRSIGs have no hash of their own
+
+  Record record;
+  record.content=checkOffset(d_content.size());
+  record.ttl=bdr.ttl;
+  record.qtype=bdr.qtype;
+  record.priority=bdr.priority;
+  record.auth=bdr.auth;
+  record.hashed=!bdr.nsec3hash.empty();
+  d_content.append(bdr.content);
+  d_records.push_back(record);
+}
+
+void Bind2CompactStore::finishName()
+{
+  d_names.back().hash=checkOffset(d_arena.size());
+  d_arena.append(d_curhash);
+  d_curhash.clear();
+}
+
+namespace {
+struct HashCompare
+{
+  HashCompare(const Bind2CompactStore& store) : d_store(store) {}
+  bool operator()(uint32_t a, uint32_t b) const
+  {
+    return d_store.getHash(a) < d_store.getHash(b);
+  }
+  const Bind2CompactStore& d_store;
+};
+}
+
+void Bind2CompactStore::finish()
+{
+  if(!d_names.empty())
+    finishName();
+
+  Name sentinel;
+  sentinel.key=sentinel.hash=checkOffset(d_arena.size());
+  sentinel.firstRecord=checkOffset(d_records.size());
+  d_names.push_back(sentinel);
+
+  for(uint32_t name=0; name < numNames(); ++name)
+    if(d_names[name+1].key != d_names[name].hash)
+      d_byhash.push_back(name);
+  sort(d_byhash.begin(), d_byhash.end(), HashCompare(*this));
+  buildIndex();
+
+  // give back what the vectors and strings reserved while growing
+  string(d_arena).swap(d_arena);
+  string(d_content).swap(d_content);
+  vector<Name>(d_names).swap(d_names);
+  vector<Record>(d_records).swap(d_records);
+  vector<uint32_t>(d_byhash).swap(d_byhash);
+}
+
+size_t Bind2CompactStore::hashName(const char* begin, const char* end)
+{
+  return boost::hash_range(begin, end);
+}
+
+void Bind2CompactStore::buildIndex()
+{
+  size_t size=16;
+  while(size < 2*(size_t)numNames()) // keeps probe sequences short
+    size*=2;
+  d_index.assign(size, 0);
+  for(uint32_t name=0; name < numNames(); ++name) {
+    size_t slot=hashName(d_arena.c_str()+d_names[name].key, d_arena.c_str()+d_names[name].hash) & (size-1);
+    while(d_index[slot])
+      slot=(slot+1) & (size-1);
+    d_index[slot]=name+1;
+  }
+}
+
+uint32_t Bind2CompactStore::upperBound(const string& qname) const
+{
+  uint32_t low=0, high=numNames();
+  while(low < high) {
+    uint32_t mid=low + (high-low)/2;
+    if(compareName(mid, qname) > 0)
+      high=mid;
+    else
+      low=mid+1;
+  }
+  return low;
+}
+
+bool Bind2CompactStore::find(const string& qname, uint32_t& name) const
+{
+  size_t mask=d_index.size()-1;
+  for(size_t slot=hashName(qname.c_str(), qname.c_str()+qname.size()) & mask; d_index[slot]; slot=(slot+1) & mask) {
+    if(!compareName(d_index[slot]-1, qname)) {
+      name=d_index[slot]-1;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t Bind2CompactStore::hashUpperBound(const string& hash) const
+{
+  uint32_t low=0, high=numHashed();
+  while(low < high) {
+    uint32_t mid=low + (high-low)/2;
+    if(getHash(d_byhash[mid]) > hash)
+      high=mid;
+    else
+      low=mid+1;
+  }
+  return low;
+}
+
+size_t Bind2CompactStore::memoryUsage() const
+{
+  return sizeof(*this) + d_arena.capacity() + d_content.capacity() + d_names.capacity()*sizeof(Name) +
+    d_records.capacity()*sizeof(Record) + d_byhash.capacity()*sizeof(uint32_t) + d_index.capacity()*sizeof(uint32_t);
+}
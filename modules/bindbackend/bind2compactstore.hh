@@ -0,0 +1,153 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2014  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    Additionally, the license of this program contains a special
+    exception which allows to distribute the program in binary form when
+    it is linked against OpenSSL.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef PDNS_BIND2COMPACTSTORE_HH
+#define PDNS_BIND2COMPACTSTORE_HH
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/utility.hpp>
+
+#include "pdns/namespaces.hh"
+
+struct Bind2DNSRecord;
+
+/** Read-only copy of the records of a zone, which takes a fraction of the memory of a recordstorage_t.
+    Used with bind-compact-storage, for deployments with many records.
+
+    Every distinct owner name is stored once, together with its NSEC3 hash, in a single character arena.
+    Record content lives in a second arena. Records are a flat array, in the same order as recordstorage_t
+    keeps them, and owner names are a sorted array pointing into it. So finding a name is a binary search,
+    and all records of a name are adjacent. An open addressing hash table over the names makes exact lookups,
+    which is what most questions need, a single probe most of the time. For NSEC3 zones, a second array lists
+    the hashed names in hash order. Names are referred to by their position in the sorted array. */
+class Bind2CompactStore : public boost::noncopyable
+{
+public:
+  //! records must be in recordstorage_t order, which is what iterating one gives you
+  template<typename Iterator> Bind2CompactStore(Iterator begin, Iterator end)
+  {
+    for(; begin != end; ++begin)
+      add(*begin);
+    finish();
+  }
+
+  struct Record
+  {
+    uint32_t content; //!< offset in the content arena
+    uint32_t ttl;
+    uint16_t qtype;
+    uint16_t priority;
+    bool auth;
+    bool hashed; //!< if this record has a part in the NSEC3 chain
+  };
+
+  //! number of owner names
+  uint32_t numNames() const
+  {
+    return d_names.size() - 1; // there is a sentinel
+  }
+
+  uint32_t numRecords() const
+  {
+    return d_records.size();
+  }
+
+  //! position of the first name that sorts after qname, numNames() if there is none
+  uint32_t upperBound(const string& qname) const;
+  //! finds exactly qname through the hash table, returns false if it is not there
+  bool find(const string& qname, uint32_t& name) const;
+
+  //! the owner name as recordstorage_t has it, so label reversed and relative to the zone
+  string getName(uint32_t name) const
+  {
+    return d_arena.substr(d_names[name].key, d_names[name].hash - d_names[name].key);
+  }
+
+  string getHash(uint32_t name) const
+  {
+    return d_arena.substr(d_names[name].hash, d_names[name+1].key - d_names[name].hash);
+  }
+
+  //! records of a name run from firstRecord(name) up to firstRecord(name+1)
+  uint32_t firstRecord(uint32_t name) const
+  {
+    return d_names[name].firstRecord;
+  }
+
+  const Record& getRecord(uint32_t record) const
+  {
+    return d_records[record];
+  }
+
+  string getContent(uint32_t record) const
+  {
+    uint32_t end = record+1 < d_records.size() ? d_records[record+1].content : d_content.size();
+    return d_content.substr(d_records[record].content, end - d_records[record].content);
+  }
+
+  //! number of names with an NSEC3 hash
+  uint32_t numHashed() const
+  {
+    return d_byhash.size();
+  }
+
+  //! the name at position pos in hash order
+  uint32_t getHashed(uint32_t pos) const
+  {
+    return d_byhash[pos];
+  }
+
+  //! position in hash order of the first name with a hash that sorts after hash, numHashed() if there is none
+  uint32_t hashUpperBound(const string& hash) const;
+
+  //! bytes taken by this store
+  size_t memoryUsage() const;
+
+private:
+  void add(const Bind2DNSRecord& bdr);
+  void finishName();
+  void finish();
+  int compareName(uint32_t name, const string& qname) const
+  {
+    return d_arena.compare(d_names[name].key, d_names[name].hash - d_names[name].key, qname);
+  }
+  static uint32_t checkOffset(size_t offset);
+  void buildIndex();
+  static size_t hashName(const char* begin, const char* end);
+
+  struct Name
+  {
+    uint32_t key;  //!< offset in d_arena of the owner name, which is followed by the hash
+    uint32_t hash;
+    uint32_t firstRecord;
+  };
+
+  string d_arena;
+  string d_content;
+  vector<Name> d_names;
+  vector<Record> d_records;
+  vector<uint32_t> d_byhash;
+  vector<uint32_t> d_index; //!< power of two sized, holds name+1 of the names, 0 for an empty slot
+  string d_curhash; //!< while adding, the hash of the name being added
+};
+
+#endif
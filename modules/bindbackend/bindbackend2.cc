@@ -81,6 +81,7 @@ shared_ptr<Bind2Backend::State> Bind2Backend::s_state;
 
 int Bind2Backend::s_first=1;
 bool Bind2Backend::s_ignore_broken_records=false;
+bool Bind2Backend::s_compact_storage=false;
 
 pthread_mutex_t Bind2Backend::s_startup_lock=PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t Bind2Backend::s_state_lock=PTHREAD_MUTEX_INITIALIZER;
@@ -96,6 +97,7 @@ BB2DomainInfo::BB2DomainInfo()
   d_lastcheck=0;
   d_checknow=false;
   d_status="Unknown";
+  d_loadtime=0;
 }
 
 void BB2DomainInfo::setCheckInterval(time_t seconds)
@@ -396,6 +398,15 @@ void Bind2Backend::parseZoneFile(shared_ptr<State> staging, BB2DomainInfo *bbd)
 {
   NSEC3PARAMRecordContent ns3pr;
   bool nsec3zone=getNSEC3PARAM(bbd->d_name, &ns3pr);
+  parseZoneFile(staging, bbd, nsec3zone, ns3pr);
+}
+
+//! does the actual work of parseZoneFile, but without touching the DNSSEC database, so the load threads can use it
+void Bind2Backend::parseZoneFile(shared_ptr<State> staging, BB2DomainInfo *bbd, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr)
+{
+  DTime dt;
+  dt.set();
+  bbd->d_compact.reset(); // we load into d_records, and compact from there
         
   ZoneParserTNG zpt(bbd->d_filename, bbd->d_name, s_binddirectory);
   DNSResourceRecord rr;
@@ -418,7 +429,15 @@ void Bind2Backend::parseZoneFile(shared_ptr<State> staging, BB2DomainInfo *bbd)
 
   bbd->setCtime();
   bbd->d_loaded=true; 
-  bbd->d_status="parsed into memory at "+nowTime();
+  bbd->d_loadtime=dt.udiff()/1000;
+  bbd->d_status="parsed into memory at "+nowTime()+" in "+lexical_cast<string>(bbd->d_loadtime)+" ms";
+
+  if(s_compact_storage) {
+    bbd->d_compact=shared_ptr<Bind2CompactStore>(new Bind2CompactStore(bbd->d_records->begin(), bbd->d_records->end()));
+    bbd->d_records=shared_ptr<recordstorage_t>(new recordstorage_t);
+    bbd->d_status+=", "+lexical_cast<string>(bbd->d_compact->numRecords())+" records in "+
+      lexical_cast<string>(bbd->d_compact->memoryUsage())+" bytes of compact storage";
+  }
 }
 
 /** THIS IS AN INTERNAL FUNCTION! It does moadnsparser prio impedance matching
@@ -578,20 +597,23 @@ Bind2Backend::Bind2Backend(const string &suffix, bool loadZones)
   setArgPrefix("bind"+suffix);
   d_logprefix="[bind"+suffix+"backend]";
   s_ignore_broken_records=mustDo("ignore-broken-records");
+  s_compact_storage=mustDo("compact-storage");
 
-  Lock l(&s_startup_lock);
-  
   d_transaction_id=0;
-  setupDNSSEC();
-  if(!s_first) {
-    return;
-  }
+  {
+    Lock l(&s_startup_lock);
   
-  s_state = shared_ptr<State>(new State);
-  if(loadZones) {
-    loadConfig();
-    s_first=0;
+    setupDNSSEC();
+    if(!s_first) {
+      return;
+    }
+  
+    s_state = shared_ptr<State>(new State);
+    if(loadZones)
+      s_first=0; // other instances get to serve the zones we loaded so far, instead of waiting for all of them
   }
+  if(loadZones)
+    loadConfig();
   
   extern DynListener *dl;
   dl->registerFunc("BIND-RELOAD-NOW", &DLReloadNowHandler, "bindbackend: reload domains", "<domains>");
@@ -695,6 +717,101 @@ void Bind2Backend::doEmptyNonTerminals(shared_ptr<State> stage, int id, bool nse
   }
 }
 
+//! the zones loadConfig hands out to the load threads, and what becomes of them
+struct Bind2Backend::LoadJobs
+{
+  LoadJobs() : d_rejected(0), d_slowesttime(0)
+  {
+    pthread_mutex_init(&d_lock, 0);
+  }
+  ~LoadJobs()
+  {
+    pthread_mutex_destroy(&d_lock);
+  }
+
+  vector<BB2DomainInfo> d_zones;  //!< copies of the zones to parse, replaced by the parsed versions
+  vector<pair<bool, NSEC3PARAMRecordContent> > d_nsec3;
+  vector<char> d_failed;          //!< if we could not parse a zone, d_status says why
+  AtomicCounter d_next;           //!< next zone in d_zones to hand out
+  pthread_mutex_t d_lock;
+  vector<unsigned int> d_done;    //!< zones parsed since applyLoadedZones last looked, protected by d_lock
+  int d_rejected;
+  string d_slowest;
+  unsigned int d_slowesttime;
+};
+
+void* Bind2Backend::loadThread(void* jobs)
+{
+  while(loadNextZone(*static_cast<LoadJobs*>(jobs)))
+    ;
+  return 0;
+}
+
+//! parses the next zone from jobs, returns false if there is nothing left to do
+bool Bind2Backend::loadNextZone(LoadJobs& jobs)
+{
+  unsigned int n=jobs.d_next++;
+  if(n >= jobs.d_zones.size())
+    return false;
+
+  // insert() wants a State to work on, so give it one of its own
+  shared_ptr<State> own(new State);
+  BB2DomainInfo& bbd=own->id_zone_map[jobs.d_zones[n].d_id];
+  bbd=jobs.d_zones[n];
+  bbd.d_records=shared_ptr<recordstorage_t> (new recordstorage_t());
+
+  try {
+    parseZoneFile(own, &bbd, jobs.d_nsec3[n].first, jobs.d_nsec3[n].second);
+    jobs.d_zones[n]=bbd;
+  }
+  catch(PDNSException &ae) {
+    ostringstream msg;
+    msg<<" error at "+nowTime()+" parsing '"<<bbd.d_name<<"' from file '"<<bbd.d_filename<<"': "<<ae.reason;
+    jobs.d_zones[n].d_status=msg.str(); // and we stay with what we had
+    jobs.d_failed[n]=true;
+  }
+  catch(std::exception &ae) {
+    ostringstream msg;
+    msg<<" error at "+nowTime()+" parsing '"<<bbd.d_name<<"' from file '"<<bbd.d_filename<<"': "<<ae.what();
+    jobs.d_zones[n].d_status=msg.str();
+    jobs.d_failed[n]=true;
+  }
+
+  Lock l(&jobs.d_lock);
+  jobs.d_done.push_back(n);
+  return true;
+}
+
+//! moves the zones the load threads have parsed so far into staging
+void Bind2Backend::applyLoadedZones(LoadJobs& jobs, shared_ptr<State> staging, string* status)
+{
+  vector<unsigned int> done;
+  {
+    Lock l(&jobs.d_lock);
+    done.swap(jobs.d_done);
+  }
+
+  for(vector<unsigned int>::const_iterator n=done.begin(); n != done.end(); ++n) {
+    BB2DomainInfo& bbd=jobs.d_zones[*n];
+    if(jobs.d_failed[*n]) {
+      if(status)
+        *status+=bbd.d_status;
+      L<<Logger::Warning<<d_logprefix<<bbd.d_status<<endl;
+      jobs.d_rejected++;
+      staging->id_zone_map[bbd.d_id].d_status=bbd.d_status;
+    }
+    else {
+      if(bbd.d_loadtime >= jobs.d_slowesttime) {
+        jobs.d_slowest=bbd.d_name;
+        jobs.d_slowesttime=bbd.d_loadtime;
+      }
+      staging->id_zone_map[bbd.d_id]=bbd;
+    }
+    bbd.d_records.reset(); // staging has them now
+    bbd.d_compact.reset();
+  }
+}
+
 void Bind2Backend::loadConfig(string* status)
 {
   // Interference with createDomainEntry()
@@ -737,6 +854,8 @@ void Bind2Backend::loadConfig(string* status)
     }
 
     sort(domains.begin(), domains.end()); // put stuff in inode order
+    LoadJobs jobs;
+    shared_ptr<State> previous=s_state; // we publish partial states while loading
     for(vector<BindDomainInfo>::const_iterator i=domains.begin();
         i!=domains.end();
         ++i) 
@@ -776,35 +895,13 @@ void Bind2Backend::loadConfig(string* status)
         
         if(filenameChanged || !bbd->d_loaded || !bbd->current()) {
           L<<Logger::Info<<d_logprefix<<" parsing '"<<i->name<<"' from file '"<<i->filename<<"'"<<endl;
-
-          try {
-            // we need to allocate a new vector so we don't kill the original, which is still in use!
-            bbd->d_records=shared_ptr<recordstorage_t> (new recordstorage_t()); 
-
-            parseZoneFile(staging, bbd);
-
-            //  s_stage->id_zone_map[bbd->d_id].d_records->swap(*s_staging_zone_map[bbd->d_id].d_records);
-          }
-          catch(PDNSException &ae) {
-            ostringstream msg;
-            msg<<" error at "+nowTime()+" parsing '"<<i->name<<"' from file '"<<i->filename<<"': "<<ae.reason;
-
-            if(status)
-              *status+=msg.str();
-            staging->id_zone_map[bbd->d_id].d_status=msg.str();
-            L<<Logger::Warning<<d_logprefix<<msg.str()<<endl;
-            rejected++;
-          }
-          catch(std::exception &ae) {
-            ostringstream msg;
-            msg<<" error at "+nowTime()+" parsing '"<<i->name<<"' from file '"<<i->filename<<"': "<<ae.what();
-
-            if(status)
-              *status+=msg.str();
-            staging->id_zone_map[bbd->d_id].d_status=msg.str();
-            L<<Logger::Warning<<d_logprefix<<msg.str()<<endl;
-            rejected++;
-          }
+          if(!bbd->d_records)
+            bbd->d_records=shared_ptr<recordstorage_t> (new recordstorage_t());
+          // the load threads parse a copy, so whatever we had keeps being served until the new version is in
+          jobs.d_zones.push_back(*bbd);
+          jobs.d_failed.push_back(false);
+          jobs.d_nsec3.push_back(make_pair(false, NSEC3PARAMRecordContent()));
+          jobs.d_nsec3.back().first=getNSEC3PARAM(bbd->d_name, &jobs.d_nsec3.back().second);
         }
         /*
         vector<vector<BBResourceRecord> *>&tmp=d_zone_id_map[bbd.d_id];  // shrink trick
@@ -812,10 +909,43 @@ void Bind2Backend::loadConfig(string* status)
         */
       }
 
+    // parse the zones, with help from the load threads. Every second we publish what we have so far
+    DTime dt;
+    dt.set();
+    int loadThreads=getArgAsNum("load-threads");
+    vector<pthread_t> tids;
+    for(int n=1; n < loadThreads && n < (int)jobs.d_zones.size(); ++n) {
+      pthread_t tid;
+      pthread_create(&tid, 0, loadThread, &jobs);
+      tids.push_back(tid);
+    }
+    time_t published=time(0);
+    while(loadNextZone(jobs)) {
+      if(time(0) != published) {
+        applyLoadedZones(jobs, staging, status);
+        // zones we have not parsed yet are left out, lookups for an unloaded zone would fail with an exception
+        shared_ptr<State> snapshot(new State);
+        for(name_id_map_t::const_iterator j=staging->name_id_map.begin(); j != staging->name_id_map.end(); ++j) {
+          const BB2DomainInfo& bbd=staging->id_zone_map[j->second];
+          if(bbd.d_loaded) {
+            snapshot->name_id_map.insert(*j);
+            snapshot->id_zone_map[j->second]=bbd;
+          }
+        }
+        Lock l(&s_state_swap_lock);
+        s_state.swap(snapshot);
+        published=time(0);
+      }
+    }
+    for(vector<pthread_t>::const_iterator tid=tids.begin(); tid != tids.end(); ++tid)
+      pthread_join(*tid, 0);
+    applyLoadedZones(jobs, staging, status);
+    rejected=jobs.d_rejected;
+
     // figure out which domains were new and which vanished
     int remdomains=0;
     set<string> oldnames, newnames;
-    for(id_zone_map_t::const_iterator j=s_state->id_zone_map.begin();j != s_state->id_zone_map.end();++j) {
+    for(id_zone_map_t::const_iterator j=previous->id_zone_map.begin();j != previous->id_zone_map.end();++j) {
       oldnames.insert(j->second.d_name);
     }
     for(id_zone_map_t::const_iterator j=staging->id_zone_map.begin(); j!= staging->id_zone_map.end(); ++j) {
@@ -858,6 +988,9 @@ void Bind2Backend::loadConfig(string* status)
     // report
     ostringstream msg;
     msg<<" Done parsing domains, "<<rejected<<" rejected, "<<newdomains<<" new, "<<remdomains<<" removed"; 
+    msg<<", parsed "<<jobs.d_zones.size()<<" in "<<dt.udiff()/1000<<" ms";
+    if(!jobs.d_slowest.empty())
+      msg<<", slowest was '"<<jobs.d_slowest<<"' in "<<jobs.d_slowesttime<<" ms";
     if(status)
       *status=msg.str();
 
@@ -870,6 +1003,7 @@ void Bind2Backend::nukeZoneRecords(BB2DomainInfo *bbd)
 {
   bbd->d_loaded=0; // block further access
   bbd->d_records = shared_ptr<recordstorage_t > (new recordstorage_t);
+  bbd->d_compact.reset();
 }
 
 
@@ -911,8 +1045,135 @@ void Bind2Backend::queueReload(BB2DomainInfo *bbd)
   }
 }
 
+namespace {
+//! a name is part of the NSEC chain if it is no empty non-terminal, and auth or a delegation
+bool inNSECChain(const Bind2CompactStore& store, uint32_t name)
+{
+  for(uint32_t r=store.firstRecord(name); r < store.firstRecord(name+1); ++r) {
+    const Bind2CompactStore::Record& rec=store.getRecord(r);
+    if(rec.qtype && (rec.auth || rec.qtype == QType::NS))
+      return true;
+  }
+  return false;
+}
+
+//! a hashed name is part of the NSEC3 chain if it has an auth record, or is a delegation and we're not doing opt-out
+bool inNSEC3Chain(const Bind2CompactStore& store, uint32_t name, const string& auth, bool optout)
+{
+  bool apex=pdns_iequals(store.getName(name), auth);
+  for(uint32_t r=store.firstRecord(name); r < store.firstRecord(name+1); ++r) {
+    const Bind2CompactStore::Record& rec=store.getRecord(r);
+    if(rec.hashed && (rec.auth || (rec.qtype == QType::NS && !apex && !optout)))
+      return true;
+  }
+  return false;
+}
+}
+
+//! same as findBeforeAndAfterUnhashed, for a zone in compact storage
+bool Bind2Backend::findBeforeAndAfterUnhashedCompact(BB2DomainInfo& bbd, const std::string& qname, std::string& unhashed, std::string& before, std::string& after)
+{
+  string domain=toLower(qname);
+  const Bind2CompactStore& store=*bbd.d_compact;
+  uint32_t upper=store.upperBound(domain);
+
+  if (before.empty()){
+    uint32_t pos=upper;
+    while(pos > 0 && !inNSECChain(store, --pos)) // the apex always is
+      ;
+    before=store.getName(pos);
+  }
+  else {
+    before=domain;
+  }
+
+  after.clear(); // if we find nothing, this points to the apex, which is sure to have auth records
+  for(uint32_t pos=upper; pos < store.numNames(); ++pos) {
+    if(inNSECChain(store, pos)) {
+      after=store.getName(pos);
+      break;
+    }
+  }
+  return true;
+}
+
+//! the NSEC3 half of getBeforeAndAfterNamesAbsolute, for a zone in compact storage
+bool Bind2Backend::findBeforeAndAfterHashedCompact(BB2DomainInfo& bbd, const NSEC3PARAMRecordContent& ns3pr, const std::string& qname, std::string& unhashed, std::string& before, std::string& after)
+{
+  string lqname = toLower(qname);
+  const Bind2CompactStore& store=*bbd.d_compact;
+  uint32_t numHashed=store.numHashed();
+  if(!numHashed) {
+    before.clear();
+    after.clear();
+    return false;
+  }
+
+  uint32_t pos;
+  bool wraponce;
+
+  if (before.empty()) {
+    pos=store.hashUpperBound(lqname);
+
+    if(pos != 0 && (pos == numHashed || store.getHash(store.getHashed(pos)) > lqname))
+      pos--;
+
+    if(pos == 0 && store.getHash(store.getHashed(pos)) > lqname)
+      pos=numHashed;
+
+    wraponce = false;
+    while(pos == numHashed || !inNSEC3Chain(store, store.getHashed(pos), bbd.d_name, ns3pr.d_flags)) {
+      pos--;
+      if(pos == 0) {
+        if (!wraponce) {
+          pos = numHashed;
+          wraponce = true;
+        }
+        else {
+          before.clear();
+          after.clear();
+          return false;
+        }
+      }
+    }
+
+    uint32_t name=store.getHashed(pos);
+    before = store.getHash(name);
+    unhashed = dotConcat(labelReverse(store.getName(name)), bbd.d_name);
+  }
+  else {
+    before = lqname;
+  }
+
+  pos=store.hashUpperBound(lqname);
+  if(pos == numHashed)
+    pos=0;
+
+  wraponce = false;
+  while(!inNSEC3Chain(store, store.getHashed(pos), bbd.d_name, ns3pr.d_flags)) {
+    pos++;
+    if(pos == numHashed) {
+      if (!wraponce) {
+        pos = 0;
+        wraponce = true;
+      }
+      else {
+        before.clear();
+        after.clear();
+        return false;
+      }
+    }
+  }
+
+  after = store.getHash(store.getHashed(pos));
+  return true;
+}
+
 bool Bind2Backend::findBeforeAndAfterUnhashed(BB2DomainInfo& bbd, const std::string& qname, std::string& unhashed, std::string& before, std::string& after)
 {
+  if(bbd.d_compact)
+    return findBeforeAndAfterUnhashedCompact(bbd, qname, unhashed, before, after);
+
   string domain=toLower(qname);
 
   recordstorage_t::const_iterator iter = bbd.d_records->upper_bound(domain);
@@ -968,6 +1229,9 @@ bool Bind2Backend::getBeforeAndAfterNamesAbsolute(uint32_t id, const std::string
     return findBeforeAndAfterUnhashed(bbd, qname, unhashed, before, after);
   
   }
+  else if(bbd.d_compact) {
+    return findBeforeAndAfterHashedCompact(bbd, ns3pr, qname, unhashed, before, after);
+  }
   else {
     string lqname = toLower(qname);
     // cerr<<"\nin bind2backend::getBeforeAndAfterAbsolute: nsec3 HASH for "<<auth<<", asked for: "<<lqname<< " (auth: "<<auth<<".)"<<endl;
@@ -1104,6 +1368,20 @@ void Bind2Backend::lookup(const QType &qtype, const string &qname, DNSPacket *pk
   }
 
   d_handle.d_records = bbd.d_records; // give it a reference counted copy
+
+  if(bbd.d_compact) {
+    d_handle.mustlog = mustlog;
+    d_handle.d_list=false;
+    d_handle.d_compact = bbd.d_compact;
+    uint32_t name;
+    if(d_handle.d_compact->find(labelReverse(toLower(d_handle.qname)), name)) {
+      d_handle.d_crecord=d_handle.d_compact->firstRecord(name);
+      d_handle.d_cend=d_handle.d_compact->firstRecord(name+1);
+    }
+    else
+      d_handle.d_crecord=d_handle.d_cend=0;
+    return;
+  }
   
   if(d_handle.d_records->empty())
     DLOG(L<<"Query with no results"<<endl);
@@ -1160,6 +1438,8 @@ bool Bind2Backend::get(DNSResourceRecord &r)
 
 bool Bind2Backend::handle::get(DNSResourceRecord &r)
 {
+  if(d_compact)
+    return get_compact(r);
   if(d_list)
     return get_list(r);
   else
@@ -1169,6 +1449,7 @@ bool Bind2Backend::handle::get(DNSResourceRecord &r)
 void Bind2Backend::handle::reset()
 {
   d_records.reset();
+  d_compact.reset();
   qname.clear();
   mustlog=false;
 }
@@ -1221,6 +1502,11 @@ bool Bind2Backend::list(const string &target, int id)
   d_handle.d_records=state->id_zone_map[id].d_records; // give it a copy, which will stay around
   d_handle.d_qname_iter= d_handle.d_records->begin();
   d_handle.d_qname_end=d_handle.d_records->end();   // iter now points to a vector of pointers to vector<BBResourceRecords>
+  d_handle.d_compact=state->id_zone_map[id].d_compact;
+  if(d_handle.d_compact) {
+    d_handle.d_cname=d_handle.d_crecord=0;
+    d_handle.d_cend=d_handle.d_compact->numRecords();
+  }
 
   d_handle.id=id;
   d_handle.d_list=true;
@@ -1245,6 +1531,35 @@ bool Bind2Backend::handle::get_list(DNSResourceRecord &r)
 
 }
 
+//! get_normal and get_list in one, for zones in compact storage
+bool Bind2Backend::handle::get_compact(DNSResourceRecord &r)
+{
+  if(!d_list)
+    while(d_crecord != d_cend && !(qtype.getCode()==QType::ANY || d_compact->getRecord(d_crecord).qtype==qtype.getCode()))
+      d_crecord++;
+  if(d_crecord == d_cend)
+    return false;
+
+  if(d_list) {
+    while(d_compact->firstRecord(d_cname+1) <= d_crecord)
+      d_cname++;
+    string name=d_compact->getName(d_cname);
+    r.qname=name.empty() ? domain : (labelReverse(name)+"."+domain);
+  }
+  else
+    r.qname=qname.empty() ? domain : (qname+"."+domain);
+
+  const Bind2CompactStore::Record& record=d_compact->getRecord(d_crecord);
+  r.domain_id=id;
+  r.content=d_compact->getContent(d_crecord);
+  r.qtype=record.qtype;
+  r.ttl=record.ttl;
+  r.priority=record.priority;
+  r.auth=record.auth;
+  d_crecord++;
+  return true;
+}
+
 // this function really is too slow
 bool Bind2Backend::isMaster(const string &name, const string &ip)
 {
@@ -1365,6 +1680,8 @@ class Bind2Factory : public BackendFactory
       void declareArguments(const string &suffix="")
       {
          declare(suffix,"ignore-broken-records","Ignore records that are out-of-bound for the zone.","no");
+         declare(suffix,"load-threads","Number of threads parsing zones at startup and rediscover","1");
+         declare(suffix,"compact-storage","Keep loaded zones in a compact read-only format that needs less memory","no");
          declare(suffix,"config","Location of named.conf","");
          declare(suffix,"check-interval","Interval for zonefile changes","0");
          declare(suffix,"supermaster-config","Location of (part of) named.conf where pdns can write zone-statements to","");
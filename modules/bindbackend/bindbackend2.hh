@@ -38,6 +38,7 @@
 #include <unistd.h>
 #include "pdns/misc.hh"
 #include "pdns/dnsbackend.hh"
+#include "bind2compactstore.hh"
 
 #include "pdns/namespaces.hh"
 using namespace ::boost::multi_index;
@@ -112,8 +113,10 @@ public:
   set<string> d_also_notify; //!< IP list of hosts to also notify
 
   uint32_t d_lastnotified; //!< Last serial number we notified our slaves of
+  unsigned int d_loadtime; //!< milliseconds it took to parse the zone the last time
 
   shared_ptr<recordstorage_t > d_records;  //!< the actual records belonging to this domain
+  shared_ptr<Bind2CompactStore> d_compact; //!< with bind-compact-storage, the records live here instead, and d_records is empty
 private:
   time_t getCtime();
   time_t d_checkinterval;
@@ -176,6 +179,7 @@ public:
   };
 
   void parseZoneFile(shared_ptr<State> staging, BB2DomainInfo *bbd);
+  static void parseZoneFile(shared_ptr<State> staging, BB2DomainInfo *bbd, bool nsec3zone, const NSEC3PARAMRecordContent& ns3pr);
   static void insert(shared_ptr<State> stage, int id, const string &qname, const QType &qtype, const string &content, int ttl=300, int prio=25, const std::string& hashed=string());
   void rediscover(string *status=0);
 
@@ -205,6 +209,10 @@ private:
     recordstorage_t::const_iterator d_qname_iter;
     recordstorage_t::const_iterator d_qname_end;
 
+    shared_ptr<Bind2CompactStore> d_compact; //!< if set, we walk this instead of d_records
+    uint32_t d_crecord, d_cend;   //!< records we still have to go through in d_compact
+    uint32_t d_cname;             //!< name d_crecord belongs to, when listing
+
     bool d_list;
     int id;
 
@@ -216,6 +224,7 @@ private:
   private:
     bool get_normal(DNSResourceRecord &);
     bool get_list(DNSResourceRecord &);
+    bool get_compact(DNSResourceRecord &);
 
     void operator=(const handle& ); // don't go copying this
     handle(const handle &);
@@ -228,6 +237,7 @@ private:
   static shared_ptr<State> getState();
   static int s_first;                                  //!< this is raised on construction to prevent multiple instances of us being generated
   static bool s_ignore_broken_records;
+  static bool s_compact_storage;
 
   static string s_binddirectory;                              //!< this is used to store the 'directory' setting of the bind configuration
   string d_logprefix;
@@ -244,6 +254,8 @@ private:
 
   void queueReload(BB2DomainInfo *bbd);
   bool findBeforeAndAfterUnhashed(BB2DomainInfo& bbd, const std::string& qname, std::string& unhashed, std::string& before, std::string& after);
+  bool findBeforeAndAfterUnhashedCompact(BB2DomainInfo& bbd, const std::string& qname, std::string& unhashed, std::string& before, std::string& after);
+  bool findBeforeAndAfterHashedCompact(BB2DomainInfo& bbd, const NSEC3PARAMRecordContent& ns3pr, const std::string& qname, std::string& unhashed, std::string& before, std::string& after);
   void reload();
   static string DLDomStatusHandler(const vector<string>&parts, Utility::pid_t ppid);
   static string DLListRejectsHandler(const vector<string>&parts, Utility::pid_t ppid);
@@ -252,5 +264,9 @@ private:
   static void fixupAuth(shared_ptr<recordstorage_t> records);
   static void doEmptyNonTerminals(shared_ptr<State> stage, int id, bool nsec3zone, NSEC3PARAMRecordContent ns3pr);
   void loadConfig(string *status=0);
+  struct LoadJobs;
+  static void* loadThread(void* jobs);
+  static bool loadNextZone(LoadJobs& jobs);
+  void applyLoadedZones(LoadJobs& jobs, shared_ptr<State> staging, string* status);
   static void nukeZoneRecords(BB2DomainInfo *bbd);
 };
@@ -3,8 +3,8 @@
 
 // this function can clean any cache that has a getTTD() method on its entries, and a 'sequence' index as its second index
 // the ritual is that the oldest entries are in *front* of the sequence collection, so on a hit, move an item to the end
-// on a miss, move it to the beginning
-template <typename T> void pruneCollection(T& collection, unsigned int maxCached, unsigned int scanFraction=1000)
+// on a miss, move it to the beginning. Entries are only considered expired once they are 'grace' seconds past their ttd
+template <typename T> void pruneCollection(T& collection, unsigned int maxCached, unsigned int scanFraction=1000, uint32_t grace=0)
 {
   uint32_t now=(uint32_t)time(0);
   unsigned int toTrim=0;
@@ -32,7 +32,7 @@ template <typename T> void pruneCollection(T& collection, unsigned int maxCached
 
   typename sequence_t::iterator iter=sidx.begin(), eiter;
   for(; iter != sidx.end() && tried < lookAt ; ++tried) {
-    if(iter->getTTD() < now) { 
+    if(iter->getTTD() + (uint64_t)grace < now) { 
       sidx.erase(iter++);
       erased++;
     }
@@ -34,6 +34,7 @@ DNSProxy *DP;
 DynListener *dl;
 CommunicatorClass Communicator;
 UDPNameserver *N;
+vector<UDPNameserver*> g_udpReceivers; //!< with reuseport, the sockets of receiver threads 1 and up
 int avg_latency;
 TCPNameserver *TN;
 
@@ -79,6 +80,9 @@ void declareArguments()
   ::arg().set("distributor-threads","Default number of Distributor (backend) threads to start")="3";
   ::arg().set("signing-threads","Default number of signer threads to start")="3";
   ::arg().set("receiver-threads","Default number of receiver threads to start")="1";
+  ::arg().setSwitch("reuseport","Give each receiver thread its own SO_REUSEPORT sockets")="no";
+  ::arg().set("receiver-cpus","Comma separated list of CPUs to pin receiver threads to, in order")="";
+  ::arg().set("udp-batch-size","Number of UDP packets to receive or send per system call, 1 disables batching")="1";
   ::arg().set("queue-limit","Maximum number of milliseconds to queue a query")="1500"; 
   ::arg().set("recursor","If recursion is desired, IP address of a recursing nameserver")="no"; 
   ::arg().set("allow-recursion","List of subnets that are allowed to recurse")="0.0.0.0/0";
@@ -132,6 +136,10 @@ void declareArguments()
 
   ::arg().set("default-ttl","Seconds a result is valid if not set otherwise")="3600";
   ::arg().set("max-tcp-connections","Maximum number of TCP connections")="10";
+  ::arg().set("tcp-event-threads","Number of threads serving TCP connections from a multiplexer, 0 gives every connection its own thread")="0";
+  ::arg().set("tcp-axfr-threads","Number of threads doing AXFR and IXFR for the TCP event threads")="2";
+  ::arg().set("tcp-pipeline-depth","Number of questions per TCP connection the event threads answer concurrently, 1 answers them one by one")="1";
+  ::arg().set("tcp-pipeline-threads","Number of backend threads answering the questions of the TCP event threads")="3";
   ::arg().setSwitch("no-shuffle","Set this to prevent random shuffling of answers - for regression testing")="off";
 
   ::arg().set("experimental-logfile", "Filename of the log file for JSON parser" )= "/var/log/pdns.log";
@@ -139,6 +147,7 @@ void declareArguments()
   ::arg().set("setgid","If set, change group id to this gid for more security")="";
 
   ::arg().set("max-cache-entries", "Maximum number of cache entries")="1000000";
+  ::arg().set("max-query-cache-entries", "Maximum number of entries in the query cache")="100000";
   ::arg().set("max-ent-entries", "Maximum number of empty non-terminals in a zone")="100000";
   ::arg().set("entropy-source", "If set, read entropy from this file")="/dev/urandom";
 
@@ -173,8 +182,11 @@ void declareStats(void)
 
   S.declare("tcp-queries","Number of TCP queries received");
   S.declare("tcp-answers","Number of answers sent out over TCP");
+  S.declare("axfr-records","Number of records sent out in outgoing zone transfers");
+  S.declare("axfr-records-per-second","Transfer rate of the last finished outgoing zone transfer");
 
   S.declare("qsize-q","Number of questions waiting for database attention");
+  S.declare("queue-latency","Average number of microseconds questions wait for database attention");
 
   S.declare("deferred-cache-inserts","Amount of cache inserts that were deferred because of maintenance");
   S.declare("deferred-cache-lookup","Amount of cache lookups that were deferred because of maintenance");
@@ -224,13 +236,47 @@ void sendout(const DNSDistributor::AnswerData &AD)
   delete AD.A;  
 }
 
+static void pinReceiverThread(unsigned int number)
+{
+  vector<string> cpus;
+  stringtok(cpus, ::arg()["receiver-cpus"], " ,");
+  if(number >= cpus.size())
+    return;
+#ifdef __linux__
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(atoi(cpus[number].c_str()), &cpuset);
+  int err=pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+  if(err)
+    L<<Logger::Error<<"Unable to pin receiver thread "<<number<<" to CPU "<<cpus[number]<<": "<<strerror(err)<<endl;
+  else
+    L<<Logger::Info<<"Pinned receiver thread "<<number<<" to CPU "<<cpus[number]<<endl;
+#else
+  L<<Logger::Warning<<"Pinning receiver threads to CPUs is not supported on this platform, ignoring receiver-cpus"<<endl;
+#endif
+}
+
 //! The qthread receives questions over the internet via the Nameserver class, and hands them to the Distributor for further processing
 void *qthread(void *number)
 {
+  pinReceiverThread((unsigned int)(unsigned long)number);
+  UDPNameserver *NS = N;
+  if(number != 0 && !g_udpReceivers.empty())
+    NS = g_udpReceivers[(unsigned long)number - 1];
+
   DNSPacket *P;
   DNSDistributor *distributor = new DNSDistributor(::arg().asNum("distributor-threads")); // the big dispatcher!
   DNSPacket question;
-  DNSPacket cached;
+  string cached; // answers from the PacketCache, sent as they are
+
+  UDPBatch *batch=0;
+  unsigned int batchsize=::arg().asNum("udp-batch-size");
+  if(batchsize > 1) {
+    if(UDPBatch::supported())
+      batch=new UDPBatch(batchsize);
+    else if(number==0)
+      L<<Logger::Warning<<"Batched UDP operation is not supported on this platform, ignoring udp-batch-size"<<endl;
+  }
 
   unsigned int &numreceived=*S.getPointer("udp-queries");
   unsigned int &numreceiveddo=*S.getPointer("udp-do-queries");
@@ -255,10 +301,11 @@ void *qthread(void *number)
         int qcount, acount;
         distributor->getQueueSizes(qcount, acount);
         S.set("qsize-q",qcount);
+        S.set("queue-latency",distributor->getQueueLatency());
       }
     }
 
-    if(!(P=N->receive(&question))) { // receive a packet         inline
+    if(!(P=NS->receive(&question, batch))) { // receive a packet         inline
       continue;                    // packet was broken, try again
     }
 
@@ -286,18 +333,11 @@ void *qthread(void *number)
     }
 
 
-    if((P->d.opcode != Opcode::Notify && P->d.opcode != Opcode::Update) && P->couldBeCached() && PC.get(P, &cached)) { // short circuit - does the PacketCache recognize this question?
+    if((P->d.opcode != Opcode::Notify && P->d.opcode != Opcode::Update) && P->couldBeCached() && PC.getWire(P, cached)) { // short circuit - does the PacketCache recognize this question?
       if(logDNSQueries)
         L<<"packetcache HIT"<<endl;
-      cached.setRemote(&P->d_remote);  // inlined
-      cached.setSocket(P->getSocket());                               // inlined
-      cached.d_anyLocal = P->d_anyLocal;
-      cached.setMaxReplyLen(P->getMaxReplyLen());
-      cached.d.rd=P->d.rd; // copy in recursion desired bit 
-      cached.d.id=P->d.id;
-      cached.commitD(); // commit d to the packet                        inlined
-
-      N->send(&cached);   // answer it then                              inlined
+
+      NS->sendWire(cached, P, batch);   // answer it then, ID and RD bit were patched in by the PacketCache
       diff=P->d_dt.udiff();                                                    
       avg_latency=(int)(0.999*avg_latency+0.001*diff); // 'EWMA'
       
@@ -333,6 +373,8 @@ void mainthread()
    g_addSuperfluousNSEC3 = ::arg().mustDo("add-superfluous-nsec3-for-old-bind");
    DNSPacket::s_udpTruncationThreshold = std::max(512, ::arg().asNum("udp-truncation-threshold"));
    DNSPacket::s_doEDNSSubnetProcessing = ::arg().mustDo("edns-subnet-processing");
+   PC.setMaxEntries(::arg().asNum("max-cache-entries"));
+   PC.queryCache().setMaxEntries(::arg().asNum("max-query-cache-entries"));
    {
       std::vector<std::string> codes;
       stringtok(codes, ::arg()["edns-subnet-option-numbers"], "\t ,");
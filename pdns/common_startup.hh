@@ -42,6 +42,7 @@ extern DNSProxy *DP;
 extern DynListener *dl;
 extern CommunicatorClass Communicator;
 extern UDPNameserver *N;
+extern vector<UDPNameserver*> g_udpReceivers;
 extern int avg_latency;
 extern TCPNameserver *TN;
 extern ArgvMap & arg( void );
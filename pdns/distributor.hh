@@ -29,6 +29,7 @@
 #include <vector>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
 #include <unistd.h>
 #include "logger.hh"
 #include "dns.hh"
@@ -36,6 +37,7 @@
 #include "pdnsexception.hh"
 #include "arguments.hh"
 #include "statbag.hh"
+#include "mpmcqueue.hh"
 
 extern StatBag S;
 
@@ -52,6 +54,10 @@ extern StatBag S;
     The Backend needs to count the number of living instances and supply this number to
     the Distributor using its numBackends() method. This is silly.
 
+    Questions travel to the Backend threads over a lock-free ring, sized after max-queue-length.
+    Idle threads sleep on a semaphore which is posted once per question. The depth of the ring 
+    is exact, and the time questions spend waiting in it is tracked as an average.
+
     If an exception escapes a Backend, the distributor retires it.
 */
 template<class Answer, class Question, class Backend> class Distributor
@@ -69,6 +75,10 @@ public:
   int timeoutWait(int id, Answer *, int); //!< wait for a specific answer, with timeout
   static void* makeThread(void *); //!< helper function to create our n threads
   void getQueueSizes(int &questions, int &answers); //!< Returns length of question queue
+  int getQueueLatency() //!< Average number of microseconds a question waits before a Backend picks it up
+  {
+    return d_queueLatency;
+  }
 
   int getNumBusy()
   {
@@ -80,6 +90,7 @@ public:
     Question *Q;
     void (*callback)(const AnswerData &);
     int id;
+    DTime queued;
   };
 
   typedef pair<QuestionData, AnswerData> tuple_t;
@@ -90,8 +101,8 @@ public:
   
 private:
   bool d_overloaded;
-  std::queue<QuestionData> questions;
-  pthread_mutex_t q_lock;
+  MPMCQueue<QuestionData> questions;
+  int d_queueLatency;
   
   deque<tuple_t> answers;
   pthread_mutex_t a_lock;
@@ -112,15 +123,15 @@ private:
 
 //template<class Answer, class Question, class Backend>::nextid;
 
-template<class Answer, class Question, class Backend>Distributor<Answer,Question,Backend>::Distributor(int n)
+template<class Answer, class Question, class Backend>Distributor<Answer,Question,Backend>::Distributor(int n) : questions(::arg().asNum("max-queue-length")+1)
 {
   b=0;
   d_overloaded = false;
+  d_queueLatency = 0;
   nextid=0;
   // d_idle_threads=0;
   d_last_started=time(0);
 //  sem_init(&numquestions,0,0);
-  pthread_mutex_init(&q_lock,0);
 
 //  sem_init(&numanswers,0,0);
   pthread_mutex_init(&a_lock,0);
@@ -149,7 +160,6 @@ template<class Answer, class Question, class Backend>void *Distributor<Answer,Qu
   try {
     Backend *b=new Backend(); // this will answer our questions
     Distributor *us=static_cast<Distributor *>(p);
-    int qcount;
 
     // this is so gross
 #ifndef SMTPREDIR 
@@ -160,22 +170,21 @@ template<class Answer, class Question, class Backend>void *Distributor<Answer,Qu
     for(;;) {
       ++(us->d_idle_threads);
 
-      us->numquestions.getValue( &qcount );
-
       us->numquestions.wait();
 
       --(us->d_idle_threads);
-      pthread_mutex_lock(&us->q_lock);
 
-      QuestionData QD=us->questions.front();
+      QuestionData QD;
+      while(!us->questions.pop(QD)) // we were posted, so a question is there, its producer may still be writing it
+        sched_yield();
 
-      us->questions.pop();
-      pthread_mutex_unlock(&us->q_lock);
+      int waited=QD.queued.udiffNoReset();
+      us->d_queueLatency=(int)(0.999*us->d_queueLatency+0.001*waited); // 'EWMA', racy but so is avg_latency
 
       Question *q=QD.Q;
       
 
-      if(us->d_overloaded && qcount <= overloadQueueLength/10) {
+      if(us->d_overloaded && us->questions.size() <= (size_t)overloadQueueLength/10) {
         us->d_overloaded=false;
       }
       
@@ -300,29 +309,22 @@ template<class Answer, class Question, class Backend>int Distributor<Answer,Ques
   QD.Q=q;
   QD.id=nextid++;
   QD.callback=callback;
+  QD.queued.set();
 
-  pthread_mutex_lock(&q_lock);
-  questions.push(QD);
-  pthread_mutex_unlock(&q_lock);
-
-  numquestions.post();
-  
   static int overloadQueueLength=::arg().asNum("overload-queue-length");
+  static int maxQueueLength=::arg().asNum("max-queue-length");
 
-  if(!(nextid%50)) {
-    int val;
-    numquestions.getValue( &val );
-    
-    if(!d_overloaded)
-      d_overloaded = overloadQueueLength && (val > overloadQueueLength);
-
-    if(val>::arg().asNum("max-queue-length")) {
-      L<<Logger::Error<<val<<" questions waiting for database attention. Limit is "<<::arg().asNum("max-queue-length")<<", respawning"<<endl;
-      _exit(1);
-    }
-
+  int val=questions.size();
+  if(val >= maxQueueLength || !questions.push(QD)) {
+    L<<Logger::Error<<val<<" questions waiting for database attention. Limit is "<<maxQueueLength<<", respawning"<<endl;
+    _exit(1);
   }
 
+  numquestions.post();
+  
+  if(!d_overloaded)
+    d_overloaded = overloadQueueLength && (val > overloadQueueLength);
+
   return QD.id;
 }
 
@@ -361,10 +363,10 @@ template<class Answer, class Question,class Backend>Answer* Distributor<Answer,Q
   // FIXME: write this
 }
 
-template<class Answer, class Question,class Backend>void Distributor<Answer,Question,Backend>::getQueueSizes(int &questions, int &answers)
+template<class Answer, class Question,class Backend>void Distributor<Answer,Question,Backend>::getQueueSizes(int &qcount, int &acount)
 {
-  numquestions.getValue( &questions );
-  numanswers.getValue( &answers );
+  qcount=questions.size();
+  numanswers.getValue( &acount );
 }
 
 #endif // DISTRIBUTOR_HH
@@ -0,0 +1,107 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2014  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2
+    as published by the Free Software Foundation
+
+    Additionally, the license of this program contains a special
+    exception which allows to distribute the program in binary form when
+    it is linked against OpenSSL.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef PDNS_HISTOGRAM_HH
+#define PDNS_HISTOGRAM_HH
+#include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include "namespaces.hh"
+
+/** Log-linear histogram of latencies in microseconds. Every power of two is split in four buckets, so a bucket is
+    at most 25% wide, from 1 usec up to a bucket for everything from 2^29 usec. Submitting is a few shifts and
+    an increment. There is no locking, every thread keeps its own, and they are added up on demand. */
+class LatencyHistogram
+{
+public:
+  enum { SubBits=2, Powers=28, NumBuckets=(Powers << SubBits) + 1 };
+
+  LatencyHistogram()
+  {
+    memset(d_buckets, 0, sizeof(d_buckets));
+  }
+
+  void submit(uint64_t usec)
+  {
+    d_buckets[bucketFor(usec)]++;
+  }
+
+  LatencyHistogram& operator+=(const LatencyHistogram& rhs)
+  {
+    for(unsigned int n=0; n < NumBuckets; ++n)
+      d_buckets[n]+=rhs.d_buckets[n];
+    return *this;
+  }
+
+  uint64_t count() const
+  {
+    uint64_t ret=0;
+    for(unsigned int n=0; n < NumBuckets; ++n)
+      ret+=d_buckets[n];
+    return ret;
+  }
+
+  uint64_t getBucket(unsigned int n) const
+  {
+    return d_buckets[n];
+  }
+
+  //! the upper bound of the bucket the requested percentile falls in, 0 if there is no data
+  uint64_t percentile(double perc) const
+  {
+    uint64_t total=count();
+    if(!total)
+      return 0;
+    uint64_t wanted=min((uint64_t)(total*perc/100.0), total-1), seen=0;
+    for(unsigned int n=0; n < NumBuckets; ++n) {
+      seen+=d_buckets[n];
+      if(seen > wanted)
+        return upperBound(n);
+    }
+    return upperBound(NumBuckets-1);
+  }
+
+  //! latencies in bucket n are below this, the last bucket has no bound and returns the largest uint64_t
+  static uint64_t upperBound(unsigned int n)
+  {
+    if(n >= NumBuckets - 1)
+      return ~(uint64_t)0;
+    if(n < (1 << SubBits))
+      return n + 1;
+    unsigned int power=(n >> SubBits) - 1 + SubBits, sub=n & ((1 << SubBits) - 1);
+    return (1ULL << power) + ((sub + 1ULL) << (power - SubBits));
+  }
+
+private:
+  static unsigned int bucketFor(uint64_t usec)
+  {
+    if(usec < (1 << SubBits))
+      return usec;
+    unsigned int power=63 - __builtin_clzll(usec); // usec lies in [2^power, 2^(power+1))
+    if(power >= Powers + SubBits - 1)
+      return NumBuckets - 1;
+    return ((power - SubBits + 1) << SubBits) + ((usec >> (power - SubBits)) & ((1 << SubBits) - 1));
+  }
+
+  uint64_t d_buckets[NumBuckets];
+};
+
+#endif
@@ -37,6 +37,7 @@
 #include <boost/tuple/tuple.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "namespaces.hh"
 
@@ -175,6 +176,22 @@ union ComboAddress {
   }
 };
 
+//! agrees with ComboAddress::operator==, so the port counts too
+struct ComboAddressHash : public std::unary_function<ComboAddress, size_t>
+{
+  size_t operator()(const ComboAddress& ca) const
+  {
+    size_t seed=0;
+    boost::hash_combine(seed, ca.sin4.sin_family);
+    boost::hash_combine(seed, ca.sin4.sin_port);
+    if(ca.sin4.sin_family == AF_INET)
+      boost::hash_combine(seed, ca.sin4.sin_addr.s_addr);
+    else
+      boost::hash_range(seed, ca.sin6.sin6_addr.s6_addr, ca.sin6.sin6_addr.s6_addr + 16);
+    return seed;
+  }
+};
+
 /** This exception is thrown by the Netmask class and by extension by the NetmaskGroup class */
 class NetmaskException: public PDNSException 
 {
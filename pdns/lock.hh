@@ -34,16 +34,17 @@ class Lock
   pthread_mutex_t *d_lock;
 public:
 
+  //! passing a null lock does nothing, for structures that are only sometimes shared between threads
   Lock(pthread_mutex_t *lock) : d_lock(lock)
   {
-    if(g_singleThreaded)
+    if(g_singleThreaded || !d_lock)
       return;
     if((errno=pthread_mutex_lock(d_lock)))
       throw PDNSException("error acquiring lock: "+stringerror());
   }
   ~Lock()
   {
-    if(g_singleThreaded)
+    if(g_singleThreaded || !d_lock)
       return;
 
     pthread_mutex_unlock(d_lock);
@@ -173,4 +174,31 @@ public:
     pthread_rwlock_wrlock(d_lock);
   }
 };
+
+/** A read/write lock for something that lives in a vector, like the shards of a cache. vector::resize copies and
+    assigns its elements, which pthread_rwlock_t does not allow, so a copy gets a fresh lock and an assignment keeps its own. */
+class ShardRWLock
+{
+public:
+  ShardRWLock() { pthread_rwlock_init(&d_mut, 0); }
+  ShardRWLock(const ShardRWLock&) { pthread_rwlock_init(&d_mut, 0); }
+  ~ShardRWLock() { pthread_rwlock_destroy(&d_mut); }
+  operator pthread_rwlock_t*() { return &d_mut; }
+  ShardRWLock& operator=(const ShardRWLock&) { return *this; }
+private:
+  pthread_rwlock_t d_mut;
+};
+
+//! ShardRWLock, for a plain mutex
+class ShardMutex
+{
+public:
+  ShardMutex() { pthread_mutex_init(&d_mut, 0); }
+  ShardMutex(const ShardMutex&) { pthread_mutex_init(&d_mut, 0); }
+  ~ShardMutex() { pthread_mutex_destroy(&d_mut); }
+  operator pthread_mutex_t*() { return &d_mut; }
+  ShardMutex& operator=(const ShardMutex&) { return *this; }
+private:
+  pthread_mutex_t d_mut;
+};
 #endif
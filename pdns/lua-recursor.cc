@@ -55,7 +55,94 @@ extern "C" {
 RecursorLua::RecursorLua(const std::string &fname)
   : PowerDNSLua(fname)
 {
-  // empty
+  loadHookFilters();
+}
+
+/* reads the optional 'hookfilters' table, for example:
+   hookfilters = { preresolve = { suffixes = { "example.com" }, qtypes = { pdns.A, pdns.AAAA }, netmasks = { "10.0.0.0/8" } } } */
+void RecursorLua::loadHookFilters()
+{
+  for(unsigned int n=0; n < RecursorLuaStats::NumHooks; ++n) {
+    lua_getglobal(d_lua, RecursorLuaStats::hookName(n));
+    d_filters[n].d_defined = lua_isfunction(d_lua, -1);
+    lua_pop(d_lua, 1);
+  }
+
+  lua_getglobal(d_lua, "hookfilters");
+  if(lua_isnil(d_lua, -1)) {
+    lua_pop(d_lua, 1);
+    return;
+  }
+  if(!lua_istable(d_lua, -1)) {
+    lua_pop(d_lua, 1);
+    throw runtime_error("'hookfilters' should be a table");
+  }
+
+  // a misspelled hook name would silently leave that hook unfiltered
+  lua_pushnil(d_lua);
+  while(lua_next(d_lua, -2)) {
+    lua_pop(d_lua, 1); // the value, lua_next wants the key
+    string hook=lua_type(d_lua, -1) == LUA_TSTRING ? lua_tostring(d_lua, -1) : "";
+    unsigned int n=0;
+    while(n < RecursorLuaStats::NumHooks && hook != RecursorLuaStats::hookName(n))
+      ++n;
+    if(n == RecursorLuaStats::NumHooks)
+      theL()<<Logger::Error<<"Ignoring hookfilters for '"<<hook<<"', which is not a hook"<<endl;
+  }
+
+  for(unsigned int n=0; n < RecursorLuaStats::NumHooks; ++n) {
+    RecursorHookFilter& filter=d_filters[n];
+    lua_getfield(d_lua, -1, RecursorLuaStats::hookName(n));
+    if(!lua_istable(d_lua, -1)) {
+      lua_pop(d_lua, 1);
+      continue;
+    }
+
+    lua_getfield(d_lua, -1, "suffixes");
+    if(lua_istable(d_lua, -1)) {
+      lua_pushnil(d_lua);
+      while(lua_next(d_lua, -2)) {
+        string suffix=toLower(lua_tostring(d_lua, -1) ? lua_tostring(d_lua, -1) : "");
+        if(!suffix.empty() && suffix[suffix.size()-1]=='.')
+          suffix.resize(suffix.size()-1);
+        filter.d_suffixes.insert(suffix);
+        lua_pop(d_lua, 1);
+      }
+    }
+    lua_pop(d_lua, 1);
+
+    lua_getfield(d_lua, -1, "qtypes");
+    if(lua_istable(d_lua, -1)) {
+      lua_pushnil(d_lua);
+      while(lua_next(d_lua, -2)) {
+        double qtype=lua_isnumber(d_lua, -1) ? lua_tonumber(d_lua, -1) : -1;
+        if(qtype < 0 || qtype > 65535 || qtype != (uint16_t)qtype)
+          theL()<<Logger::Error<<"Ignoring invalid qtype '"<<(lua_tostring(d_lua, -1) ? lua_tostring(d_lua, -1) : "")<<"' in hookfilters for '"<<RecursorLuaStats::hookName(n)<<"'"<<endl;
+        else
+          filter.d_qtypes.insert((uint16_t)qtype);
+        lua_pop(d_lua, 1);
+      }
+    }
+    lua_pop(d_lua, 1);
+
+    lua_getfield(d_lua, -1, "netmasks");
+    if(lua_istable(d_lua, -1)) {
+      lua_pushnil(d_lua);
+      while(lua_next(d_lua, -2)) {
+        string netmask=lua_tostring(d_lua, -1) ? lua_tostring(d_lua, -1) : "";
+        lua_pop(d_lua, 1);
+        try {
+          filter.d_netmasks.addMask(netmask);
+        }
+        catch(PDNSException& ae) {
+          lua_settop(d_lua, 0);
+          throw runtime_error("Error in hookfilters for '"+string(RecursorLuaStats::hookName(n))+"': "+ae.reason);
+        }
+      }
+    }
+    lua_pop(d_lua, 2); // netmasks and the filter of this hook
+  }
+  lua_pop(d_lua, 1);
 }
 
 int getFakeAAAARecords(const std::string& qname, const std::string& prefix, vector<DNSResourceRecord>& ret)
@@ -111,28 +198,47 @@ int getFakePTRRecords(const std::string& qname, const std::string& prefix, vecto
 
 bool RecursorLua::nxdomain(const ComboAddress& remote, const ComboAddress& local,const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, int& res, bool* variable)
 {
-  return passthrough("nxdomain", remote, local, query, qtype, ret, res, variable);
+  return passthrough(RecursorLuaStats::Nxdomain, remote, local, query, qtype, ret, res, variable);
 }
 
 bool RecursorLua::preresolve(const ComboAddress& remote, const ComboAddress& local,const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, int& res, bool* variable)
 {
-  return passthrough("preresolve", remote, local, query, qtype, ret, res, variable);
+  return passthrough(RecursorLuaStats::Preresolve, remote, local, query, qtype, ret, res, variable);
 }
 
 bool RecursorLua::nodata(const ComboAddress& remote, const ComboAddress& local,const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, int& res, bool* variable)
 {
-  return passthrough("nodata", remote, local, query, qtype, ret, res, variable);
+  return passthrough(RecursorLuaStats::Nodata, remote, local, query, qtype, ret, res, variable);
 }
 
 bool RecursorLua::postresolve(const ComboAddress& remote, const ComboAddress& local,const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, int& res, bool* variable)
 {
-  return passthrough("postresolve", remote, local, query, qtype, ret, res, variable);
+  return passthrough(RecursorLuaStats::Postresolve, remote, local, query, qtype, ret, res, variable);
 }
 
 
-bool RecursorLua::passthrough(const string& func, const ComboAddress& remote, const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, 
+bool RecursorLua::passthrough(RecursorLuaStats::Hook hook, const ComboAddress& remote, const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, 
+  int& res, bool* variable)
+{
+  if(!d_filters[hook].d_defined)
+    return false;
+  if(!d_filters[hook].match(remote, query, qtype)) {
+    d_stats.d_skipped[hook]++;
+    return false;
+  }
+
+  d_stats.d_calls[hook]++;
+  DTime dt;
+  dt.set();
+  bool handled=callHook(hook, remote, local, query, qtype, ret, res, variable);
+  d_stats.d_usec[hook]+=dt.udiff();
+  return handled;
+}
+
+bool RecursorLua::callHook(RecursorLuaStats::Hook hook, const ComboAddress& remote, const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, 
   int& res, bool* variable)
 {
+  const string func=RecursorLuaStats::hookName(hook);
   d_variable = false;
   lua_getglobal(d_lua,  func.c_str());
   if(!lua_isfunction(d_lua, -1)) {
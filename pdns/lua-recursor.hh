@@ -3,6 +3,87 @@
 #include "dns.hh"
 #include "iputils.hh"
 #include "lua-pdns.hh"
+#include <string.h>
+
+//! Per hook counters of a RecursorLua, summed over all threads for 'rec_control get-lua-stats'
+struct RecursorLuaStats
+{
+  enum Hook { Preresolve, Nxdomain, Nodata, Postresolve, NumHooks };
+
+  RecursorLuaStats()
+  {
+    memset(d_calls, 0, sizeof(d_calls));
+    memset(d_skipped, 0, sizeof(d_skipped));
+    memset(d_usec, 0, sizeof(d_usec));
+  }
+
+  RecursorLuaStats& operator+=(const RecursorLuaStats& rhs)
+  {
+    for(unsigned int n=0; n < NumHooks; ++n) {
+      d_calls[n]+=rhs.d_calls[n];
+      d_skipped[n]+=rhs.d_skipped[n];
+      d_usec[n]+=rhs.d_usec[n];
+    }
+    return *this;
+  }
+
+  static const char* hookName(unsigned int hook)
+  {
+    static const char* names[NumHooks]={"preresolve", "nxdomain", "nodata", "postresolve"};
+    return names[hook];
+  }
+
+  uint64_t d_calls[NumHooks];   //!< times Lua was entered
+  uint64_t d_skipped[NumHooks]; //!< times the hookfilters of the script kept us out of Lua
+  uint64_t d_usec[NumHooks];    //!< time spent in Lua, including the conversion of records
+};
+
+/* Which queries a hook wants to see, read from the 'hookfilters' table of the script once it is loaded, so
+   queries the hook is not interested in never have their records turned into Lua tables. An empty set
+   matches everything. */
+struct RecursorHookFilter
+{
+  RecursorHookFilter() : d_defined(false) {}
+
+  bool match(const ComboAddress& remote, const string& query, const QType& qtype)
+  {
+    if(!d_qtypes.empty() && !d_qtypes.count(qtype.getCode()))
+      return false;
+
+    if(!d_netmasks.empty() && !d_netmasks.match(remote))
+      return false;
+
+    if(d_suffixes.empty() || d_suffixes.count(""))
+      return true;
+
+    string::size_type len=query.size();
+    if(len && query[len-1]=='.')
+      len--;
+    for(set<string>::const_iterator i=d_suffixes.begin(); i != d_suffixes.end(); ++i)
+      if(suffixMatch(query, len, *i))
+        return true;
+    return false;
+  }
+
+  //! compares in place, so 'example.com' matches 'www.example.com' but not 'badexample.com'
+  static bool suffixMatch(const string& name, string::size_type len, const string& suffix)
+  {
+    if(suffix.size() > len)
+      return false;
+    string::size_type pos=len-suffix.size();
+    if(pos && name[pos-1]!='.')
+      return false;
+    for(string::size_type n=0; n < suffix.size(); ++n)
+      if(dns_tolower(name[pos+n]) != suffix[n])
+        return false;
+    return true;
+  }
+
+  bool d_defined; //!< the script has a function for this hook
+  set<string> d_suffixes; //!< lowercase, without trailing dot
+  set<uint16_t> d_qtypes;
+  NetmaskGroup d_netmasks;
+};
 
 class RecursorLua : public PowerDNSLua
 {
@@ -14,8 +95,18 @@ public:
   bool nodata(const ComboAddress& remote, const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& res, int& ret, bool* variable);
   bool postresolve(const ComboAddress& remote, const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& res, int& ret, bool* variable);
 
+  const RecursorLuaStats& getStats() const
+  {
+    return d_stats;
+  }
+
 private:
-  bool passthrough(const string& func, const ComboAddress& remote,const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, int& res, bool* variable);
+  void loadHookFilters();
+  bool passthrough(RecursorLuaStats::Hook hook, const ComboAddress& remote,const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, int& res, bool* variable);
+  bool callHook(RecursorLuaStats::Hook hook, const ComboAddress& remote,const ComboAddress& local, const string& query, const QType& qtype, vector<DNSResourceRecord>& ret, int& res, bool* variable);
+
+  RecursorHookFilter d_filters[RecursorLuaStats::NumHooks];
+  RecursorLuaStats d_stats;
 };
 
 #endif
@@ -97,7 +97,8 @@ int readn2(int fd, void* buffer, unsigned int len)
 string nowTime()
 {
   time_t now=time(0);
-  string t=ctime(&now);
+  char buffer[30];
+  string t=ctime_r(&now, buffer); // the BIND backend calls this from several zone loading threads at once
   boost::trim_right(t);
   return t;
 }
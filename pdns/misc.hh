@@ -338,6 +338,24 @@ inline bool pdns_iequals(const std::string& a, const std::string& b)
   return true;
 }
 
+static const uint32_t fnvSeed = 2166136261U;
+
+//! adds a byte to an FNV-1a hash, start from fnvSeed
+inline uint32_t fnvAdd(uint32_t hash, unsigned char c)
+{
+  hash ^= c;
+  return hash * 16777619U;
+}
+
+//! FNV-1a hash of a name, case insensitive so it agrees with pdns_iequals
+inline uint32_t pdns_ihash(const std::string& str, uint32_t hash = fnvSeed) __attribute__((pure));
+inline uint32_t pdns_ihash(const std::string& str, uint32_t hash)
+{
+  for(std::string::const_iterator i = str.begin(); i != str.end(); ++i)
+    hash = fnvAdd(hash, dns_tolower(*i));
+  return hash;
+}
+
 // lifted from boost, with thanks
 class AtomicCounter
 {
@@ -0,0 +1,132 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2014  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2
+    as published by the Free Software Foundation
+
+    Additionally, the license of this program contains a special
+    exception which allows to distribute the program in binary form when
+    it is linked against OpenSSL.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef PDNS_MPMCQUEUE_HH
+#define PDNS_MPMCQUEUE_HH
+
+#include <vector>
+#include <stdint.h>
+#include <boost/utility.hpp>
+
+/** Bounded multi-producer multi-consumer queue that never takes a lock.
+
+    Every cell carries a sequence number which tells producers and consumers whether it is free,
+    filled or still being written to. A producer claims a position by advancing the enqueue counter
+    with a compare-and-swap, fills the cell and then publishes it by bumping its sequence number.
+    Consumers do the same on the dequeue side. The capacity is rounded up to a power of two.
+
+    push() fails when the queue is full. pop() fails when the queue is empty, but also when the oldest
+    cell has been claimed by a producer that has not finished writing it yet. Callers that know an item
+    is there (because they were woken for it) should simply retry. */
+template<typename T> class MPMCQueue : public boost::noncopyable
+{
+public:
+  MPMCQueue(size_t capacity) : d_enqueuePos(0), d_dequeuePos(0)
+  {
+    size_t size=2;
+    while(size < capacity)
+      size<<=1;
+    d_mask=size-1;
+    d_cells.resize(size);
+    for(size_t n=0; n < size; ++n)
+      d_cells[n].seq=n;
+  }
+
+  bool push(const T& data)
+  {
+    Cell* cell;
+    size_t pos=d_enqueuePos;
+    for(;;) {
+      cell=&d_cells[pos & d_mask];
+      size_t seq=cell->seq;
+      __sync_synchronize();
+      intptr_t dif=(intptr_t)seq - (intptr_t)pos;
+      if(!dif) {
+        if(__sync_bool_compare_and_swap(&d_enqueuePos, pos, pos+1))
+          break;
+        pos=d_enqueuePos;
+      }
+      else if(dif < 0)
+        return false; // full
+      else
+        pos=d_enqueuePos;
+    }
+    cell->data=data;
+    __sync_synchronize();
+    cell->seq=pos+1;
+    return true;
+  }
+
+  bool pop(T& data)
+  {
+    Cell* cell;
+    size_t pos=d_dequeuePos;
+    for(;;) {
+      cell=&d_cells[pos & d_mask];
+      size_t seq=cell->seq;
+      __sync_synchronize();
+      intptr_t dif=(intptr_t)seq - (intptr_t)(pos+1);
+      if(!dif) {
+        if(__sync_bool_compare_and_swap(&d_dequeuePos, pos, pos+1))
+          break;
+        pos=d_dequeuePos;
+      }
+      else if(dif < 0)
+        return false; // empty, or the oldest item is not fully written yet
+      else
+        pos=d_dequeuePos;
+    }
+    data=cell->data;
+    __sync_synchronize();
+    cell->seq=pos+d_mask+1;
+    return true;
+  }
+
+  //! number of items claimed by producers and not yet claimed by consumers
+  size_t size() const
+  {
+    size_t dequeuePos=d_dequeuePos;
+    size_t enqueuePos=d_enqueuePos;
+    return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+  }
+
+  size_t capacity() const
+  {
+    return d_mask+1;
+  }
+
+private:
+  struct Cell
+  {
+    volatile size_t seq;
+    T data;
+  };
+
+  std::vector<Cell> d_cells;
+  size_t d_mask;
+  char d_pad0[64]; // keep producers and consumers off each other's cache line
+  volatile size_t d_enqueuePos;
+  char d_pad1[64];
+  volatile size_t d_dequeuePos;
+  char d_pad2[64];
+};
+
+#endif
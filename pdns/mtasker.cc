@@ -270,7 +270,7 @@ template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start,
   getcontext(uc);
   
   uc->uc_link = &d_kernel; // come back to kernel after dying
-  uc->uc_stack.ss_sp = new char[d_stacksize];
+  uc->uc_stack.ss_sp = allocStack();
   
   uc->uc_stack.ss_size = d_stacksize;
   pair<uint32_t, uint32_t> valpair = splitPointer(val);
@@ -306,8 +306,10 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
     return true;
   }
   if(!d_zombiesQueue.empty()) {
-    delete[] (char *)d_threads[d_zombiesQueue.front()].context->uc_stack.ss_sp;
-    delete d_threads[d_zombiesQueue.front()].context;
+    ThreadInfo& ti=d_threads[d_zombiesQueue.front()];
+    d_maxstackusage=std::max(d_maxstackusage, (unsigned int)(ti.startOfStack - ti.highestStackSeen));
+    freeStack((char *)ti.context->uc_stack.ss_sp);
+    delete ti.context;
     d_threads.erase(d_zombiesQueue.front());
     d_zombiesQueue.pop();
     return true;
@@ -402,3 +404,52 @@ template<class Key, class Val>unsigned int MTasker<Key,Val>::getMaxStackUsage()
 {
   return d_threads[d_tid].startOfStack - d_threads[d_tid].highestStackSeen;
 }
+
+//! Returns the maximum stack usage of all MThreads so far, running or exited
+template<class Key, class Val>unsigned int MTasker<Key,Val>::getHighestStackUsage()
+{
+  unsigned int ret=d_maxstackusage;
+  for(typename mthreads_t::const_iterator i=d_threads.begin(); i != d_threads.end(); ++i)
+    ret=std::max(ret, (unsigned int)(i->second.startOfStack - i->second.highestStackSeen));
+  return ret;
+}
+
+//! Returns a stack of d_stacksize bytes, with a guard page below it
+template<class Key, class Val>char* MTasker<Key,Val>::allocStack()
+{
+  if(!d_freestacks.empty()) {
+    char* ret=d_freestacks.back();
+    d_freestacks.pop_back();
+    return ret;
+  }
+
+  size_t guard=pageSize();
+  void* area=mmap(0, guard + d_stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(area == MAP_FAILED)
+    throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+  if(d_hugepages)
+    madvise(area, guard + d_stacksize, MADV_HUGEPAGE); // just advice, no reason to fail over it
+#endif
+  if(mprotect(area, guard, PROT_NONE) < 0) { // stacks grow down, towards the guard page
+    munmap(area, guard + d_stacksize);
+    throw std::bad_alloc();
+  }
+  return (char*)area + guard;
+}
+
+template<class Key, class Val>void MTasker<Key,Val>::freeStack(char* stack)
+{
+  if(d_freestacks.size() < d_maxfreestacks)
+    d_freestacks.push_back(stack);
+  else
+    munmap(stack - pageSize(), pageSize() + d_stacksize);
+}
+
+template<class Key, class Val>MTasker<Key,Val>::~MTasker()
+{
+  while(!d_freestacks.empty()) {
+    munmap(d_freestacks.back() - pageSize(), pageSize() + d_stacksize);
+    d_freestacks.pop_back();
+  }
+}
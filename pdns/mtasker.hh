@@ -28,6 +28,8 @@
 #include <vector>
 #include <map>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/key_extractors.hpp>
@@ -61,6 +63,10 @@ private:
   int d_tid;
   int d_maxtid;
   size_t d_stacksize;
+  std::vector<char*> d_freestacks; // stacks of exited threads, ready for new ones
+  unsigned int d_maxfreestacks;
+  bool d_hugepages;
+  unsigned int d_maxstackusage; // of threads that have exited
 
   EventVal d_waitval;
   enum waitstatusenum {Error=-1,TimeOut=0,Answer} d_waitstatus;
@@ -89,10 +95,17 @@ public:
       This limit applies solely to the stack, the heap is not limited in any way. If threads need to allocate a lot of data,
       the use of new/delete is suggested. 
    */
-  MTasker(size_t stacksize=8192) : d_stacksize(stacksize)
+  /** Stacks are mapped with an inaccessible guard page below them, so a thread that overflows its stack crashes
+      right away instead of corrupting the heap. Up to maxFreeStacks stacks of exited threads are kept for reuse.
+      With hugePages, the kernel is asked to back stacks with huge pages, which only helps for stacks of several megabytes.
+   */
+  MTasker(size_t stacksize=8192, unsigned int maxFreeStacks=0, bool hugePages=false) : 
+    d_maxfreestacks(maxFreeStacks), d_hugepages(hugePages), d_maxstackusage(0)
   {
     d_maxtid=0;
+    d_stacksize=(stacksize + pageSize() - 1) & ~(pageSize() - 1);
   }
+  ~MTasker();
 
   typedef void tfunc_t(void *); //!< type of the pointer that starts a thread 
   int waitEvent(EventKey &key, EventVal *val=0, unsigned int timeoutMsec=0, struct timeval* now=0);
@@ -105,9 +118,25 @@ public:
   unsigned int numProcesses();
   int getTid(); 
   unsigned int getMaxStackUsage();
+  unsigned int getHighestStackUsage();
+  size_t getStackSize() const
+  {
+    return d_stacksize;
+  }
+  unsigned int numFreeStacks() const
+  {
+    return d_freestacks.size();
+  }
 
 private:
   static void threadWrapper(uint32_t self1, uint32_t self2, tfunc_t *tf, int tid, uint32_t val1, uint32_t val2);
+  char* allocStack();
+  void freeStack(char* stack);
+  static size_t pageSize()
+  {
+    static size_t pagesize=sysconf(_SC_PAGESIZE);
+    return pagesize;
+  }
   EventKey d_eventkey;   // for waitEvent, contains exact key it was awoken for
 };
 #include "mtasker.cc"
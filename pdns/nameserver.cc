@@ -90,6 +90,20 @@ extern StatBag S;
 
 vector<ComboAddress> g_localaddresses; // not static, our unit tests need to poke this
 
+/* with reuseport, every receiver thread gets its own set of sockets, and the kernel spreads flows over them */
+void UDPNameserver::setReusePort(int s)
+{
+  if(!::arg().mustDo("reuseport"))
+    return;
+#ifdef SO_REUSEPORT
+  int tmp=1;
+  if(setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char*)&tmp, sizeof tmp) < 0)
+    throw PDNSException("Unable to set SO_REUSEPORT on UDP socket: "+stringerror());
+#else
+  throw PDNSException("reuseport is not supported on this platform");
+#endif
+}
+
 void UDPNameserver::bindIPv4()
 {
   vector<string>locals;
@@ -126,7 +140,10 @@ void UDPNameserver::bindIPv4()
     if(locala.sin4.sin_family != AF_INET) 
       throw PDNSException("Attempting to bind IPv4 socket to IPv6 address");
 
-    g_localaddresses.push_back(locala);
+    setReusePort(s);
+
+    if(!d_additional_socket)
+      g_localaddresses.push_back(locala);
     if(::bind(s, (sockaddr*)&locala, locala.getSocklen()) < 0) {
       L<<Logger::Error<<"binding UDP socket to '"+locala.toStringWithPort()+": "<<strerror(errno)<<endl;
       throw PDNSException("Unable to bind to UDP socket");
@@ -217,7 +234,10 @@ void UDPNameserver::bindIPv6()
       setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &val, sizeof(val)); 
       setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val));      // if this fails, we report an error in tcpreceiver too
     }
-    g_localaddresses.push_back(locala);
+    setReusePort(s);
+
+    if(!d_additional_socket)
+      g_localaddresses.push_back(locala);
     if(::bind(s, (sockaddr*)&locala, sizeof(locala))<0) {
       L<<Logger::Error<<"binding to UDP ipv6 socket: "<<strerror(errno)<<endl;
       throw PDNSException("Unable to bind to UDP ipv6 socket");
@@ -234,7 +254,7 @@ void UDPNameserver::bindIPv6()
 #endif
 }
 
-UDPNameserver::UDPNameserver()
+UDPNameserver::UDPNameserver(bool additional_socket) : d_additional_socket(additional_socket)
 {
   if(!::arg()["local-address"].empty())
     bindIPv4();
@@ -247,55 +267,28 @@ UDPNameserver::UDPNameserver()
 
 ResponseStats g_rs;
 
-void UDPNameserver::send(DNSPacket *p)
+/* sets up msgh to send buffer to p->d_remote, from p->d_anyLocal if that is set. cbuf needs to be 256 bytes */
+static void fillMSGHdr(struct msghdr* msgh, struct iovec* iov, char* cbuf, const string& buffer, DNSPacket* p)
 {
-  const string& buffer=p->getString();
-  static unsigned int &numanswered=*S.getPointer("udp-answers");
-  static unsigned int &numanswered4=*S.getPointer("udp4-answers");
-  static unsigned int &numanswered6=*S.getPointer("udp6-answers");
-  static unsigned int &bytesanswered=*S.getPointer("udp-answers-bytes");
-
-  g_rs.submitResponse(p->qtype.getCode(), buffer.length(), true);
-
-  struct msghdr msgh;
   struct cmsghdr *cmsg;
-  struct iovec iov;
-  char cbuf[256];
-
-  /* Query statistics */
-  if(p->d.aa) {
-    if (p->d.rcode==RCode::NXDomain)
-      S.ringAccount("nxdomain-queries",p->qdomain+"/"+p->qtype.getName());
-  } else if (p->isEmpty()) {
-    S.ringAccount("unauth-queries",p->qdomain+"/"+p->qtype.getName());
-    S.ringAccount("remotes-unauth",p->getRemote());
-  }
-
-  /* Count responses (total/v4/v6) and byte counts */
-  numanswered++;
-  bytesanswered+=buffer.length();
-  if(p->d_remote.sin4.sin_family==AF_INET)
-    numanswered4++;
-  else
-    numanswered6++;
 
   /* Set up iov and msgh structures. */
-  memset(&msgh, 0, sizeof(struct msghdr));
-  iov.iov_base = (void*)buffer.c_str();
-  iov.iov_len = buffer.length();
-  msgh.msg_iov = &iov;
-  msgh.msg_iovlen = 1;
-  msgh.msg_name = (struct sockaddr*)&p->d_remote;
-  msgh.msg_namelen = p->d_remote.getSocklen();
+  memset(msgh, 0, sizeof(struct msghdr));
+  iov->iov_base = (void*)buffer.c_str();
+  iov->iov_len = buffer.length();
+  msgh->msg_iov = iov;
+  msgh->msg_iovlen = 1;
+  msgh->msg_name = (struct sockaddr*)&p->d_remote;
+  msgh->msg_namelen = p->d_remote.getSocklen();
 
   if(p->d_anyLocal) {
     if(p->d_anyLocal->sin4.sin_family == AF_INET6) {
       struct in6_pktinfo *pkt;
           
-      msgh.msg_control = cbuf;
-      msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+      msgh->msg_control = cbuf;
+      msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
                   
-      cmsg = CMSG_FIRSTHDR(&msgh);
+      cmsg = CMSG_FIRSTHDR(msgh);
       cmsg->cmsg_level = IPPROTO_IPV6;
       cmsg->cmsg_type = IPV6_PKTINFO;
       cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -303,15 +296,15 @@ void UDPNameserver::send(DNSPacket *p)
       pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
       memset(pkt, 0, sizeof(*pkt));
       pkt->ipi6_addr = p->d_anyLocal->sin6.sin6_addr;
-      msgh.msg_controllen = cmsg->cmsg_len; // makes valgrind happy and is slightly better style
+      msgh->msg_controllen = cmsg->cmsg_len; // makes valgrind happy and is slightly better style
     }
     else {
 #ifdef IP_PKTINFO
       struct in_pktinfo *pkt;
-      msgh.msg_control = cbuf;
-      msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+      msgh->msg_control = cbuf;
+      msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-      cmsg = CMSG_FIRSTHDR(&msgh);
+      cmsg = CMSG_FIRSTHDR(msgh);
       cmsg->cmsg_level = IPPROTO_IP;
       cmsg->cmsg_type = IP_PKTINFO;
       cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -323,10 +316,10 @@ void UDPNameserver::send(DNSPacket *p)
 #ifdef IP_SENDSRCADDR
       struct in_addr *in;
     
-      msgh.msg_control = cbuf;
-      msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+      msgh->msg_control = cbuf;
+      msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
             
-      cmsg = CMSG_FIRSTHDR(&msgh);
+      cmsg = CMSG_FIRSTHDR(msgh);
       cmsg->cmsg_level = IPPROTO_IP;
       cmsg->cmsg_type = IP_SENDSRCADDR;
       cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -334,13 +327,88 @@ void UDPNameserver::send(DNSPacket *p)
       in = (struct in_addr *) CMSG_DATA(cmsg);
       *in = p->d_anyLocal->sin4.sin_addr;
 #endif
-      msgh.msg_controllen = cmsg->cmsg_len;
+      msgh->msg_controllen = cmsg->cmsg_len;
     }
   }
+}
+
+void UDPNameserver::send(DNSPacket *p, UDPBatch *batch)
+{
+  const string& buffer=p->getString();
+
+  /* Query statistics */
+  if(p->d.aa) {
+    if (p->d.rcode==RCode::NXDomain)
+      S.ringAccount("nxdomain-queries",p->qdomain+"/"+p->qtype.getName());
+  } else if (p->isEmpty()) {
+    S.ringAccount("unauth-queries",p->qdomain+"/"+p->qtype.getName());
+    S.ringAccount("remotes-unauth",p->getRemote());
+  }
+
+  sendBuffer(buffer, p, batch);
+}
+
+void UDPNameserver::sendWire(const string& wire, DNSPacket *q, UDPBatch *batch)
+{
+  const struct dnsheader* dh=(const struct dnsheader*)wire.c_str();
+
+  /* Query statistics, taken from the header as there are no records to look at */
+  if(dh->aa) {
+    if (dh->rcode==RCode::NXDomain)
+      S.ringAccount("nxdomain-queries",q->qdomain+"/"+q->qtype.getName());
+  } else if (!dh->ancount && !dh->nscount && ntohs(dh->arcount) <= (q->hasEDNS() ? 1U : 0U)) { // the OPT record is no answer
+    S.ringAccount("unauth-queries",q->qdomain+"/"+q->qtype.getName());
+    S.ringAccount("remotes-unauth",q->getRemote());
+  }
+
+  sendBuffer(wire, q, batch);
+}
+
+/* p supplies the remote and local addresses, the socket and the qtype */
+void UDPNameserver::sendBuffer(const string& buffer, DNSPacket *p, UDPBatch *batch)
+{
+  static unsigned int &numanswered=*S.getPointer("udp-answers");
+  static unsigned int &numanswered4=*S.getPointer("udp4-answers");
+  static unsigned int &numanswered6=*S.getPointer("udp6-answers");
+  static unsigned int &bytesanswered=*S.getPointer("udp-answers-bytes");
+
+  g_rs.submitResponse(p->qtype.getCode(), buffer.length(), true);
+
+  /* Count responses (total/v4/v6) and byte counts */
+  numanswered++;
+  bytesanswered+=buffer.length();
+  if(p->d_remote.sin4.sin_family==AF_INET)
+    numanswered4++;
+  else
+    numanswered6++;
+
   DLOG(L<<Logger::Notice<<"Sending a packet to "<< p->getRemote() <<" ("<< buffer.length()<<" octets)"<<endl);
   if(buffer.length() > p->getMaxReplyLen()) {
     L<<Logger::Error<<"Weird, trying to send a message that needs truncation, "<< buffer.length()<<" > "<<p->getMaxReplyLen()<<endl;
   }
+
+#ifdef HAVE_RECVMMSG
+  if(batch) {
+    if(batch->d_scount && (batch->d_ssock != p->getSocket() || batch->d_scount == batch->d_size))
+      batch->flush();
+
+    // p is likely to be reused before the batch goes out, so we keep our own copy of everything
+    unsigned int pos=batch->d_scount++;
+    UDPBatch::Slot& slot=batch->d_sslots[pos];
+    batch->d_ssock=p->getSocket();
+    batch->d_sbuffers[pos].assign(buffer);
+    slot.remote=p->d_remote;
+    fillMSGHdr(&batch->d_smsgs[pos].msg_hdr, &slot.iov, slot.cbuf, batch->d_sbuffers[pos], p);
+    batch->d_smsgs[pos].msg_hdr.msg_name = (struct sockaddr*)&slot.remote;
+    return;
+  }
+#endif
+
+  struct msghdr msgh;
+  struct iovec iov;
+  char cbuf[256];
+
+  fillMSGHdr(&msgh, &iov, cbuf, buffer, p);
   if(sendmsg(p->getSocket(), &msgh, 0) < 0)
     L<<Logger::Error<<"Error sending reply with sendmsg (socket="<<p->getSocket()<<"): "<<strerror(errno)<<endl;
 }
@@ -377,31 +445,9 @@ static bool HarvestDestinationAddress(struct msghdr* msgh, ComboAddress* destina
   return false;
 }
 
-DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
+/* waits until one of our sockets is readable, and returns it */
+int UDPNameserver::waitForPacket()
 {
-  ComboAddress remote;
-  extern StatBag S;
-  int len=-1;
-  char mesg[DNSPacket::s_udpTruncationThreshold];
-  Utility::sock_t sock=-1;
-
-  struct msghdr msgh;
-  struct iovec iov;
-  char cbuf[256];
-
-  iov.iov_base = mesg;
-  iov.iov_len  = sizeof(mesg);
-
-  memset(&msgh, 0, sizeof(struct msghdr));
-  
-  msgh.msg_control = cbuf;
-  msgh.msg_controllen = sizeof(cbuf);
-  msgh.msg_name = &remote;
-  msgh.msg_namelen = sizeof(remote);
-  msgh.msg_iov  = &iov;
-  msgh.msg_iovlen = 1;
-  msgh.msg_flags = 0;
-  
   int err;
   vector<struct pollfd> rfds= d_rfds;
 
@@ -415,20 +461,14 @@ DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
     unixDie("Unable to poll for new UDP events");
     
   BOOST_FOREACH(struct pollfd &pfd, rfds) {
-    if(pfd.revents & POLLIN) {
-      sock=pfd.fd;        
-      if((len=recvmsg(sock, &msgh, 0)) < 0 ) {
-        if(errno != EAGAIN)
-          L<<Logger::Error<<"recvfrom gave error, ignoring: "<<strerror(errno)<<endl;
-        return 0;
-      }
-      break;
-    }
+    if(pfd.revents & POLLIN) 
+      return pfd.fd;
   }
-  if(sock==-1)
-    throw PDNSException("poll betrayed us! (should not happen)");
-  
+  throw PDNSException("poll betrayed us! (should not happen)");
+}
 
+DNSPacket *UDPNameserver::parsePacket(DNSPacket *prefilled, const char *mesg, int len, int sock, const ComboAddress& remote, struct msghdr *msgh)
+{
   DLOG(L<<"Received a packet " << len <<" bytes long from "<< remote.toString()<<endl);
   
   DNSPacket *packet;
@@ -441,7 +481,7 @@ DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
   packet->setRemote(&remote);
 
   ComboAddress dest;
-  if(HarvestDestinationAddress(&msgh, &dest)) {
+  if(HarvestDestinationAddress(msgh, &dest)) {
 //    cerr<<"Setting d_anyLocal to '"<<dest.toString()<<"'"<<endl;
     packet->d_anyLocal = dest;
   }            
@@ -457,3 +497,123 @@ DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
   
   return packet;
 }
+
+DNSPacket *UDPNameserver::receive(DNSPacket *prefilled, UDPBatch *batch)
+{
+  if(batch)
+    return receiveBatched(prefilled, batch);
+
+  ComboAddress remote;
+  int len=-1;
+  char mesg[DNSPacket::s_udpTruncationThreshold];
+  Utility::sock_t sock=-1;
+
+  struct msghdr msgh;
+  struct iovec iov;
+  char cbuf[256];
+
+  iov.iov_base = mesg;
+  iov.iov_len  = sizeof(mesg);
+
+  memset(&msgh, 0, sizeof(struct msghdr));
+  
+  msgh.msg_control = cbuf;
+  msgh.msg_controllen = sizeof(cbuf);
+  msgh.msg_name = &remote;
+  msgh.msg_namelen = sizeof(remote);
+  msgh.msg_iov  = &iov;
+  msgh.msg_iovlen = 1;
+  msgh.msg_flags = 0;
+  
+  sock=waitForPacket();
+  if((len=recvmsg(sock, &msgh, 0)) < 0 ) {
+    if(errno != EAGAIN)
+      L<<Logger::Error<<"recvfrom gave error, ignoring: "<<strerror(errno)<<endl;
+    return 0;
+  }
+
+  return parsePacket(prefilled, mesg, len, sock, remote, &msgh);
+}
+
+/* hands out the next packet from the batch, refilling it with a single recvmmsg() once it is drained.
+   Queued answers are flushed before we go to sleep in poll() */
+DNSPacket *UDPNameserver::receiveBatched(DNSPacket *prefilled, UDPBatch *batch)
+{
+#ifdef HAVE_RECVMMSG
+  if(batch->d_rpos == batch->d_rcount) {
+    batch->flush();
+    batch->d_rpos = batch->d_rcount = 0;
+
+    int sock=waitForPacket();
+    unsigned int bufsize=DNSPacket::s_udpTruncationThreshold;
+    for(unsigned int n=0; n < batch->d_size; ++n) {
+      UDPBatch::Slot& slot=batch->d_rslots[n];
+      struct msghdr& msgh=batch->d_rmsgs[n].msg_hdr;
+      slot.iov.iov_base = &batch->d_rbuffer[n*bufsize];
+      slot.iov.iov_len = bufsize;
+      memset(&msgh, 0, sizeof(struct msghdr));
+      msgh.msg_control = slot.cbuf;
+      msgh.msg_controllen = sizeof(slot.cbuf);
+      msgh.msg_name = &slot.remote;
+      msgh.msg_namelen = sizeof(slot.remote);
+      msgh.msg_iov = &slot.iov;
+      msgh.msg_iovlen = 1;
+      batch->d_rmsgs[n].msg_len = 0;
+    }
+
+    int ret=recvmmsg(sock, &batch->d_rmsgs[0], batch->d_size, 0, 0);
+    if(ret < 0) {
+      if(errno != EAGAIN)
+        L<<Logger::Error<<"recvmmsg gave error, ignoring: "<<strerror(errno)<<endl;
+      return 0;
+    }
+    batch->d_rcount=ret;
+    batch->d_rsock=sock;
+    if(!ret)
+      return 0;
+  }
+
+  unsigned int pos=batch->d_rpos++;
+  UDPBatch::Slot& slot=batch->d_rslots[pos];
+  return parsePacket(prefilled, (const char*)slot.iov.iov_base, batch->d_rmsgs[pos].msg_len, batch->d_rsock, slot.remote, &batch->d_rmsgs[pos].msg_hdr);
+#else
+  return receive(prefilled);
+#endif
+}
+
+UDPBatch::UDPBatch(unsigned int size) : d_size(size ? size : 1), d_rpos(0), d_rcount(0), d_rsock(-1), d_scount(0), d_ssock(-1)
+{
+  d_rslots.resize(d_size);
+  d_rbuffer.resize(d_size * DNSPacket::s_udpTruncationThreshold);
+  d_sslots.resize(d_size);
+  d_sbuffers.resize(d_size);
+#ifdef HAVE_RECVMMSG
+  d_rmsgs.resize(d_size);
+  d_smsgs.resize(d_size);
+#endif
+}
+
+bool UDPBatch::supported()
+{
+#ifdef HAVE_RECVMMSG
+  return true;
+#else
+  return false;
+#endif
+}
+
+void UDPBatch::flush()
+{
+#ifdef HAVE_RECVMMSG
+  unsigned int sent=0;
+  while(sent < d_scount) {
+    int ret=sendmmsg(d_ssock, &d_smsgs[sent], d_scount - sent, 0);
+    if(ret <= 0) {
+      L<<Logger::Error<<"Error sending reply with sendmmsg (socket="<<d_ssock<<"): "<<strerror(errno)<<endl;
+      ret=1; // skip the message that failed, and try the rest
+    }
+    sent+=ret;
+  }
+#endif
+  d_scount=0;
+}
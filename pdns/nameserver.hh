@@ -32,6 +32,7 @@
 #include <netdb.h>
 #include <vector>
 #include <boost/foreach.hpp>
+#include <boost/utility.hpp>
 #include "statbag.hh"
 #include "namespaces.hh"
 #include "dnspacket.hh"
@@ -71,17 +72,64 @@
 
 */
 
+#ifdef MSG_WAITFORONE
+#define HAVE_RECVMMSG 1
+#endif
+
+/** Per receiver thread state for batched UDP operation. When handed to UDPNameserver::receive(), up to 
+    'size' datagrams are pulled in with a single recvmmsg() call and handed out one by one. Answers passed
+    to UDPNameserver::send() with a batch are queued, and go out in a single sendmmsg() call once the batch 
+    is full, the socket changes, or receive() is about to wait for new packets. 
+
+    Each queued message carries its own control buffer, so the local address of every query is preserved. */
+class UDPBatch : public boost::noncopyable
+{
+public:
+  UDPBatch(unsigned int size);
+  void flush(); //!< send out all queued answers
+  static bool supported();
+private:
+  friend class UDPNameserver;
+  struct Slot
+  {
+    ComboAddress remote;
+    struct iovec iov;
+    char cbuf[256];
+  };
+  unsigned int d_size;
+
+  vector<Slot> d_rslots;
+  vector<char> d_rbuffer;
+  unsigned int d_rpos, d_rcount;
+  int d_rsock;
+
+  vector<Slot> d_sslots;
+  vector<string> d_sbuffers;
+  unsigned int d_scount;
+  int d_ssock;
+#ifdef HAVE_RECVMMSG
+  vector<struct mmsghdr> d_rmsgs, d_smsgs;
+#endif
+};
+
 class UDPNameserver
 {
 public:
-  UDPNameserver();  //!< Opens the socket
-  DNSPacket *receive(DNSPacket *prefilled=0); //!< call this in a while or for(;;) loop to get packets
-  static void send(DNSPacket *); //!< send a DNSPacket. Will call DNSPacket::truncate() if over 512 bytes
+  UDPNameserver(bool additional_socket=false);  //!< Opens the socket. Additional sockets share the port with SO_REUSEPORT
+  DNSPacket *receive(DNSPacket *prefilled=0, UDPBatch *batch=0); //!< call this in a while or for(;;) loop to get packets
+  static void send(DNSPacket *, UDPBatch *batch=0); //!< send a DNSPacket. Will call DNSPacket::truncate() if over 512 bytes
+  static void sendWire(const string& wire, DNSPacket *q, UDPBatch *batch=0); //!< send a ready made answer to question q, as it comes from the PacketCache
   
 private:
+  static void sendBuffer(const string& buffer, DNSPacket *p, UDPBatch *batch);
+  DNSPacket *receiveBatched(DNSPacket *prefilled, UDPBatch *batch);
+  int waitForPacket();
+  DNSPacket *parsePacket(DNSPacket *prefilled, const char *mesg, int len, int sock, const ComboAddress& remote, struct msghdr *msgh);
+  bool d_additional_socket;
   vector<int> d_sockets;
   void bindIPv4();
   void bindIPv6();
+  void setReusePort(int s);
   vector<pollfd> d_rfds;
 };
 
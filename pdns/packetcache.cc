@@ -29,9 +29,11 @@
 
 extern StatBag S;
 
-PacketCache::PacketCache()
+PacketCache::PacketCache(unsigned int shards)
 {
-  pthread_rwlock_init(&d_mut, 0);
+  d_maps.resize(shards ? shards : 1);
+  d_maxEntries=0;
+  d_shards=d_maps.size();
   // d_ops = 0;
 
   d_ttl=-1;
@@ -48,10 +50,63 @@ PacketCache::PacketCache()
 
 PacketCache::~PacketCache()
 {
-  WriteLock l(&d_mut);
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    WriteLock l(mc->d_mut);
+  }
+}
+
+/* picks the shard for a question. The qname is hashed case insensitively, as lookups are */
+PacketCache::MapCombo& PacketCache::getMap(const string& qname, uint16_t qtype, CacheEntryType cet, bool meritsRecursion, bool dnssecOk)
+{
+  uint32_t hash = pdns_ihash(qname);
+  uint32_t flags = (uint32_t)qtype << 8 | (uint32_t)cet << 2 | (meritsRecursion ? 2 : 0) | (dnssecOk ? 1 : 0);
+  for(int n = 0; n < 4; ++n)
+    hash = fnvAdd(hash, (flags >> (8*n)) & 0xff);
+  return d_maps[hash % d_shards];
 }
 
 int PacketCache::get(DNSPacket *p, DNSPacket *cached)
+{
+  string value;
+  if(lookup(p, value)) {
+    if(cached->noparse(value.c_str(), value.size()) < 0) {
+      return 0;
+    }
+    cached->spoofQuestion(p); // for correct case
+    cached->qdomain=p->qdomain;
+    cached->qtype=p->qtype;
+    return 1;
+  }
+  return 0;
+}
+
+/* the fast path for UDP: no DNSPacket gets built, we patch the stored answer in place */
+int PacketCache::getWire(DNSPacket *p, string& wire)
+{
+  if(!lookup(p, wire) || wire.size() < sizeof(dnsheader))
+    return 0;
+
+  dnsheader* dh=(dnsheader*)&wire[0];
+  dh->id=p->d.id;
+  dh->rd=p->d.rd; // copy in recursion desired bit
+
+  // paste in the exact case of the question, like DNSPacket::spoofQuestion does
+  const string& question=p->getString();
+  string::size_type i=sizeof(dnsheader);
+  while(i < question.size()) {
+    unsigned int labellen=(unsigned char)question[i];
+    if(!labellen)
+      break;
+    i++;
+    if(i + labellen > question.size() || i + labellen > wire.size())
+      return 0;
+    memcpy(&wire[i], &question[i], labellen);
+    i+=labellen;
+  }
+  return 1;
+}
+
+bool PacketCache::lookup(DNSPacket *p, string& value)
 {
   extern StatBag S;
 
@@ -79,27 +134,21 @@ int PacketCache::get(DNSPacket *p, DNSPacket *cached)
   if(ntohs(p->d.qdcount)!=1) // we get confused by packets with more than one question
     return 0;
 
-  string value;
   bool haveSomething;
   {
-    TryReadLock l(&d_mut); // take a readlock here
+    MapCombo& mc=getMap(p->qdomain, p->qtype.getCode(), PacketCache::PACKETCACHE, packetMeritsRecursion, p->d_dnssecOk);
+    TryReadLock l(mc.d_mut); // take a readlock here
     if(!l.gotIt()) {
       S.inc("deferred-cache-lookup");
       return 0;
     }
 
     uint16_t maxReplyLen = p->d_tcp ? 0xffff : p->getMaxReplyLen();
-    haveSomething=getEntryLocked(p->qdomain, p->qtype, PacketCache::PACKETCACHE, value, -1, packetMeritsRecursion, maxReplyLen, p->d_dnssecOk, p->hasEDNS());
+    haveSomething=getEntryLocked(mc, p->qdomain, p->qtype, PacketCache::PACKETCACHE, value, -1, packetMeritsRecursion, maxReplyLen, p->d_dnssecOk, p->hasEDNS());
   }
   if(haveSomething) {
     (*d_statnumhit)++;
-    if(cached->noparse(value.c_str(), value.size()) < 0) {
-      return 0;
-    }
-    cached->spoofQuestion(p); // for correct case
-    cached->qdomain=p->qdomain;
-    cached->qtype=p->qtype;
-    return 1;
+    return true;
   }
 
   //  cerr<<"Packet cache miss for '"<<p->qdomain<<"', merits: "<<packetMeritsRecursion<<endl;
@@ -115,6 +164,24 @@ void PacketCache::getTTLS()
   d_doRecursion=::arg().mustDo("recursor"); 
 }
 
+/* a small cache uses fewer shards, so every shard can get at least one entry. This picks the shard for every
+   question, which is why it can't change once there are lookups going on */
+void PacketCache::setMaxEntries(unsigned int maxEntries)
+{
+  d_maxEntries=maxEntries;
+  d_shards=maxEntries ? min(maxEntries, (unsigned int)d_maps.size()) : d_maps.size();
+}
+
+//! the first shards get one entry more each, so the limits add up to max-cache-entries
+unsigned int PacketCache::maxShardEntries(unsigned int n) const
+{
+  if(!d_maxEntries)
+    return UINT_MAX;
+  if(n >= d_shards)
+    return 0;
+  return d_maxEntries / d_shards + (n < d_maxEntries % d_shards);
+}
+
 
 void PacketCache::insert(DNSPacket *q, DNSPacket *r, unsigned int maxttl)
 {
@@ -161,14 +228,15 @@ void PacketCache::insert(const string &qname, const QType& qtype, CacheEntryType
   val.zoneID = zoneID;
   val.hasEDNS = EDNS;
   
-  TryWriteLock l(&d_mut);
+  MapCombo& mc=getMap(qname, val.qtype, cet, meritsRecursion, dnssecOk);
+  TryWriteLock l(mc.d_mut);
   if(l.gotIt()) { 
     bool success;
     cmap_t::iterator place;
-    tie(place, success)=d_map.insert(val);
+    tie(place, success)=mc.d_map.insert(val);
     //    cerr<<"Insert succeeded: "<<success<<endl;
     if(!success)
-      d_map.replace(place, val);
+      mc.d_map.replace(place, val);
     
   }
   else 
@@ -178,17 +246,20 @@ void PacketCache::insert(const string &qname, const QType& qtype, CacheEntryType
 /* clears the entire packetcache. */
 int PacketCache::purge()
 {
-  WriteLock l(&d_mut);
-  int delcount=d_map.size();
-  d_map.clear();
-  *d_statnumentries=0;
+  int delcount=0;
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    WriteLock l(mc->d_mut);
+    delcount+=mc->d_map.size();
+    mc->d_map.clear();
+  }
+  delcount+=d_qc.purge();
+  updateEntryCount();
   return delcount;
 }
 
 /* purges entries from the packetcache. If match ends on a $, it is treated as a suffix */
 int PacketCache::purge(const string &match)
 {
-  WriteLock l(&d_mut);
   int delcount=0;
 
   /* ok, the suffix delete plan. We want to be able to delete everything that 
@@ -233,30 +304,37 @@ int PacketCache::purge(const string &match)
      'powerdnsiscool.com'
      'www.userpowerdns.com'
 
+     Since the shard is picked on more than just the qname, all of this happens in every shard.
   */
-  if(ends_with(match, "$")) {
-    string suffix(match);
+  bool suffixMatch=ends_with(match, "$");
+  string suffix(match);
+  if(suffixMatch)
     suffix.resize(suffix.size()-1);
-
-    cmap_t::const_iterator iter = d_map.lower_bound(tie(suffix));
-    cmap_t::const_iterator start=iter;
-    string dotsuffix = "."+suffix;
-
-    for(; iter != d_map.end(); ++iter) {
-      if(!pdns_iequals(iter->qname, suffix) && !iends_with(iter->qname, dotsuffix)) {
-        //        cerr<<"Stopping!"<<endl;
-        break;
+  string dotsuffix = "."+suffix;
+
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    WriteLock l(mc->d_mut);
+    if(suffixMatch) {
+      cmap_t::const_iterator iter = mc->d_map.lower_bound(tie(suffix));
+      cmap_t::const_iterator start=iter;
+
+      for(; iter != mc->d_map.end(); ++iter) {
+        if(!pdns_iequals(iter->qname, suffix) && !iends_with(iter->qname, dotsuffix)) {
+          //        cerr<<"Stopping!"<<endl;
+          break;
+        }
+        delcount++;
       }
-      delcount++;
+      mc->d_map.erase(start, iter);
+    }
+    else {
+      delcount+=mc->d_map.count(tie(match));
+      pair<cmap_t::iterator, cmap_t::iterator> range = mc->d_map.equal_range(tie(match));
+      mc->d_map.erase(range.first, range.second);
     }
-    d_map.erase(start, iter);
-  }
-  else {
-    delcount=d_map.count(tie(match));
-    pair<cmap_t::iterator, cmap_t::iterator> range = d_map.equal_range(tie(match));
-    d_map.erase(range.first, range.second);
   }
-  *d_statnumentries=d_map.size();
+  delcount+=d_qc.purge(match);
+  updateEntryCount();
   return delcount;
 }
 // called from ueberbackend
@@ -270,24 +348,25 @@ bool PacketCache::getEntry(const string &qname, const QType& qtype, CacheEntryTy
     cleanup();
   }
 
-  TryReadLock l(&d_mut); // take a readlock here
+  MapCombo& mc=getMap(qname, qtype.getCode(), cet, meritsRecursion, dnssecOk);
+  TryReadLock l(mc.d_mut); // take a readlock here
   if(!l.gotIt()) {
     S.inc( "deferred-cache-lookup");
     return false;
   }
 
-  return getEntryLocked(qname, qtype, cet, value, zoneID, meritsRecursion, maxReplyLen, dnssecOk, hasEDNS);
+  return getEntryLocked(mc, qname, qtype, cet, value, zoneID, meritsRecursion, maxReplyLen, dnssecOk, hasEDNS);
 }
 
 
-bool PacketCache::getEntryLocked(const string &qname, const QType& qtype, CacheEntryType cet, string& value, int zoneID, bool meritsRecursion,
+bool PacketCache::getEntryLocked(MapCombo& mc, const string &qname, const QType& qtype, CacheEntryType cet, string& value, int zoneID, bool meritsRecursion,
   unsigned int maxReplyLen, bool dnssecOK, bool hasEDNS)
 {
   uint16_t qt = qtype.getCode();
   //cerr<<"Lookup for maxReplyLen: "<<maxReplyLen<<endl;
-  cmap_t::const_iterator i=d_map.find(tie(qname, qt, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOK, hasEDNS));
+  cmap_t::const_iterator i=mc.d_map.find(tie(qname, qt, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOK, hasEDNS));
   time_t now=time(0);
-  bool ret=(i!=d_map.end() && i->ttd > now);
+  bool ret=(i!=mc.d_map.end() && i->ttd > now);
   if(ret)
     value = i->value;
   
@@ -296,55 +375,79 @@ bool PacketCache::getEntryLocked(const string &qname, const QType& qtype, CacheE
 
 map<char,int> PacketCache::getCounts()
 {
-  ReadLock l(&d_mut);
-
   map<char,int>ret;
   int recursivePackets=0, nonRecursivePackets=0, queryCacheEntries=0, negQueryCacheEntries=0;
 
-  for(cmap_t::const_iterator iter = d_map.begin() ; iter != d_map.end(); ++iter) {
-    if(iter->ctype == PACKETCACHE)
-      if(iter->meritsRecursion)
-        recursivePackets++;
-      else
-        nonRecursivePackets++;
-    else if(iter->ctype == QUERYCACHE) {
-      if(iter->value.empty())
-        negQueryCacheEntries++;
-      else
-        queryCacheEntries++;
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    ReadLock l(mc->d_mut);
+
+    for(cmap_t::const_iterator iter = mc->d_map.begin() ; iter != mc->d_map.end(); ++iter) {
+      if(iter->ctype == PACKETCACHE)
+        if(iter->meritsRecursion)
+          recursivePackets++;
+        else
+          nonRecursivePackets++;
+      else if(iter->ctype == QUERYCACHE) {
+        if(iter->value.empty())
+          negQueryCacheEntries++;
+        else
+          queryCacheEntries++;
+      }
     }
   }
   ret['!']=negQueryCacheEntries;
   ret['Q']=queryCacheEntries;
   ret['n']=nonRecursivePackets;
   ret['r']=recursivePackets;
+  d_qc.getCounts(ret);
   return ret;
 }
 
 int PacketCache::size()
 {
-  ReadLock l(&d_mut);
-  return d_map.size();
+  int ret=0;
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    ReadLock l(mc->d_mut);
+    ret+=mc->d_map.size();
+  }
+  return ret;
+}
+
+void PacketCache::updateEntryCount()
+{
+  *d_statnumentries=size();
 }
 
-/** readlock for figuring out which iterators to delete, upgrade to writelock when actually cleaning */
+//! cleans each shard in turn, under its own lock only, trimming it to its part of max-cache-entries
 void PacketCache::cleanup()
 {
-  WriteLock l(&d_mut);
+  time_t now=time(0);
+
+  DLOG(L<<"Starting cache clean"<<endl);
+  unsigned int totErased=0;
+  for(unsigned int n = 0; n < d_shards; ++n)
+    totErased+=cleanupShard(d_maps[n], maxShardEntries(n), now);
+  totErased+=d_qc.cleanup();
 
-  *d_statnumentries=d_map.size();
+  //  cerr<<"erased: "<<totErased<<endl;
+  updateEntryCount();
+  DLOG(L<<"Done with cache clean"<<endl);
+}
+
+unsigned int PacketCache::cleanupShard(MapCombo& mc, unsigned int maxCached, time_t now)
+{
+  WriteLock l(mc.d_mut);
 
-  unsigned int maxCached=::arg().asNum("max-cache-entries");
   unsigned int toTrim=0;
   
-  unsigned int cacheSize=*d_statnumentries;
+  unsigned int cacheSize=mc.d_map.size();
 
-  if(maxCached && cacheSize > maxCached) {
+  if(cacheSize > maxCached) {
     toTrim = cacheSize - maxCached;
   }
 
   unsigned int lookAt=0;
-  // two modes - if toTrim is 0, just look through 10%  of the cache and nuke everything that is expired
+  // two modes - if toTrim is 0, just look through 10%  of the shard and nuke everything that is expired
   // otherwise, scan first 5*toTrim records, and stop once we've nuked enough
   if(toTrim)
     lookAt=5*toTrim;
@@ -352,14 +455,11 @@ void PacketCache::cleanup()
     lookAt=cacheSize/10;
 
   //  cerr<<"cacheSize: "<<cacheSize<<", lookAt: "<<lookAt<<", toTrim: "<<toTrim<<endl;
-  time_t now=time(0);
-
-  DLOG(L<<"Starting cache clean"<<endl);
-  if(d_map.empty())
-    return; // clean
+  if(mc.d_map.empty())
+    return 0; // clean
 
   typedef cmap_t::nth_index<1>::type sequence_t;
-  sequence_t& sidx=d_map.get<1>();
+  sequence_t& sidx=mc.d_map.get<1>();
   unsigned int erased=0, lookedAt=0;
   for(sequence_t::iterator i=sidx.begin(); i != sidx.end(); lookedAt++) {
     if(i->ttd < now) {
@@ -375,7 +475,5 @@ void PacketCache::cleanup()
     if(lookedAt > lookAt)
       break;
   }
-  //  cerr<<"erased: "<<erased<<endl;
-  *d_statnumentries=d_map.size();
-  DLOG(L<<"Done with cache clean"<<endl);
+  return erased;
 }
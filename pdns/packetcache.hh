@@ -35,6 +35,7 @@ using namespace ::boost::multi_index;
 #include "dnspacket.hh"
 #include "lock.hh"
 #include "statbag.hh"
+#include "querycache.hh"
 
 /** This class performs 'whole packet caching'. Feed it a question packet and it will
     try to find an answer. If you have an answer, insert it to have it cached for later use. 
@@ -43,8 +44,11 @@ using namespace ::boost::multi_index;
 
     Locking! 
 
-    The cache itself is protected by a read/write lock. Because deleting is a two step process, which 
-    first marks and then sweeps, a second lock is present to prevent simultaneous inserts and deletes.
+    The cache is split into a number of shards, each protected by its own read/write lock. An entry
+    lives in the shard selected by a hash of its qname (case insensitively), qtype and flags, so 
+    concurrent lookups for different questions rarely contend. Cleanup and purges visit the shards 
+    one by one, never holding more than a single shard lock at a time. If max-cache-entries is below
+    the number of shards, only that many shards are used.
 */
 
 struct CIBackwardsStringCompare: public std::binary_function<string, string, bool>  
@@ -68,27 +72,45 @@ struct CIBackwardsStringCompare: public std::binary_function<string, string, boo
 class PacketCache : public boost::noncopyable
 {
 public:
-  PacketCache();
+  PacketCache(unsigned int shards=1024);
   ~PacketCache();
   enum CacheEntryType { PACKETCACHE, QUERYCACHE};
 
+  //! spreads maxEntries (0 for no limit) over the shards. Call this before the cache is shared between threads
+  void setMaxEntries(unsigned int maxEntries);
+  //! the part of max-cache-entries shard n may hold, UINT_MAX if there is no limit
+  unsigned int maxShardEntries(unsigned int n) const;
+  unsigned int numShards() const
+  {
+    return d_maps.size();
+  }
+
   void insert(DNSPacket *q, DNSPacket *r, unsigned int maxttl=UINT_MAX);  //!< We copy the contents of *p into our cache. Do not needlessly call this to insert questions already in the cache as it wastes resources
 
   void insert(const string &qname, const QType& qtype, CacheEntryType cet, const string& value, unsigned int ttl, int zoneID=-1, bool meritsRecursion=false,
     unsigned int maxReplyLen=512, bool dnssecOk=false, bool EDNS=false);
 
   int get(DNSPacket *p, DNSPacket *q); //!< We return a dynamically allocated copy out of our cache. You need to delete it. You also need to spoof in the right ID with the DNSPacket.spoofID() method.
+  int getWire(DNSPacket *p, string& wire); //!< Like get(), but hands back the cached answer ready to be sent to p, with ID, RD bit and question case patched in
   bool getEntry(const string &content, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1, 
     bool meritsRecursion=false, unsigned int maxReplyLen=512, bool dnssecOk=false, bool hasEDNS=false);
 
   int size(); //!< number of entries in the cache
   void cleanup(); //!< force the cache to preen itself from expired packets
-  int purge();
+  int purge(); //!< also purges the query cache
   int purge(const string &match);
 
   map<char,int> getCounts();
+
+  //! the UeberBackend query cache, which is cleaned, purged and counted along with us
+  QueryCache& queryCache()
+  {
+    return d_qc;
+  }
 private:
-  bool getEntryLocked(const string &content, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1, 
+  struct MapCombo;
+  bool lookup(DNSPacket *p, string& value);
+  bool getEntryLocked(MapCombo& mc, const string &content, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1, 
     bool meritsRecursion=false, unsigned int maxReplyLen=512, bool dnssecOk=false, bool hasEDNS=false);
   struct CacheEntry
   {
@@ -131,9 +153,20 @@ private:
   > cmap_t;
 
 
-  cmap_t d_map;
+  struct MapCombo
+  {
+    ShardRWLock d_mut;
+    cmap_t d_map;
+  };
+
+  MapCombo& getMap(const string& qname, uint16_t qtype, CacheEntryType cet, bool meritsRecursion, bool dnssecOk);
+  unsigned int cleanupShard(MapCombo& mc, unsigned int maxCached, time_t now);
+  void updateEntryCount();
 
-  pthread_rwlock_t d_mut;
+  vector<MapCombo> d_maps;
+  unsigned int d_maxEntries;
+  unsigned int d_shards; //!< shards in use, fewer than d_maps.size() if max-cache-entries is smaller
+  QueryCache d_qc;
 
   AtomicCounter d_ops;
   int d_ttl;
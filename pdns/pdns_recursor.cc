@@ -64,6 +64,11 @@
 #include "config.h"
 #include "lua-recursor.hh"
 #include "version.hh"
+#include "histogram.hh"
+#include "spscring.hh"
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #ifndef RECURSOR
 #include "statbag.hh"
@@ -83,6 +88,26 @@ __thread shared_ptr<Regex>* t_traceRegex;
 
 RecursorControlChannel s_rcc; // only active in thread 0
 
+//! a UDP question handed from the distributing thread to a worker, see distributeUDPQuestion
+struct DistributedQuestion
+{
+  ComboAddress remote;
+  int fd;
+  unsigned int len;
+  char data[1500];
+};
+typedef SPSCRing<DistributedQuestion> questionring_t;
+
+//! answers to coalesced queries, handed to a thread by the threads that sent them, see finishInflightQuery
+struct InflightAnswers
+{
+  InflightAnswers() : reserved(0) { pthread_mutex_init(&lock, 0); }
+  pthread_mutex_t lock;
+  deque<pair<PacketID, string> > answers;
+  unsigned int reserved; // answers this thread waits for, queued or not, never more than s_maxInflightAnswers
+};
+static const unsigned int s_maxInflightAnswers=1024;
+
 // for communicating with our threads
 struct ThreadPipeSet
 {
@@ -90,6 +115,12 @@ struct ThreadPipeSet
   int readToThread;
   int writeFromThread;
   int readFromThread;
+  questionring_t* questions; // only with pdns-distributes-queries
+  int writeQuestionWakeup;   // an eventfd where available, so both ends can be the same fd
+  int readQuestionWakeup;
+  InflightAnswers* inflightAnswers; // only with coalesce-outgoing-queries
+  int writeAnswerWakeup;     // same as the question wakeup
+  int readAnswerWakeup;
 };
 
 vector<ThreadPipeSet> g_pipes; // effectively readonly after startup
@@ -115,6 +146,7 @@ typedef vector<int> tcpListenSockets_t;
 tcpListenSockets_t g_tcpListenSockets;   // shared across threads, but this is fine, never written to from a thread. All threads listen on all sockets
 int g_tcpTimeout;
 unsigned int g_maxMThreads;
+unsigned int g_udpSourcePoolSize, g_udpSourcePoolMaxUses, g_udpSourcePoolMaxAge; // pooling is off if the size is 0
 struct timeval g_now; // timestamp, updated (too) frequently
 map<int, ComboAddress> g_listenSocketsAddresses; // is shared across all threads right now
 
@@ -261,10 +293,28 @@ static void setSocketSendBuffer(int fd, uint32_t size)
 // you can ask this class for a UDP socket to send a query from
 // this socket is not yours, don't even think about deleting it
 // but after you call 'returnSocket' on it, don't assume anything anymore
+
+// Normally every query gets a fresh socket, connected to the server. With udp-source-pool-size set, queries are
+// instead sent from a small pool of unconnected sockets per address family, each on its own random port, and answers
+// are matched on id, remote address and port. To keep ports hard to guess, a pooled socket is retired after
+// udp-source-pool-max-uses queries or udp-source-pool-max-age seconds, and closed once its last query is done.
 class UDPClientSocks
 {
   unsigned int d_numsocks;
   unsigned int d_maxsocks;
+
+  struct PooledSocket
+  {
+    int family;
+    unsigned int uses;
+    unsigned int inflight;
+    time_t created;
+    bool retired;
+  };
+  typedef map<int, PooledSocket> pooled_t;
+  pooled_t d_pooled;
+  vector<int> d_pool[2]; // sockets new queries can go out on, IPv4 and IPv6
+
 public:
   UDPClientSocks() : d_numsocks(0), d_maxsocks(5000)
   {
@@ -273,9 +323,17 @@ public:
   typedef set<int> socks_t;
   socks_t d_socks;
 
+  bool isPooled(int fd) const
+  {
+    return d_pooled.count(fd);
+  }
+
   // returning -1 means: temporary OS error (ie, out of files), -2 means OS error
   int getSocket(const ComboAddress& toaddr, int* fd)
   {
+    if(g_udpSourcePoolSize)
+      return getPooledSocket(toaddr.sin4.sin_family, fd);
+
     *fd=makeClientSocket(toaddr.sin4.sin_family);
     if(*fd < 0) // temporary error - receive exception otherwise
       return -1;
@@ -298,7 +356,14 @@ public:
   {
     socks_t::iterator i=d_socks.find(fd);
     if(i==d_socks.end()) {
-      throw PDNSException("Trying to return a socket (fd="+lexical_cast<string>(fd)+") not in the pool");
+      pooled_t::iterator j=d_pooled.find(fd);
+      if(j==d_pooled.end())
+        throw PDNSException("Trying to return a socket (fd="+lexical_cast<string>(fd)+") not in the pool");
+      if(j->second.inflight)
+        --j->second.inflight;
+      if(j->second.retired && !j->second.inflight)
+        closePooledSocket(j);
+      return;
     }
     returnSocketLocked(i);
   }
@@ -321,6 +386,49 @@ public:
     --d_numsocks;
   }
 
+  int getPooledSocket(int family, int* fd)
+  {
+    vector<int>& pool=d_pool[family == AF_INET6];
+
+    if(pool.size() < g_udpSourcePoolSize) {
+      *fd=makeClientSocket(family);
+      if(*fd < 0)
+        return -1;
+      PacketID pident;
+      pident.fd=*fd;
+      t_fdm->addReadFD(*fd, handleUDPServerResponse, pident);
+      PooledSocket ps;
+      ps.family=family;
+      ps.uses=ps.inflight=0;
+      ps.created=g_now.tv_sec;
+      ps.retired=false;
+      d_pooled[*fd]=ps;
+      pool.push_back(*fd);
+    }
+    else
+      *fd=pool[dns_random(pool.size())];
+
+    PooledSocket& ps=d_pooled[*fd];
+    ps.inflight++;
+    if(++ps.uses >= g_udpSourcePoolMaxUses || g_now.tv_sec - ps.created >= (time_t)g_udpSourcePoolMaxAge) {
+      // this is the last query for this socket, the next one gets a fresh port
+      ps.retired=true;
+      pool.erase(find(pool.begin(), pool.end(), *fd));
+    }
+    return 0;
+  }
+
+  void closePooledSocket(pooled_t::iterator& i)
+  {
+    try {
+      t_fdm->removeReadFD(i->first);
+    }
+    catch(FDMultiplexerException& e) {
+    }
+    Utility::closesocket(i->first);
+    d_pooled.erase(i++);
+  }
+
   // returns -1 for errors which might go away, throws for ones that won't
   static int makeClientSocket(int family)
   {
@@ -358,6 +466,161 @@ public:
 
 static __thread UDPClientSocks* t_udpclientsocks;
 
+//! what this thread has seen, merged over all threads by 'rec_control get-latency'
+struct RecLatencies
+{
+  typedef map<ComboAddress, LatencyHistogram, ComboAddress::addressOnlyLessThan> servers_t;
+  LatencyHistogram packetCache, cache, resolve, outgoing;
+  servers_t servers;
+};
+static __thread RecLatencies* t_latencies;
+static const unsigned int s_maxLatencyServers=1000;
+
+static uint64_t usecSince(const struct timeval& then)
+{
+  struct timeval now;
+  Utility::gettimeofday(&now, 0);
+  int64_t diff=(now.tv_sec - then.tv_sec)*1000000LL + (now.tv_usec - then.tv_usec);
+  return diff > 0 ? diff : 0;
+}
+
+void submitOutgoingLatency(const ComboAddress& server, uint64_t usec)
+{
+  t_latencies->outgoing.submit(usec);
+  RecLatencies::servers_t::iterator iter=t_latencies->servers.find(server);
+  if(iter != t_latencies->servers.end())
+    iter->second.submit(usec);
+  else if(t_latencies->servers.size() < s_maxLatencyServers)
+    t_latencies->servers[server].submit(usec);
+}
+
+LatencyHistogram* pleaseGetLatencyHistogram(const std::string& which)
+{
+  if(which=="packetcache")
+    return new LatencyHistogram(t_latencies->packetCache);
+  if(which=="cache")
+    return new LatencyHistogram(t_latencies->cache);
+  if(which=="resolve")
+    return new LatencyHistogram(t_latencies->resolve);
+  if(which=="outgoing")
+    return new LatencyHistogram(t_latencies->outgoing);
+
+  RecLatencies::servers_t::const_iterator iter=t_latencies->servers.find(ComboAddress(which, 53));
+  if(iter == t_latencies->servers.end())
+    return 0;
+  return new LatencyHistogram(iter->second);
+}
+
+/* With coalesce-outgoing-queries, identical queries from different threads to the same server are sent only once.
+   The thread that sends the query owns its entry in g_inflight. Other threads add themselves there as waiters, and
+   the owner queues the answer for them in their InflightAnswers. If the owner gets no answer, the waiters just time out.
+   The owner never blocks on a waiter, as two threads doing that to each other would deadlock. Instead every waiter
+   reserves room for its answer when it joins, and a thread with s_maxInflightAnswers reserved sends its own query. */
+struct InflightQuery
+{
+  unsigned int owner;
+  time_t ttd; // after this, the owner is assumed to have abandoned the entry
+  vector<pair<unsigned int, uint16_t> > waiters; // thread and query id
+};
+typedef tuple<ComboAddress, string, uint16_t> inflightkey_t;
+typedef map<inflightkey_t, InflightQuery> inflight_t;
+static inflight_t g_inflight;
+static pthread_mutex_t g_inflightlock = PTHREAD_MUTEX_INITIALIZER;
+bool g_coalesceQueries;
+
+// gives back the room reserved for answers that are not coming
+static void releaseInflightAnswers(const vector<pair<unsigned int, uint16_t> >& waiters)
+{
+  for(vector<pair<unsigned int, uint16_t> >::const_iterator i=waiters.begin(); i != waiters.end(); ++i) {
+    InflightAnswers* ia=g_pipes[i->first].inflightAnswers;
+    Lock l(&ia->lock);
+    ia->reserved--;
+  }
+}
+
+// returns true if another thread has this query outstanding already, and will pass us the answer
+static bool joinInflightQuery(const PacketID& pident)
+{
+  inflightkey_t key(pident.remote, toLower(pident.domain), pident.type);
+  Lock l(&g_inflightlock);
+  inflight_t::iterator i=g_inflight.find(key);
+  if(i != g_inflight.end() && i->second.ttd > g_now.tv_sec) {
+    if(i->second.owner == t_id) // the owner already chains these itself
+      return false;
+    InflightAnswers* ia=g_pipes[t_id].inflightAnswers;
+    Lock al(&ia->lock);
+    if(ia->reserved >= s_maxInflightAnswers) // we are far behind on answers already, resolve this one ourselves
+      return false;
+    ia->reserved++;
+    i->second.waiters.push_back(make_pair(t_id, pident.id));
+    return true;
+  }
+  InflightQuery& iq=g_inflight[key];
+  iq.owner=t_id;
+  iq.ttd=g_now.tv_sec + g_networkTimeoutMsec/1000 + 1;
+  releaseInflightAnswers(iq.waiters); // of an abandoned entry
+  iq.waiters.clear();
+  return false;
+}
+
+static void handleInflightAnswers(int fd, FDMultiplexer::funcparam_t& var)
+{
+  uint64_t buf[16];
+  while(read(fd, buf, sizeof(buf)) == sizeof(buf))
+    ;
+
+  InflightAnswers* ia=g_pipes[t_id].inflightAnswers;
+  deque<pair<PacketID, string> > answers;
+  {
+    Lock l(&ia->lock);
+    answers.swap(ia->answers);
+    ia->reserved-=answers.size();
+  }
+  for(deque<pair<PacketID, string> >::const_iterator i=answers.begin(); i != answers.end(); ++i)
+    MT->sendEvent(i->first, &i->second);
+}
+
+// called by the owner when its query is done, pass the answer if there was a good one
+static void finishInflightQuery(const PacketID& pident, const string* packet)
+{
+  if(!g_coalesceQueries)
+    return;
+
+  vector<pair<unsigned int, uint16_t> > waiters;
+  {
+    Lock l(&g_inflightlock);
+    inflight_t::iterator i=g_inflight.find(inflightkey_t(pident.remote, toLower(pident.domain), pident.type));
+    if(i == g_inflight.end() || i->second.owner != t_id)
+      return;
+    waiters.swap(i->second.waiters);
+    g_inflight.erase(i);
+  }
+  if(!packet) {
+    releaseInflightAnswers(waiters);
+    return;
+  }
+
+  PacketID resend;
+  resend.remote=pident.remote;
+  resend.domain=pident.domain;
+  resend.type=pident.type;
+  resend.fd=-1;
+  for(vector<pair<unsigned int, uint16_t> >::const_iterator i=waiters.begin(); i != waiters.end(); ++i) {
+    resend.id=i->second;
+    g_stats.coalescedQueries++;
+    ThreadPipeSet& tps=g_pipes[i->first];
+    bool wasEmpty;
+    {
+      Lock l(&tps.inflightAnswers->lock); // room for this was reserved in joinInflightQuery
+      wasEmpty=tps.inflightAnswers->answers.empty();
+      tps.inflightAnswers->answers.push_back(make_pair(resend, *packet));
+    }
+    uint64_t one=1;
+    if(wasEmpty && write(tps.writeAnswerWakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      unixDie("write to inflight answer wakeup returned error");
+  }
+}
+
 /* these two functions are used by LWRes */
 // -2 is OS error, -1 is error that depends on the remote, > 0 is success
 int asendto(const char *data, int len, int flags, 
@@ -385,20 +648,33 @@ int asendto(const char *data, int len, int flags,
     }
   }
 
+  pident.id=id;
+  if(g_coalesceQueries && joinInflightQuery(pident)) {
+    *fd=-1; // another thread sends this one, and will wake us up like a chained waiter
+    return 1;
+  }
+
   int ret=t_udpclientsocks->getSocket(toaddr, fd);
-  if(ret < 0)
+  if(ret < 0) {
+    finishInflightQuery(pident, 0);
     return ret;
+  }
 
   pident.fd=*fd;
-  pident.id=id;
   
-  t_fdm->addReadFD(*fd, handleUDPServerResponse, pident);
-  ret = send(*fd, data, len, 0);
+  if(t_udpclientsocks->isPooled(*fd)) // pooled sockets are not connected, and are always being watched
+    ret = sendto(*fd, data, len, 0, (struct sockaddr*)&toaddr, toaddr.getSocklen());
+  else {
+    t_fdm->addReadFD(*fd, handleUDPServerResponse, pident);
+    ret = send(*fd, data, len, 0);
+  }
 
   int tmp = errno;
 
-  if(ret < 0)
+  if(ret < 0) {
     t_udpclientsocks->returnSocket(*fd);
+    finishInflightQuery(pident, 0);
+  }
 
   errno = tmp; // this is for logging purposes only
   return ret;
@@ -423,20 +699,29 @@ int arecvfrom(char *data, int len, int flags, const ComboAddress& fromaddr, int
   int ret=MT->waitEvent(pident, &packet, g_networkTimeoutMsec, now);
 
   if(ret > 0) {
-    if(packet.empty()) // means "error"
+    if(packet.empty()) { // means "error"
+      if(fd >= 0)
+        finishInflightQuery(pident, 0);
       return -1; 
+    }
 
     *d_len=(int)packet.size();
     memcpy(data,packet.c_str(),min(len,*d_len));
     if(*nearMissLimit && pident.nearMisses > *nearMissLimit) {
       L<<Logger::Error<<"Too many ("<<pident.nearMisses<<" > "<<*nearMissLimit<<") bogus answers for '"<<domain<<"' from "<<fromaddr.toString()<<", assuming spoof attempt."<<endl;
       g_stats.spoofCount++;
+      if(fd >= 0)
+        finishInflightQuery(pident, 0);
       return -1;
     }
+    if(fd >= 0)
+      finishInflightQuery(pident, &packet);
   }
   else {
-    if(fd >= 0)
+    if(fd >= 0) {
       t_udpclientsocks->returnSocket(fd);
+      finishInflightQuery(pident, 0);
+    }
   }
   return ret;
 }
@@ -488,6 +773,31 @@ void updateRcodeStats(int res)
   }
 }
 
+// resolves a popular record again before it expires, so clients keep getting it from the cache
+static void doPrefetch(void* p)
+{
+  SyncRes::prefetches_t::value_type* pf=(SyncRes::prefetches_t::value_type*)p;
+  try {
+    struct timeval now;
+    Utility::gettimeofday(&now, 0);
+    SyncRes sr(now);
+    sr.setId(MT->getTid());
+    sr.setRefresh();
+    vector<DNSResourceRecord> ret;
+    sr.beginResolve(pf->first, pf->second, QClass::IN, ret);
+  }
+  catch(PDNSException& ae) {
+    L<<Logger::Error<<"Problem prefetching '"<<pf->first<<"|"<<pf->second.getName()<<"': "<<ae.reason<<endl;
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"STL error prefetching '"<<pf->first<<"|"<<pf->second.getName()<<"': "<<e.what()<<endl;
+  }
+  catch(...) {
+    L<<Logger::Error<<"Any other exception prefetching '"<<pf->first<<"|"<<pf->second.getName()<<"'"<<endl;
+  }
+  delete pf;
+}
+
 void startDoResolve(void *p)
 {
   DNSComboWriter* dc=(DNSComboWriter *)p;
@@ -498,8 +808,10 @@ void startDoResolve(void *p)
     loginfo=" ("+dc->d_mdp.d_qname+"/"+lexical_cast<string>(dc->d_mdp.d_qtype)+" from "+(dc->d_remote.toString())+")";
     uint32_t maxanswersize= dc->d_tcp ? 65535 : min((uint16_t) 512, g_udpTruncationThreshold);
     EDNSOpts edo;
+    uint16_t ednsSize=0;
     if(getEDNSOpts(dc->d_mdp, &edo) && !dc->d_tcp) {
       maxanswersize = min(edo.d_packetsize, g_udpTruncationThreshold);
+      ednsSize = edo.d_packetsize;
     }
     
     vector<DNSResourceRecord> ret;
@@ -618,7 +930,7 @@ void startDoResolve(void *p)
     if(!dc->d_tcp) {
       sendto(dc->d_socket, (const char*)&*packet.begin(), packet.size(), 0, (struct sockaddr *)(&dc->d_remote), dc->d_remote.getSocklen());
       if(!SyncRes::s_nopacketcache && !variableAnswer ) {
-        t_packetCache->insertResponsePacket(string((const char*)&*packet.begin(), packet.size()), g_now.tv_sec, 
+        t_packetCache->insertResponsePacket(string((const char*)&*packet.begin(), packet.size()), ednsSize, g_now.tv_sec, 
                                            min(minTTL, 
                                                (pw.getHeader()->rcode == RCode::ServFail) ? SyncRes::s_packetcacheservfailttl : SyncRes::s_packetcachettl
                                                ) 
@@ -668,6 +980,14 @@ void startDoResolve(void *p)
     }
 
     sr.d_outqueries ? t_RC->cacheMisses++ : t_RC->cacheHits++; 
+    (sr.d_outqueries ? t_latencies->resolve : t_latencies->cache).submit(usecSince(dc->d_now));
+
+    BOOST_FOREACH(const SyncRes::prefetches_t::value_type& pf, sr.getPrefetches()) {
+      if(MT->numProcesses() >= g_maxMThreads)
+        break;
+      g_stats.prefetches++;
+      MT->makeThread(doPrefetch, new SyncRes::prefetches_t::value_type(pf));
+    }
     float spent=makeFloat(sr.d_now-dc->d_now);
     if(spent < 0.001)
       g_stats.answers0_1++;
@@ -858,22 +1178,21 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
   if(fromaddr.sin4.sin_family==AF_INET6)
      g_stats.ipv6qcounter++;
 
-  string response;
   try {
-    uint32_t age;
-    if(!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(question, g_now.tv_sec, &response, &age)) {
+    const string* response;
+    if(!SyncRes::s_nopacketcache && t_packetCache->getResponsePacket(question, g_now.tv_sec, &response)) {
       if(!g_quiet)
         L<<Logger::Error<<t_id<< " question answered from packet cache from "<<fromaddr.toString()<<endl;
 
       g_stats.packetCacheHits++;
       SyncRes::s_queries++;
-      ageDNSPacket(response, age);
-      sendto(fd, response.c_str(), response.length(), 0, (struct sockaddr*) &fromaddr, fromaddr.getSocklen());
-      if(response.length() >= sizeof(struct dnsheader)) {
+      sendto(fd, response->c_str(), response->length(), 0, (struct sockaddr*) &fromaddr, fromaddr.getSocklen());
+      if(response->length() >= sizeof(struct dnsheader)) {
         struct dnsheader dh;
-        memcpy(&dh, response.c_str(), sizeof(dh));
+        memcpy(&dh, response->c_str(), sizeof(dh));
         updateRcodeStats(dh.rcode);
       }
+      t_latencies->packetCache.submit(usecSince(g_now));
       g_stats.avgLatencyUsec=(uint64_t)((1-0.0001)*g_stats.avgLatencyUsec + 0); // we assume 0 usec
       return 0;
     }
@@ -898,6 +1217,58 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
   return 0;
 } 
  
+/* With pdns-distributes-queries, questions travel to the workers through a ring per worker instead of the thread pipes,
+   which saves a ThreadMSG, a boost::function and a string allocation as well as a write and a read for every query.
+   The worker only needs to be woken when its ring goes from empty to non-empty, it drains the ring once awake. */
+static void distributeUDPQuestion(const char* data, unsigned int len, const ComboAddress& fromaddr, int fd)
+{
+  static unsigned int counter;
+  unsigned int target = 1 + (++counter % (g_pipes.size()-1));
+  ThreadPipeSet& tps = g_pipes[target];
+
+  DistributedQuestion* slot = tps.questions->getWriteSlot();
+  if(!slot) { // worker is far behind, queue it the slow way
+    g_stats.questionRingFull++;
+    asyncFunctionToThread(target, boost::bind(doProcessUDPQuestion, string(data, len), fromaddr, fd));
+    return;
+  }
+  slot->remote = fromaddr;
+  slot->fd = fd;
+  slot->len = len;
+  memcpy(slot->data, data, len);
+
+  if(tps.questions->publish()) {
+    uint64_t one=1;
+    if(write(tps.writeQuestionWakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      unixDie("write to question ring wakeup returned error");
+  }
+}
+
+static void handleQuestionRing(int fd, FDMultiplexer::funcparam_t& var)
+{
+  uint64_t buf[16];
+  while(read(fd, buf, sizeof(buf)) == sizeof(buf)) // a pipe may hold more than one wakeup, an eventfd holds one counter
+    ;
+
+  // don't starve our own sockets and mthreads when the distributor keeps up with us
+  static const unsigned int maxPerWakeup=64;
+  ThreadPipeSet& tps = g_pipes[t_id];
+  DistributedQuestion* slot;
+  for(unsigned int n=0; n < maxPerWakeup && (slot = tps.questions->getReadSlot()); ++n) {
+    string question(slot->data, slot->len);
+    ComboAddress remote = slot->remote;
+    int replyfd = slot->fd;
+    tps.questions->release(); // before processing, so the distributor can reuse the slot while we work
+    doProcessUDPQuestion(question, remote, replyfd);
+  }
+
+  if(tps.questions->getReadSlot()) { // the distributor only wakes us when the ring was empty, so wake ourselves
+    uint64_t one=1;
+    if(write(tps.writeQuestionWakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      unixDie("write to question ring wakeup returned error");
+  }
+}
+
 void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 {
   int len;
@@ -927,11 +1298,10 @@ void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
           L<<Logger::Error<<"Ignoring non-query opcode "<<dh->opcode<<" from "<<fromaddr.toString()<<" on server socket!"<<endl;
       }
       else {
-        string question(data, len);
         if(g_weDistributeQueries)
-          distributeAsyncFunction(boost::bind(doProcessUDPQuestion, question, fromaddr, fd));
+          distributeUDPQuestion(data, len, fromaddr, fd);
         else
-          doProcessUDPQuestion(question, fromaddr, fd);
+          doProcessUDPQuestion(string(data, len), fromaddr, fd);
       }
     }
     catch(MOADNSException& mde) {
@@ -1101,6 +1471,18 @@ void usr2Handler(int)
 
 }
 
+static __thread uint64_t t_housekeepingUsec;
+
+uint64_t* pleaseGetHousekeepingUsec()
+{
+  return new uint64_t(t_housekeepingUsec);
+}
+
+static string* pleaseGetHousekeepingMsec()
+{
+  return new string(" "+lexical_cast<string>(t_id)+":"+lexical_cast<string>(t_housekeepingUsec/1000));
+}
+
 void doStats(void)
 {
   static time_t lastOutputTime;
@@ -1111,8 +1493,8 @@ void doStats(void)
     uint64_t cacheMisses = broadcastAccFunction<uint64_t>(pleaseGetCacheMisses);
     
     L<<Logger::Warning<<"stats: "<<g_stats.qcounter<<" questions, "<<
-      broadcastAccFunction<uint64_t>(pleaseGetCacheSize)<< " cache entries, "<<
-      broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize)<<" negative entries, "<<
+      cacheAccFunction(pleaseGetCacheSize)<< (t_RC->isShared() ? " shared" : "") << " cache entries, "<<
+      cacheAccFunction(pleaseGetNegCacheSize)<<" negative entries, "<<
       (int)((cacheHits*100.0)/(cacheHits+cacheMisses))<<"% cache hits"<<endl; 
     
     L<<Logger::Warning<<"stats: throttle map: "
@@ -1123,6 +1505,7 @@ void doStats(void)
      <<SyncRes::s_nodelegated<<" no-delegation drops"<<endl;
     L<<Logger::Warning<<"stats: "<<SyncRes::s_tcpoutqueries<<" outgoing tcp connections, "<<
       broadcastAccFunction<uint64_t>(pleaseGetConcurrentQueries)<<" queries running, "<<SyncRes::s_outgoingtimeouts<<" outgoing timeouts"<<endl;
+    L<<Logger::Warning<<"stats: msec spent in housekeeping per thread:"<<broadcastAccFunction<string>(pleaseGetHousekeepingMsec)<<endl;
 
     //L<<Logger::Warning<<"stats: "<<g_stats.ednsPingMatches<<" ping matches, "<<g_stats.ednsPingMismatches<<" mismatches, "<<
       //g_stats.noPingOutQueries<<" outqueries w/o ping, "<< g_stats.noEdnsOutQueries<<" w/o EDNS"<<endl;
@@ -1143,11 +1526,45 @@ void doStats(void)
   statsWanted=false;
 }
 
+/* Looks at a slice of nsSpeeds, so that all of it is seen every 40 prunes, which is how often the whole map used
+   to be scanned. We continue after the name we stopped at the last time, wrapping around at the end. */
+static void pruneNSSpeeds(time_t limit)
+{
+  static __thread string* t_cursor;
+  if(!t_cursor)
+    t_cursor=new string();
+
+  SyncRes::nsspeeds_t& nsSpeeds=t_sstorage->nsSpeeds;
+  unsigned int slice=min(nsSpeeds.size()/40 + 100, nsSpeeds.size());
+  SyncRes::nsspeeds_t::iterator i=nsSpeeds.upper_bound(*t_cursor);
+  for(unsigned int n=0; n < slice && !nsSpeeds.empty(); ++n) {
+    if(i == nsSpeeds.end())
+      i=nsSpeeds.begin();
+    if(i->second.stale(limit))
+      nsSpeeds.erase(i++);
+    else
+      ++i;
+  }
+  if(i == nsSpeeds.end())
+    t_cursor->clear();
+  else
+    *t_cursor=i->first;
+}
+
+// prunes towards maxEntries, but never more than 10000 entries at a time
+static void pruneNegCache(unsigned int maxEntries)
+{
+  SyncRes::negcache_t& negcache=*t_sstorage->negcache;
+  unsigned int target=maxEntries;
+  if(negcache.size() > maxEntries + 10000)
+    target=negcache.size() - 10000;
+  pruneCollection(negcache, target, 200);
+}
+
 static void houseKeeping(void *)
 try
 {
   static __thread time_t last_stat, last_rootupdate, last_prune;
-  static __thread int cleanCounter=0;
   struct timeval now;
   Utility::gettimeofday(&now, 0);
 
@@ -1156,20 +1573,22 @@ try
   if(now.tv_sec - last_prune > (time_t)(5 + t_id)) { 
     DTime dt;
     dt.setTimeval(now);
-    t_RC->doPrune(); // this function is local to a thread, so fine anyhow
     t_packetCache->doPruneTo(::arg().asNum("max-packetcache-entries") / g_numThreads);
-    
-    pruneCollection(t_sstorage->negcache, ::arg().asNum("max-cache-entries") / (g_numThreads * 10), 200);
-    
-    if(!((cleanCounter++)%40)) {  // this is a full scan!
-      time_t limit=now.tv_sec-300;
-      for(SyncRes::nsspeeds_t::iterator i = t_sstorage->nsSpeeds.begin() ; i!= t_sstorage->nsSpeeds.end(); )
-        if(i->second.stale(limit))
-          t_sstorage->nsSpeeds.erase(i++);
-        else
-          ++i;
+
+    if(t_RC->isShared()) { // every thread takes care of its own part of the shards, thread 0 does the negcache
+      t_RC->doPrune(t_id, g_numThreads);
+      if(!t_id) {
+        Lock l(t_sstorage->negcachelock);
+        pruneNegCache(::arg().asNum("max-cache-entries") / 10);
+      }
+    }
+    else {
+      t_RC->doPrune(); // this function is local to a thread, so fine anyhow
+      pruneNegCache(::arg().asNum("max-cache-entries") / (g_numThreads * 10));
     }
-//    L<<Logger::Warning<<"Spent "<<dt.udiff()/1000<<" msec cleaning"<<endl;
+    
+    pruneNSSpeeds(now.tv_sec-300);
+    t_housekeepingUsec+=dt.udiff();
     last_prune=time(0);
   }
   
@@ -1178,6 +1597,7 @@ try
       doStats();
       last_stat=time(0);
     }
+    checkRootMirror(now.tv_sec);
   }
   
   if(now.tv_sec - last_rootupdate > 7200) {
@@ -1202,6 +1622,24 @@ catch(PDNSException& ae)
 }
 ;
 
+// a non-blocking wakeup, an eventfd where available
+static void makeWakeup(int& readfd, int& writefd)
+{
+#ifdef __linux__
+  readfd = writefd = eventfd(0, EFD_NONBLOCK);
+  if(readfd < 0)
+    unixDie("Creating eventfd for inter-thread communications");
+#else
+  int fd[2];
+  if(pipe(fd) < 0)
+    unixDie("Creating pipe for inter-thread communications");
+  Utility::setNonBlocking(fd[0]);
+  Utility::setNonBlocking(fd[1]);
+  readfd = fd[0];
+  writefd = fd[1];
+#endif
+}
+
 void makeThreadPipes()
 {
   for(unsigned int n=0; n < g_numThreads; ++n) {
@@ -1217,7 +1655,21 @@ void makeThreadPipes()
       unixDie("Creating pipe for inter-thread communications");
     tps.readFromThread = fd[0];
     tps.writeFromThread = fd[1];
-    
+
+    tps.questions = 0;
+    tps.readQuestionWakeup = tps.writeQuestionWakeup = -1;
+    if(g_weDistributeQueries && n) {
+      tps.questions = new questionring_t(::arg().asNum("distribution-ring-size"));
+      makeWakeup(tps.readQuestionWakeup, tps.writeQuestionWakeup);
+    }
+
+    tps.inflightAnswers = 0;
+    tps.readAnswerWakeup = tps.writeAnswerWakeup = -1;
+    if(g_coalesceQueries) {
+      tps.inflightAnswers = new InflightAnswers();
+      makeWakeup(tps.readAnswerWakeup, tps.writeAnswerWakeup);
+    }
+
     g_pipes.push_back(tps);
   }
 }
@@ -1264,6 +1716,11 @@ void distributeAsyncFunction(const pipefunc_t& func)
     func();
     return;
   }
+  asyncFunctionToThread(target, func);
+}
+
+void asyncFunctionToThread(unsigned int target, const pipefunc_t& func)
+{
   ThreadPipeSet& tps = g_pipes[target];    
   ThreadMSG* tmsg = new ThreadMSG();
   tmsg->func = func;
@@ -1271,7 +1728,6 @@ void distributeAsyncFunction(const pipefunc_t& func)
   
   if(write(tps.writeToThread, &tmsg, sizeof(tmsg)) != sizeof(tmsg))
     unixDie("write to thread pipe returned wrong size or error");
-    
 }
 
 void handlePipeRequest(int fd, FDMultiplexer::funcparam_t& var)
@@ -1343,6 +1799,22 @@ template<class T> T broadcastAccFunction(const boost::function<T*()>& func, bool
 template string broadcastAccFunction(const boost::function<string*()>& fun, bool skipSelf); // explicit instantiation
 template uint64_t broadcastAccFunction(const boost::function<uint64_t*()>& fun, bool skipSelf); // explicit instantiation
 template vector<ComboAddress> broadcastAccFunction(const boost::function<vector<ComboAddress> *()>& fun, bool skipSelf); // explicit instantiation
+template LatencyHistogram broadcastAccFunction(const boost::function<LatencyHistogram *()>& fun, bool skipSelf); // explicit instantiation
+template RecursorLuaStats broadcastAccFunction(const boost::function<RecursorLuaStats *()>& fun, bool skipSelf); // explicit instantiation
+
+/* for questions about the record and negative caches. If those are shared, every thread would give the same answer, so we only ask ourselves */
+uint64_t cacheAccFunction(const boost::function<uint64_t*()>& func)
+{
+  if(!t_RC->isShared())
+    return broadcastAccFunction<uint64_t>(func);
+
+  uint64_t* resp=func();
+  if(!resp)
+    return 0;
+  uint64_t ret=*resp;
+  delete resp;
+  return ret;
+}
 
 void handleRCC(int fd, FDMultiplexer::funcparam_t& var)
 {
@@ -1451,6 +1923,9 @@ void handleUDPServerResponse(int fd, FDMultiplexer::funcparam_t& var)
           ": packet smaller than DNS header"<<endl;
     }
 
+    if(t_udpclientsocks->isPooled(fd)) // many queries share this socket, we can't tell which one this was for
+      return;
+
     t_udpclientsocks->returnSocket(fd);
     string empty;
 
@@ -1569,6 +2044,13 @@ string* doReloadLuaScript()
   return new string("(re)loaded '"+fname+"'\n");
 }
 
+RecursorLuaStats* pleaseGetLuaStats()
+{
+  if(!t_pdl->get())
+    return 0;
+  return new RecursorLuaStats((*t_pdl)->getStats());
+}
+
 string doQueueReloadLuaScript(vector<string>::const_iterator begin, vector<string>::const_iterator end)
 {
   if(begin != end) 
@@ -1774,6 +2256,17 @@ int serviceMain(int argc, char*argv[])
 
   SyncRes::s_nopacketcache = ::arg().mustDo("disable-packetcache");
 
+  if(::arg().mustDo("share-caches")) {
+    MemRecursorCache::makeShared(::arg().asNum("cache-shards"));
+    SyncRes::s_sharednegcache = new SyncRes::negcache_t();
+    L<<Logger::Warning<<"Threads share a record cache of "<<::arg().asNum("cache-shards")<<" shards"<<endl;
+  }
+
+  MemRecursorCache::s_prefetchPercentage=::arg().asNum("prefetch-percentage");
+  MemRecursorCache::s_prefetchHits=::arg().asNum("prefetch-hits");
+  MemRecursorCache::s_serveStaleExtension=::arg().asNum("serve-stale-extension");
+  SyncRes::s_serveStaleDeadlineMsec=::arg().asNum("serve-stale-deadline-msec");
+
   SyncRes::s_maxnegttl=::arg().asNum("max-negative-ttl");
   SyncRes::s_maxcachettl=::arg().asNum("max-cache-ttl");
   SyncRes::s_packetcachettl=::arg().asNum("packetcache-ttl");
@@ -1836,11 +2329,16 @@ int serviceMain(int argc, char*argv[])
   Utility::dropPrivs(newuid, newgid);
   g_numThreads = ::arg().asNum("threads") + ::arg().mustDo("pdns-distributes-queries");
   
+  g_coalesceQueries=::arg().mustDo("coalesce-outgoing-queries") && g_numThreads > 1;
+
   makeThreadPipes();
   
   g_tcpTimeout=::arg().asNum("client-tcp-timeout");
   g_maxTCPPerClient=::arg().asNum("max-tcp-per-client");
   g_maxMThreads=::arg().asNum("max-mthreads");
+  g_udpSourcePoolSize=::arg().asNum("udp-source-pool-size");
+  g_udpSourcePoolMaxUses=::arg().asNum("udp-source-pool-max-uses");
+  g_udpSourcePoolMaxAge=::arg().asNum("udp-source-pool-max-age");
 
   if(g_numThreads == 1) {
     L<<Logger::Warning<<"Operating unthreaded"<<endl;
@@ -1868,8 +2366,25 @@ try
   t_sstorage->domainmap = g_initialDomainMap;
   t_allowFrom = g_initialAllowFrom;
   t_udpclientsocks = new UDPClientSocks();
+  t_latencies = new RecLatencies();
   t_tcpClientCounts = new tcpClientCounts_t();
   primeHints();
+
+  if(!::arg()["snapshot-file"].empty() && (!t_RC->isShared() || !t_id)) {
+    int fd=open(::arg()["snapshot-file"].c_str(), O_RDONLY);
+    if(fd < 0)
+      L<<Logger::Warning<<"Not loading cache snapshot from '"<<::arg()["snapshot-file"]<<"': "<<stringerror()<<endl;
+    else {
+      try {
+        uint64_t count=t_RC->doLoadSnapshot(fd, time(0));
+        L<<Logger::Warning<<"Loaded "<<count<<" entries from cache snapshot '"<<::arg()["snapshot-file"]<<"'"<<endl;
+      }
+      catch(std::exception& e) {
+        L<<Logger::Error<<"Error loading cache snapshot from '"<<::arg()["snapshot-file"]<<"': "<<e.what()<<endl;
+      }
+      close(fd);
+    }
+  }
   
   t_packetCache = new RecursorPacketCache();
   
@@ -1899,7 +2414,7 @@ try
     memset(&t_remotes->remotes[0], 0, t_remotes->remotes.size() * sizeof(RemoteKeeper::remotes_t::value_type));
   
   
-  MT=new MTasker<PacketID,string>(::arg().asNum("stack-size"));
+  MT=new MTasker<PacketID,string>(::arg().asNum("stack-size"), ::arg().asNum("stack-pool-size"), ::arg().mustDo("stack-huge-pages"));
   
   PacketID pident;
 
@@ -1919,6 +2434,10 @@ try
   }
 
   t_fdm->addReadFD(g_pipes[t_id].readToThread, handlePipeRequest);
+  if(g_pipes[t_id].questions)
+    t_fdm->addReadFD(g_pipes[t_id].readQuestionWakeup, handleQuestionRing);
+  if(g_pipes[t_id].inflightAnswers)
+    t_fdm->addReadFD(g_pipes[t_id].readAnswerWakeup, handleInflightAnswers);
 
   if(!g_weDistributeQueries || !t_id)  // if we distribute queries, only t_id = 0 listens
     for(deferredAdd_t::const_iterator i=deferredAdd.begin(); i!=deferredAdd.end(); ++i) 
@@ -2005,6 +2524,8 @@ int main(int argc, char **argv)
 
   try {
     ::arg().set("stack-size","stack size per mthread")="200000";
+    ::arg().set("stack-pool-size","number of stacks of finished mthreads kept for reuse, per thread")="128";
+    ::arg().setSwitch("stack-huge-pages","ask for mthread stacks to be backed by huge pages")="no";
     ::arg().set("soa-minimum-ttl","Don't change")="0";
     ::arg().set("soa-serial-offset","Don't change")="0";
     ::arg().set("no-shuffle","Don't change")="off";
@@ -2040,6 +2561,15 @@ int main(int argc, char **argv)
     ::arg().set("max-tcp-clients","Maximum number of simultaneous TCP clients")="128";
     ::arg().set("hint-file", "If set, load root hints from this file")="";
     ::arg().set("max-cache-entries", "If set, maximum number of entries in the main cache")="1000000";
+    ::arg().set("share-caches", "If set, all threads share one record cache and negative cache")="no";
+    ::arg().set("cache-shards", "Number of shards of the record cache when share-caches is set")="1024";
+    ::arg().set("snapshot-file", "If set, load the caches from this file at startup, and save them there on exit")="";
+    ::arg().set("prefetch-percentage", "Resolve popular records again when this percentage of their TTL is left, 0 to disable")="0";
+    ::arg().set("prefetch-hits", "Number of cache hits that makes a record popular enough to prefetch")="10";
+    ::arg().set("root-mirror-file", "Serve the root zone from a local copy in this zone file, checked for changes every SOA refresh interval")="";
+    ::arg().set("root-mirror-server", "Serve the root zone from a local copy, transferred from this IP address (and port) every time its SOA serial changes")="";
+    ::arg().set("serve-stale-extension", "Keep expired records this many seconds, to answer with when resolving fails, 0 to disable")="0";
+    ::arg().set("serve-stale-deadline-msec", "With serve-stale-extension, answer with stale records when resolving takes longer than this, 0 to wait for failure")="1800";
     ::arg().set("max-negative-ttl", "maximum number of seconds to keep a negative cached entry in memory")="3600";
     ::arg().set("max-cache-ttl", "maximum number of seconds to keep a cached entry in memory")="86400";
     ::arg().set("packetcache-ttl", "maximum number of seconds to keep a cached entry in packetcache")="3600";
@@ -2068,8 +2598,13 @@ int main(int argc, char **argv)
     ::arg().setSwitch( "disable-edns", "Disable EDNS - EXPERIMENTAL, LEAVE DISABLED" )= ""; 
     ::arg().setSwitch( "disable-packetcache", "Disable packetcache" )= "no"; 
     ::arg().setSwitch( "pdns-distributes-queries", "If PowerDNS itself should distribute queries over threads (EXPERIMENTAL)")="no";
+    ::arg().set("distribution-ring-size", "With pdns-distributes-queries, the number of questions that can be queued for each thread")="1024";
     ::arg().setSwitch( "any-to-tcp","Answer ANY queries with tc=1, shunting to TCP" )="no";
     ::arg().set("udp-truncation-threshold", "Maximum UDP response size before we truncate")="1680";
+    ::arg().setSwitch("coalesce-outgoing-queries", "If set, identical outgoing queries from different threads are sent only once")="no";
+    ::arg().set("udp-source-pool-size", "If set, send outgoing UDP queries from this many reused sockets per address family and thread")="0";
+    ::arg().set("udp-source-pool-max-uses", "Number of queries after which a pooled outgoing socket is replaced")="100";
+    ::arg().set("udp-source-pool-max-age", "Number of seconds after which a pooled outgoing socket is replaced")="60";
 
     ::arg().set("include-dir","Include *.conf files from this directory")="";
 
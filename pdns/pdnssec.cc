@@ -152,6 +152,7 @@ void loadMainConfig(const std::string& configdir)
   S.declare("query-cache-hit","Number of hits on the query cache");
   S.declare("query-cache-miss","Number of misses on the query cache");
   ::arg().set("max-cache-entries", "Maximum number of cache entries")="1000000";
+  ::arg().set("max-query-cache-entries", "Maximum number of entries in the query cache")="100000";
   ::arg().set("recursor","If recursion is desired, IP address of a recursing nameserver")="no"; 
   ::arg().set("recursive-cache-ttl","Seconds to store packets for recursive queries in the PacketCache")="10";
   ::arg().set("cache-ttl","Seconds to store packets in the PacketCache")="20";              
@@ -164,6 +165,8 @@ void loadMainConfig(const std::string& configdir)
   ::arg().set("soa-expire-default","Default SOA expire")="604800";
   ::arg().setSwitch("query-logging","Hint backends that queries should be logged")="no";
   ::arg().set("soa-minimum-ttl","Default SOA minimum ttl")="3600";    
+  PC.setMaxEntries(::arg().asNum("max-cache-entries"));
+  PC.queryCache().setMaxEntries(::arg().asNum("max-query-cache-entries"));
 
   UeberBackend::go();
 }
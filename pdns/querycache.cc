@@ -0,0 +1,205 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2014  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2
+    as published by the Free Software Foundation
+
+    Additionally, the license of this program contains a special
+    exception which allows to distribute the program in binary form when
+    it is linked against OpenSSL.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "querycache.hh"
+#include "statbag.hh"
+#include <boost/algorithm/string.hpp>
+
+extern StatBag S;
+
+QueryCache::QueryCache(unsigned int shards)
+{
+  d_maps.resize(shards ? shards : 1);
+  d_maxEntries=0;
+  d_shards=d_maps.size();
+
+  S.declare("query-cache-size", "Number of entries in the query cache");
+  d_statnumentries=S.getPointer("query-cache-size");
+}
+
+size_t QueryCache::CIHash::operator()(const string& str) const
+{
+  return pdns_ihash(str);
+}
+
+/* only the qname picks the shard, so a purge of a single name could be done in one shard */
+QueryCache::MapCombo& QueryCache::getMap(const string& qname)
+{
+  return d_maps[CIHash()(qname) % d_shards];
+}
+
+void QueryCache::setMaxEntries(unsigned int maxEntries)
+{
+  d_maxEntries=maxEntries;
+  d_shards=maxEntries ? min(maxEntries, (unsigned int)d_maps.size()) : d_maps.size();
+}
+
+//! the first shards get one entry more each, so the limits add up to max-query-cache-entries
+unsigned int QueryCache::maxShardEntries(unsigned int n) const
+{
+  if(!d_maxEntries)
+    return UINT_MAX;
+  if(n >= d_shards)
+    return 0;
+  return d_maxEntries / d_shards + (n < d_maxEntries % d_shards);
+}
+
+bool QueryCache::get(const string& qname, const QType& qtype, int zoneID, records_t& rrs)
+{
+  MapCombo& mc=getMap(qname);
+  Lock l(mc.d_mut);
+
+  cmap_t::iterator i=mc.d_map.find(boost::make_tuple(qname, qtype.getCode(), zoneID));
+  if(i == mc.d_map.end())
+    return false;
+
+  if(i->ttd < time(0)) {
+    mc.d_map.erase(i);
+    return false;
+  }
+
+  sequence_t& sidx=mc.d_map.get<1>();
+  sidx.relocate(sidx.end(), mc.d_map.project<1>(i)); // most recently used go to the back
+  rrs=i->rrs;
+  return true;
+}
+
+void QueryCache::insert(const string& qname, const QType& qtype, int zoneID, const records_t& rrs, unsigned int ttl)
+{
+  if(!ttl)
+    return;
+
+  CacheEntry val;
+  val.qname=qname;
+  val.qtype=qtype.getCode();
+  val.zoneID=zoneID;
+  val.ttd=time(0)+ttl;
+  val.rrs=rrs;
+
+  MapCombo& mc=getMap(qname);
+  unsigned int maxCached=maxShardEntries(&mc - &d_maps[0]);
+  Lock l(mc.d_mut);
+
+  pair<cmap_t::iterator, bool> ret=mc.d_map.insert(val);
+  if(!ret.second) {
+    mc.d_map.replace(ret.first, val);
+    sequence_t& sidx=mc.d_map.get<1>();
+    sidx.relocate(sidx.end(), mc.d_map.project<1>(ret.first));
+  }
+
+  sequence_t& sidx=mc.d_map.get<1>();
+  while(sidx.size() > maxCached)
+    sidx.pop_front();
+}
+
+unsigned int QueryCache::size()
+{
+  unsigned int ret=0;
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    Lock l(mc->d_mut);
+    ret+=mc->d_map.size();
+  }
+  *d_statnumentries=ret;
+  return ret;
+}
+
+/** like PacketCache::cleanupShard, looks at the least recently used tenth of each shard, but at no more than
+    s_maxCleanupPerShard entries, so a big cache does not stall lookups. Expired entries elsewhere get removed by get(),
+    or here once they have drifted to the front. */
+unsigned int QueryCache::cleanup()
+{
+  time_t now=time(0);
+  unsigned int erased=0;
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    Lock l(mc->d_mut);
+    sequence_t& sidx=mc->d_map.get<1>();
+    unsigned int lookAt=min(max((unsigned int)sidx.size()/10, 100U), s_maxCleanupPerShard);
+    for(sequence_t::iterator i=sidx.begin(); i != sidx.end() && lookAt; --lookAt) {
+      if(i->ttd < now) {
+        sidx.erase(i++);
+        erased++;
+      }
+      else
+        ++i;
+    }
+  }
+  size();
+  return erased;
+}
+
+unsigned int QueryCache::purge()
+{
+  unsigned int delcount=0;
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    Lock l(mc->d_mut);
+    delcount+=mc->d_map.size();
+    mc->d_map.clear();
+  }
+  *d_statnumentries=0;
+  return delcount;
+}
+
+unsigned int QueryCache::purge(const string& match)
+{
+  unsigned int delcount=0;
+  if(!ends_with(match, "$")) {
+    MapCombo& mc=getMap(match);
+    Lock l(mc.d_mut);
+    for(cmap_t::iterator i = mc.d_map.begin(); i != mc.d_map.end(); ) {
+      if(pdns_iequals(i->qname, match)) {
+        mc.d_map.erase(i++);
+        delcount++;
+      }
+      else
+        ++i;
+    }
+  }
+  else {
+    string suffix(match, 0, match.size()-1);
+    string dotsuffix = "."+suffix;
+    for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+      Lock l(mc->d_mut);
+      for(cmap_t::iterator i = mc->d_map.begin(); i != mc->d_map.end(); ) {
+        if(pdns_iequals(i->qname, suffix) || iends_with(i->qname, dotsuffix)) {
+          mc->d_map.erase(i++);
+          delcount++;
+        }
+        else
+          ++i;
+      }
+    }
+  }
+  size();
+  return delcount;
+}
+
+void QueryCache::getCounts(map<char,int>& counts)
+{
+  for(vector<MapCombo>::iterator mc = d_maps.begin(); mc != d_maps.end(); ++mc) {
+    Lock l(mc->d_mut);
+    for(cmap_t::const_iterator i = mc->d_map.begin(); i != mc->d_map.end(); ++i) {
+      if(i->rrs)
+        counts['Q']++;
+      else
+        counts['!']++;
+    }
+  }
+}
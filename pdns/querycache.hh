@@ -0,0 +1,130 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2014  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2
+    as published by the Free Software Foundation
+
+    Additionally, the license of this program contains a special
+    exception which allows to distribute the program in binary form when
+    it is linked against OpenSSL.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef PDNS_QUERYCACHE_HH
+#define PDNS_QUERYCACHE_HH
+
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/composite_key.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+#include "dns.hh"
+#include "qtype.hh"
+#include "lock.hh"
+#include "misc.hh"
+#include "namespaces.hh"
+using namespace ::boost::multi_index;
+
+/** Caches the answers backends give to UeberBackend lookups, keyed on qname (case insensitively), qtype and zone id.
+
+    Answers are stored as they are, in an immutable vector that is shared between the cache and everybody who gets a hit,
+    so a hit costs a reference count and no copying or parsing. An empty pointer is a negative entry.
+
+    Like the PacketCache, this is split into shards with a lock each. Every shard keeps its entries in least recently
+    used order, and evicts from the cold end once it holds more than its part of max-query-cache-entries. */
+class QueryCache : public boost::noncopyable
+{
+public:
+  typedef boost::shared_ptr<const vector<DNSResourceRecord> > records_t;
+
+  QueryCache(unsigned int shards=64);
+
+  //! like PacketCache::setMaxEntries, spreads maxEntries (0 for no limit) over the shards before the cache is shared
+  void setMaxEntries(unsigned int maxEntries);
+  //! the part of max-query-cache-entries shard n may hold, UINT_MAX if there is no limit
+  unsigned int maxShardEntries(unsigned int n) const;
+
+  //! returns false on a miss. On a negative hit, rrs is reset to an empty pointer
+  bool get(const string& qname, const QType& qtype, int zoneID, records_t& rrs);
+  void insert(const string& qname, const QType& qtype, int zoneID, const records_t& rrs, unsigned int ttl);
+
+  unsigned int size();
+  //! removes expired entries from the cold end of every shard, a bounded number per call
+  unsigned int cleanup();
+  unsigned int purge();
+  //! match works like it does for PacketCache::purge, a trailing $ makes it a suffix match
+  unsigned int purge(const string& match);
+  //! adds positive entries to counts['Q'], negative ones to counts['!']
+  void getCounts(map<char,int>& counts);
+
+private:
+  struct CIHash : public std::unary_function<string, size_t>
+  {
+    size_t operator()(const string& str) const;
+  };
+  struct CIEqual : public std::binary_function<string, string, bool>
+  {
+    bool operator()(const string& a, const string& b) const
+    {
+      return pdns_iequals(a, b);
+    }
+  };
+
+  struct CacheEntry
+  {
+    string qname;
+    uint16_t qtype;
+    int zoneID;
+    time_t ttd;
+    records_t rrs;
+  };
+
+  typedef multi_index_container<
+    CacheEntry,
+    indexed_by <
+      hashed_unique <
+        composite_key<
+          CacheEntry,
+          member<CacheEntry, string, &CacheEntry::qname>,
+          member<CacheEntry, uint16_t, &CacheEntry::qtype>,
+          member<CacheEntry, int, &CacheEntry::zoneID>
+        >,
+        composite_key_hash<CIHash, boost::hash<uint16_t>, boost::hash<int> >,
+        composite_key_equal_to<CIEqual, std::equal_to<uint16_t>, std::equal_to<int> >
+      >,
+      sequenced<>
+    >
+  > cmap_t;
+  typedef cmap_t::nth_index<1>::type sequence_t;
+
+  struct MapCombo
+  {
+    ShardMutex d_mut;
+    cmap_t d_map;
+  };
+
+  static const unsigned int s_maxCleanupPerShard=10000;
+
+  MapCombo& getMap(const string& qname);
+
+  vector<MapCombo> d_maps;
+  unsigned int *d_statnumentries;
+  unsigned int d_maxEntries;
+  unsigned int d_shards; //!< shards in use, fewer than d_maps.size() if max-query-cache-entries is smaller
+};
+
+#endif
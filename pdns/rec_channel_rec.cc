@@ -18,6 +18,8 @@
 #include "logger.hh"
 #include "dnsparser.hh"
 #include "arguments.hh"
+#include "histogram.hh"
+#include "lua-recursor.hh"
 #include <sys/resource.h>
 #include <sys/time.h>
 
@@ -145,7 +147,9 @@ static uint64_t dumpNegCache(SyncRes::negcache_t& negcache, int fd)
 
 static uint64_t* pleaseDump(int fd)
 {
-  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(t_sstorage->negcache, fd));
+  uint64_t count=t_RC->doDump(fd);
+  Lock l(t_sstorage->negcachelock);
+  return new uint64_t(count + dumpNegCache(*t_sstorage->negcache, fd));
 }
 
 static uint64_t* pleaseDumpNSSpeeds(int fd)
@@ -175,6 +179,105 @@ string doDumpNSSpeeds(T begin, T end)
   return "dumped "+lexical_cast<string>(total)+" records\n";
 }
 
+extern __thread unsigned int t_id;
+
+static string* pleaseGetStackUsage()
+{
+  return new string("thread "+lexical_cast<string>(t_id)+": highest mthread stack usage "+lexical_cast<string>(MT->getHighestStackUsage())+
+                    " of "+lexical_cast<string>(MT->getStackSize())+" bytes, "+lexical_cast<string>(MT->numFreeStacks())+" stacks pooled\n");
+}
+
+static string doGetLuaStats()
+{
+  RecursorLuaStats stats=broadcastAccFunction<RecursorLuaStats>(pleaseGetLuaStats);
+  ostringstream ret;
+  for(unsigned int n=0; n < RecursorLuaStats::NumHooks; ++n) {
+    ret<<RecursorLuaStats::hookName(n)<<" calls "<<stats.d_calls[n]<<" skipped "<<stats.d_skipped[n]<<" usec "<<stats.d_usec[n];
+    if(stats.d_calls[n])
+      ret<<" avg-usec "<<stats.d_usec[n]/stats.d_calls[n];
+    ret<<"\n";
+  }
+  return ret.str();
+}
+
+template<typename T>
+string doGetLatency(T begin, T end)
+{
+  string which = begin!=end ? toLower(*begin) : "resolve";
+  if(which!="packetcache" && which!="cache" && which!="resolve" && which!="outgoing") {
+    try {
+      ComboAddress(which, 53);
+    }
+    catch(PDNSException& ae) {
+      return "Unknown latency '"+which+"', use packetcache, cache, resolve, outgoing or the IP address of a server\n";
+    }
+  }
+
+  LatencyHistogram hist=broadcastAccFunction<LatencyHistogram>(boost::bind(pleaseGetLatencyHistogram, which));
+  ostringstream ret;
+  ret<<"count "<<hist.count()<<"\n";
+  if(!hist.count())
+    return ret.str();
+
+  ret<<"usec p50 "<<hist.percentile(50)<<" p90 "<<hist.percentile(90)<<" p99 "<<hist.percentile(99)<<" p99.9 "<<hist.percentile(99.9)<<"\n";
+  for(unsigned int n=0; n < LatencyHistogram::NumBuckets; ++n) {
+    if(!hist.getBucket(n))
+      continue;
+    if(n == LatencyHistogram::NumBuckets - 1)
+      ret<<"above "<<LatencyHistogram::upperBound(n-1);
+    else
+      ret<<"below "<<LatencyHistogram::upperBound(n);
+    ret<<" "<<hist.getBucket(n)<<"\n";
+  }
+  return ret.str();
+}
+
+static string s_snapshotError; //!< set by the thread that failed to write its part of a snapshot, read by thread 0 once all are done
+
+static uint64_t* pleaseSaveSnapshot(int fd)
+{
+  try {
+    return new uint64_t(t_RC->doSaveSnapshot(fd));
+  }
+  catch(std::exception& e) {
+    s_snapshotError=e.what();
+    return 0;
+  }
+}
+
+// written to a temporary file first, so a failed or interrupted save does not clobber the previous snapshot
+static string saveSnapshot(const string& fname)
+{
+  if(fname.empty())
+    return "No snapshot-file configured and no filename given\n";
+
+  string tmpname=fname+".tmp";
+  int fd=open(tmpname.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0660);
+  if(fd < 0)
+    return "Error opening snapshot file for writing: "+string(strerror(errno))+"\n";
+
+  s_snapshotError.clear();
+  uint64_t total=cacheAccFunction(boost::bind(pleaseSaveSnapshot, fd));
+  if(s_snapshotError.empty() && fsync(fd) < 0)
+    s_snapshotError="syncing: "+stringerror();
+  if(close(fd) < 0 && s_snapshotError.empty())
+    s_snapshotError="closing: "+stringerror();
+  if(s_snapshotError.empty() && rename(tmpname.c_str(), fname.c_str()) < 0)
+    s_snapshotError="renaming: "+stringerror();
+
+  if(!s_snapshotError.empty()) {
+    unlink(tmpname.c_str());
+    return "Error writing snapshot file, keeping the previous one: "+s_snapshotError+"\n";
+  }
+  return "saved "+lexical_cast<string>(total)+" records\n";
+}
+
+template<typename T>
+string doSaveSnapshot(T begin, T end)
+{
+  return saveSnapshot(begin != end ? *begin : ::arg()["snapshot-file"]);
+}
+
 template<typename T>
 string doDumpCache(T begin, T end)
 {
@@ -189,7 +292,7 @@ string doDumpCache(T begin, T end)
     return "Error opening dump file for writing: "+string(strerror(errno))+"\n";
   uint64_t total = 0;
   try {
-    total = broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
+    total = cacheAccFunction(boost::bind(pleaseDump, fd));
   }
   catch(...){}
   
@@ -221,12 +324,23 @@ uint64_t* pleaseWipeCache(const std::string& canon)
   return new uint64_t(t_RC->doWipeCache(canon) + t_packetCache->doWipePacketCache(canon));
 }
 
+static uint64_t* pleaseWipeRecordCache(const std::string& canon)
+{
+  return new uint64_t(t_RC->doWipeCache(canon));
+}
+
+static uint64_t* pleaseWipePacketCache(const std::string& canon)
+{
+  return new uint64_t(t_packetCache->doWipePacketCache(canon));
+}
+
 
 uint64_t* pleaseWipeAndCountNegCache(const std::string& canon)
 {
-  uint64_t res = t_sstorage->negcache.count(tie(canon));
-  pair<SyncRes::negcache_t::iterator, SyncRes::negcache_t::iterator> range=t_sstorage->negcache.equal_range(tie(canon));
-  t_sstorage->negcache.erase(range.first, range.second);
+  Lock l(t_sstorage->negcachelock);
+  uint64_t res = t_sstorage->negcache->count(tie(canon));
+  pair<SyncRes::negcache_t::iterator, SyncRes::negcache_t::iterator> range=t_sstorage->negcache->equal_range(tie(canon));
+  t_sstorage->negcache->erase(range.first, range.second);
   return new uint64_t(res);
 }
 
@@ -236,8 +350,13 @@ string doWipeCache(T begin, T end)
   int count=0, countNeg=0;
   for(T i=begin; i != end; ++i) {
     string canon=toCanonic("", *i);
-    count+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, canon));
-    countNeg+=broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, canon));
+    if(t_RC->isShared()) {
+      count+= cacheAccFunction(boost::bind(pleaseWipeRecordCache, canon));
+      count+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, canon));
+    }
+    else
+      count+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, canon));
+    countNeg+=cacheAccFunction(boost::bind(pleaseWipeAndCountNegCache, canon));
   }
 
   return "wiped "+lexical_cast<string>(count)+" records, "+lexical_cast<string>(countNeg)+" negative records\n";
@@ -299,15 +418,21 @@ static uint64_t getThrottleSize()
   return broadcastAccFunction<uint64_t>(pleaseGetThrottleSize);
 }
 
+static uint64_t getHousekeepingMsec()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetHousekeepingUsec)/1000;
+}
+
 uint64_t* pleaseGetNegCacheSize()
 {
-  uint64_t tmp=t_sstorage->negcache.size();
+  Lock l(t_sstorage->negcachelock);
+  uint64_t tmp=t_sstorage->negcache->size();
   return new uint64_t(tmp);
 }
 
 uint64_t getNegCacheSize()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize);
+  return cacheAccFunction(pleaseGetNegCacheSize);
 }
 
 uint64_t* pleaseGetNsSpeedsSize()
@@ -343,12 +468,12 @@ uint64_t* pleaseGetCacheBytes()
 
 uint64_t doGetCacheSize()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetCacheSize);
+  return cacheAccFunction(pleaseGetCacheSize);
 }
 
 uint64_t doGetCacheBytes()
 {
-  return broadcastAccFunction<uint64_t>(pleaseGetCacheBytes);
+  return cacheAccFunction(pleaseGetCacheBytes);
 }
 
 uint64_t* pleaseGetCacheHits()
@@ -466,6 +591,7 @@ RecursorControlParser::RecursorControlParser()
 
   addGetStat("resource-limits", &g_stats.resourceLimits);
   addGetStat("over-capacity-drops", &g_stats.overCapacityDrops);
+  addGetStat("prefetches", &g_stats.prefetches);
   addGetStat("no-packet-error", &g_stats.noPacketError);
   addGetStat("dlg-only-drops", &SyncRes::s_nodelegated);
   addGetStat("max-mthread-stack", &g_stats.maxMThreadStackUsage);
@@ -475,6 +601,8 @@ RecursorControlParser::RecursorControlParser()
 
   addGetStat("nsspeeds-entries", boost::bind(getNsSpeedsSize));
 
+  addGetStat("housekeeping-msec", boost::bind(getHousekeepingMsec));
+
   addGetStat("concurrent-queries", boost::bind(getConcurrentQueries)); 
   addGetStat("outgoing-timeouts", &SyncRes::s_outgoingtimeouts);
   addGetStat("tcp-outqueries", &SyncRes::s_tcpoutqueries);
@@ -485,6 +613,9 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("throttled-out", &SyncRes::s_throttledqueries);
   addGetStat("unreachables", &SyncRes::s_unreachables);
   addGetStat("chain-resends", &g_stats.chainResends);
+  addGetStat("coalesced-queries", &g_stats.coalescedQueries);
+  addGetStat("question-ring-full", &g_stats.questionRingFull);
+  addGetStat("stale-answers", &g_stats.staleAnswers);
   addGetStat("tcp-clients", boost::bind(TCPConnection::getCurrentConnections));
 
   addGetStat("edns-ping-matches", &g_stats.ednsPingMatches);
@@ -503,6 +634,8 @@ RecursorControlParser::RecursorControlParser()
 static void doExitGeneric(bool nicely)
 {
   L<<Logger::Error<<"Exiting on user request"<<endl;
+  if(!::arg()["snapshot-file"].empty())
+    L<<Logger::Warning<<"Cache snapshot to '"<<::arg()["snapshot-file"]<<"': "<<saveSnapshot(::arg()["snapshot-file"]);
   extern RecursorControlChannel s_rcc;
   s_rcc.~RecursorControlChannel(); 
 
@@ -589,7 +722,11 @@ string RecursorControlParser::getAnswer(const string& question, RecursorControlP
 "dump-nsspeeds <filename>         dump nsspeeds statistics to the named file\n"
 "get [key1] [key2] ..             get specific statistics\n"
 "get-all                          get all statistics\n"
+"get-latency [which]              show latency percentiles and buckets of packetcache, cache,\n"
+"                                 resolve, outgoing or an authoritative server IP\n"
+"get-lua-stats                    show calls, filtered calls and time spent per Lua hook\n"
 "get-parameter [key1] [key2] ..   get configuration parameters\n"
+"get-stack-usage                  show the highest mthread stack usage of each thread\n"
 "help                             get this list\n"
 "ping                             check that all threads are alive\n"
 "quit                             stop the recursor daemon\n"
@@ -597,6 +734,7 @@ string RecursorControlParser::getAnswer(const string& question, RecursorControlP
 "reload-acls                      reload ACLS\n"
 "reload-lua-script [filename]     (re)load Lua script\n"
 "reload-zones                     reload all auth and forward zones\n"
+"save-snapshot [filename]         save the caches to snapshot-file, or the named file\n"
 "trace-regex regex                emit resolution trace for matching queries\n"
 "top-remotes                      show top remotes\n"
 "unload-lua-script                unload Lua script\n"
@@ -608,9 +746,18 @@ string RecursorControlParser::getAnswer(const string& question, RecursorControlP
   if(cmd=="get") 
     return doGet(begin, end);
   
+  if(cmd=="get-latency")
+    return doGetLatency(begin, end);
+
+  if(cmd=="get-lua-stats")
+    return doGetLuaStats();
+
   if(cmd=="get-parameter") 
     return doGetParameter(begin, end);
 
+  if(cmd=="get-stack-usage")
+    return broadcastAccFunction<string>(pleaseGetStackUsage);
+
   if(cmd=="quit") {
     *command=&doExit;
     return "bye\n";
@@ -630,6 +777,9 @@ string RecursorControlParser::getAnswer(const string& question, RecursorControlP
   if(cmd=="dump-nsspeeds")
     return doDumpNSSpeeds(begin, end);
 
+  if(cmd=="save-snapshot")
+    return doSaveSnapshot(begin, end);
+
   if(cmd=="wipe-cache" || cmd=="flushname") 
     return doWipeCache(begin, end);
 
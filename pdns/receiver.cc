@@ -593,6 +593,11 @@ int main(int argc, char **argv)
 
     UeberBackend::go();
     N=new UDPNameserver; // this fails when we are not root, throws exception
+    if(::arg().mustDo("reuseport")) {
+      // the first receiver thread uses N, the others get their own sockets
+      for(int n=1; n < ::arg().asNum("receiver-threads"); ++n)
+        g_udpReceivers.push_back(new UDPNameserver(true));
+    }
     
     if(!::arg().mustDo("disable-tcp"))
       TN=new TCPNameserver; 
@@ -3,6 +3,7 @@
 #include "recpacketcache.hh"
 #include "cachecleaner.hh"
 #include "dns.hh"
+#include "dnsparser.hh"
 #include "namespaces.hh"
 #include "lock.hh"
 
@@ -17,43 +18,105 @@ int RecursorPacketCache::doWipePacketCache(const string& name, uint16_t qtype)
   int count=0;
   for(packetCache_t::iterator iter = d_packetCache.begin(); iter != d_packetCache.end();)
   {
-    const struct dnsheader* packet = reinterpret_cast<const struct dnsheader*>((*iter).d_packet.c_str());
-    if (packet->qdcount > 0) 
+    uint16_t type;
+    std::string domain=questionExpand((*iter).d_packet.c_str(), (*iter).d_packet.size(), type);
+    if (pdns_iequals(name,domain) && (qtype==0xffff || qtype==type))
     {
-        // find out type
-        const struct dnsrecordheader *header = reinterpret_cast<const struct dnsrecordheader*>((*iter).d_packet.c_str()+sizeof(struct dnsheader));
-        uint16_t type = header->d_type;
-        std::string domain=questionExpand((*iter).d_packet.c_str(), (*iter).d_packet.size(), type);         
-        if (pdns_iequals(name,domain)) 
-        { 
-            iter = d_packetCache.erase(iter);
-          count++;
-        } else iter++;
+      iter = d_packetCache.erase(iter);
+      count++;
     }
+    else
+      ++iter;
   }
   return count;
 }
 
-bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time_t now, 
-  std::string* responsePacket, uint32_t* age)
+uint32_t RecursorPacketCache::Key::getHash() const
 {
-  struct Entry e;
-  e.d_packet=queryPacket;
-  
-  packetCache_t::const_iterator iter = d_packetCache.find(e);
-  
-  if(iter == d_packetCache.end()) {
+  uint32_t ret=fnvAdd(questionHash, rd);
+  ret=fnvAdd(ret, ednsSize >> 8);
+  return fnvAdd(ret, ednsSize & 0xff);
+}
+
+/* walks the question straight from the wire, the qname is hashed case insensitively */
+bool RecursorPacketCache::getKey(const std::string& packet, Key& key)
+{
+  if(packet.size() <= sizeof(dnsheader))
+    return false;
+  const struct dnsheader* dh=(const struct dnsheader*)packet.c_str();
+  if(ntohs(dh->qdcount) != 1)
+    return false;
+
+  uint32_t hash = fnvSeed;
+  string::size_type pos=sizeof(dnsheader);
+  unsigned char labellen;
+  do {
+    labellen=packet[pos++];
+    if(labellen & 0xc0) // no compression in a question we cache
+      return false;
+    if(pos + labellen > packet.size())
+      return false;
+    hash=fnvAdd(hash, labellen);
+    for(string::size_type n = pos; n < pos + labellen; ++n)
+      hash=fnvAdd(hash, dns_tolower(packet[n]));
+    pos+=labellen;
+  } while(labellen && pos < packet.size());
+
+  if(labellen || pos + 4 > packet.size())
+    return false;
+  key.qnameEnd=pos;
+  for(int n = 0; n < 4; ++n) // qtype, qclass
+    hash=fnvAdd(hash, packet[pos+n]);
+  pos+=4;
+
+  key.questionHash=hash;
+  key.rd=dh->rd;
+  key.ednsSize=0;
+  // an OPT record has the root as name, its class is the buffer size
+  if(ntohs(dh->arcount) == 1 && !dh->ancount && !dh->nscount && pos + 11 <= packet.size() &&
+     !packet[pos] && (unsigned char)packet[pos+1]*256 + (unsigned char)packet[pos+2] == QType::OPT)
+    key.ednsSize=(unsigned char)packet[pos+3]*256 + (unsigned char)packet[pos+4];
+  key.hash=key.getHash();
+  return true;
+}
+
+RecursorPacketCache::packetCache_t::iterator RecursorPacketCache::find(const std::string& packet, const Key& key)
+{
+  pair<packetCache_t::iterator, packetCache_t::iterator> range=d_packetCache.equal_range(key.hash);
+  for(packetCache_t::iterator iter=range.first; iter != range.second; ++iter) {
+    if(iter->d_qnameEnd != key.qnameEnd || iter->d_rd != key.rd || iter->d_ednsSize != key.ednsSize)
+      continue;
+    const char* a=iter->d_packet.c_str();
+    const char* b=packet.c_str();
+    uint16_t n;
+    for(n = sizeof(dnsheader); n < key.qnameEnd; ++n) // label lengths are below 64, so lowercasing them is harmless
+      if(dns_tolower(a[n]) != dns_tolower(b[n]))
+        break;
+    if(n == key.qnameEnd && !memcmp(a + n, b + n, 4))
+      return iter;
+  }
+  return d_packetCache.end();
+}
+
+bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time_t now, const std::string** responsePacket)
+{
+  Key key;
+  packetCache_t::iterator iter;
+  if(!getKey(queryPacket, key) || (iter = find(queryPacket, key)) == d_packetCache.end()) {
     d_misses++;
     return false;
   }
     
   if((uint32_t)now < iter->d_ttd) { // it is fresh!
 //    cerr<<"Fresh for another "<<iter->d_ttd - now<<" seconds!"<<endl;
-    *age = now - iter->d_creation;
-    uint16_t id;
-    memcpy(&id, queryPacket.c_str(), 2); 
-    *responsePacket = iter->d_packet;
-    responsePacket->replace(0, 2, (char*)&id, 2);
+    string& packet=iter->d_packet;
+    if((uint32_t)now > iter->d_aged) {
+      ageDNSPacket(packet, now - iter->d_aged);
+      iter->d_aged=now;
+    }
+    memcpy(&packet[0], queryPacket.c_str(), 2); // the ID
+    memcpy(&packet[sizeof(dnsheader)], queryPacket.c_str() + sizeof(dnsheader), key.qnameEnd - sizeof(dnsheader)); // and the case of the qname
+    *responsePacket=&packet;
     d_hits++;
     moveCacheItemToBack(d_packetCache, iter);
 
@@ -64,21 +127,31 @@ bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time
   return false;
 }
 
-void RecursorPacketCache::insertResponsePacket(const std::string& responsePacket, time_t now, uint32_t ttl)
+void RecursorPacketCache::insertResponsePacket(const std::string& responsePacket, uint16_t ednsSize, time_t now, uint32_t ttl)
 {
-  struct Entry e;
-  e.d_packet = responsePacket;
-  e.d_ttd = now+ttl;
-  e.d_creation = now;
-  packetCache_t::iterator iter = d_packetCache.find(e);
-  
+  Key key;
+  if(!getKey(responsePacket, key))
+    return;
+  key.ednsSize=ednsSize;
+  key.hash=key.getHash();
+
+  packetCache_t::iterator iter = find(responsePacket, key);
   if(iter != d_packetCache.end()) {
     iter->d_packet = responsePacket;
     iter->d_ttd = now + ttl;
-    iter->d_creation = now;
+    iter->d_creation = iter->d_aged = now;
+    return;
   }
-  else 
-    d_packetCache.insert(e);
+
+  struct Entry e;
+  e.d_packet = responsePacket;
+  e.d_ttd = now+ttl;
+  e.d_creation = e.d_aged = now;
+  e.d_hash = key.hash;
+  e.d_qnameEnd = key.qnameEnd;
+  e.d_ednsSize = key.ednsSize;
+  e.d_rd = key.rd;
+  d_packetCache.insert(e);
 }
 
 uint64_t RecursorPacketCache::size()
@@ -100,4 +173,3 @@ void RecursorPacketCache::doPruneTo(unsigned int maxCached)
 {
   pruneCollection(d_packetCache, maxCached);
 }
-
@@ -7,20 +7,29 @@
 #include "namespaces.hh"
 #include <iostream>
 #include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
 
 
 using namespace ::boost::multi_index;
 
-//! Stores whole packets, ready for lobbing back at the client. Not threadsafe.
+/** Stores whole packets, ready for lobbing back at the client. Not threadsafe.
+
+    Entries are found through a hash of the question (qname case insensitively, qtype, qclass), the RD bit
+    and the EDNS buffer size of the query, which is computed straight from the wire. Candidates with that hash
+    are then compared to the query in place, so a lookup does not copy or allocate anything.
+
+    A hit hands out the stored packet itself, after patching in the ID and question case of the query and aging its
+    TTLs up to now. As every hit ages the stored packet by the time since the previous one, its TTLs stay correct. */
 class RecursorPacketCache
 {
 public:
   RecursorPacketCache();
-  bool getResponsePacket(const std::string& queryPacket, time_t now, std::string* responsePacket, uint32_t* age);
-  void insertResponsePacket(const std::string& responsePacket, time_t now, uint32_t ttd);
+  //! the answer is only valid until the next call into the cache
+  bool getResponsePacket(const std::string& queryPacket, time_t now, const std::string** responsePacket);
+  //! ednsSize is the EDNS buffer size the query announced, 0 if it had no EDNS
+  void insertResponsePacket(const std::string& responsePacket, uint16_t ednsSize, time_t now, uint32_t ttl);
   void doPruneTo(unsigned int maxSize=250000);
   int doWipePacketCache(const string& name, uint16_t qtype=0xffff);
   
@@ -30,15 +39,30 @@ public:
   uint64_t bytes();
 
 private:
+  struct Key
+  {
+    uint32_t hash;       //!< of everything below, see getHash()
+    uint32_t questionHash;
+    uint16_t qnameEnd;   //!< offset just past the qname, where qtype starts
+    uint16_t ednsSize;
+    bool rd;
+
+    uint32_t getHash() const;
+  };
+  //! fills in key from a packet with a single question, ednsSize is taken from an OPT record if that is all there is
+  static bool getKey(const std::string& packet, Key& key);
 
   struct Entry 
   {
     mutable uint32_t d_ttd;
     mutable uint32_t d_creation;
+    mutable uint32_t d_aged;    //!< the TTLs in d_packet are correct for this moment
     mutable std::string d_packet; // "I know what I am doing"
+    uint32_t d_hash;
+    uint16_t d_qnameEnd;
+    uint16_t d_ednsSize;
+    bool d_rd;
 
-    inline bool operator<(const struct Entry& rhs) const;
-    
     uint32_t getTTD() const
     {
       return d_ttd;
@@ -48,27 +72,14 @@ private:
   typedef multi_index_container<
     Entry,
     indexed_by  <
-                  ordered_unique<identity<Entry> >, 
+                  hashed_non_unique<member<Entry, uint32_t, &Entry::d_hash> >,
                   sequenced<> 
                >
   > packetCache_t;
-  
-   packetCache_t d_packetCache;
-};
-
-// needs to take into account: qname, qtype, opcode, rd, qdcount, EDNS size
-inline bool RecursorPacketCache::Entry::operator<(const struct RecursorPacketCache::Entry &rhs) const
-{
-  const struct dnsheader* 
-    dh=(const struct dnsheader*) d_packet.c_str(), 
-    *rhsdh=(const struct dnsheader*)rhs.d_packet.c_str();
-  if(make_tuple(dh->opcode, dh->rd, dh->qdcount) < 
-     make_tuple(rhsdh->opcode, rhsdh->rd, rhsdh->qdcount))
-    return true;
-
-  return dnspacketLessThan(d_packet, rhs.d_packet);
-}
 
+  packetCache_t::iterator find(const std::string& packet, const Key& key);
 
+  packetCache_t d_packetCache;
+};
 
 #endif
@@ -7,6 +7,7 @@
 #include "syncres.hh"
 #include "recursor_cache.hh"
 #include "cachecleaner.hh"
+#include "logger.hh"
 
 #include "namespaces.hh"
 #include "namespaces.hh"
@@ -86,44 +87,92 @@ string DNSRR2String(const DNSResourceRecord& rr)
   }
 }
 
+MemRecursorCache::maps_t* MemRecursorCache::s_sharedmaps;
+unsigned int MemRecursorCache::s_prefetchPercentage;
+unsigned int MemRecursorCache::s_prefetchHits;
+unsigned int MemRecursorCache::s_serveStaleExtension;
+
+MemRecursorCache::MemRecursorCache() : d_cachecachevalid(false)
+{
+  cacheHits = cacheMisses = 0;
+  d_shared = s_sharedmaps != 0;
+  if(d_shared)
+    d_maps = s_sharedmaps;
+  else {
+    d_ownmaps.resize(1);
+    d_maps = &d_ownmaps;
+  }
+}
+
+void MemRecursorCache::makeShared(unsigned int shards)
+{
+  s_sharedmaps = new maps_t(shards ? shards : 1);
+}
+
+/* the shard only depends on the name, as get() for ANY and ADDR needs all types of a name together */
+MemRecursorCache::MapCombo& MemRecursorCache::getMap(const string& qname)
+{
+  if(d_maps->size() == 1)
+    return d_maps->front();
+
+  return (*d_maps)[pdns_ihash(qname) % d_maps->size()];
+}
+
 unsigned int MemRecursorCache::size()
 {
-  return (unsigned int)d_cache.size();
+  unsigned int ret=0;
+  for(maps_t::iterator mc=d_maps->begin(); mc != d_maps->end(); ++mc) {
+    Lock l(getLock(*mc));
+    ret+=(unsigned int)mc->d_cache.size();
+  }
+  return ret;
 }
 
 unsigned int MemRecursorCache::bytes()
 {
   unsigned int ret=0;
 
-  for(cache_t::const_iterator i=d_cache.begin(); i!=d_cache.end(); ++i) {
-    ret+=sizeof(struct CacheEntry);
-    ret+=(unsigned int)i->d_qname.length();
-    for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j!= i->d_records.end(); ++j)
-      ret+=j->size();
+  for(maps_t::iterator mc=d_maps->begin(); mc != d_maps->end(); ++mc) {
+    Lock l(getLock(*mc));
+    for(cache_t::const_iterator i=mc->d_cache.begin(); i!=mc->d_cache.end(); ++i) {
+      ret+=sizeof(struct CacheEntry);
+      ret+=(unsigned int)i->d_qname.length();
+      for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j!= i->d_records.end(); ++j)
+        ret+=j->size();
+    }
   }
   return ret;
 }
 
-int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<DNSResourceRecord>* res)
+int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<DNSResourceRecord>* res, bool* prefetch)
 {
   unsigned int ttd=0;
   //  cerr<<"looking up "<< qname+"|"+qt.getName()<<"\n";
+  MapCombo& mc=getMap(qname);
+  Lock l(getLock(mc));
+  cache_t& cache=mc.d_cache;
 
-  if(!d_cachecachevalid || !pdns_iequals(d_cachedqname, qname)) {
-    //    cerr<<"had cache cache miss"<<endl;
-    d_cachedqname=qname;
-    d_cachecache=d_cache.equal_range(tie(qname));
-    d_cachecachevalid=true;
+  pair<cache_t::iterator, cache_t::iterator> range;
+  if(d_shared)
+    range=cache.equal_range(tie(qname));
+  else {
+    if(!d_cachecachevalid || !pdns_iequals(d_cachedqname, qname)) {
+      //    cerr<<"had cache cache miss"<<endl;
+      d_cachedqname=qname;
+      d_cachecache=cache.equal_range(tie(qname));
+      d_cachecachevalid=true;
+    }
+    else
+      //    cerr<<"had cache cache hit!"<<endl;
+      ;
+    range=d_cachecache;
   }
-  else
-    //    cerr<<"had cache cache hit!"<<endl;
-    ;
 
   if(res)
     res->clear();
 
-  if(d_cachecache.first!=d_cachecache.second) { 
-    for(cache_t::const_iterator i=d_cachecache.first; i != d_cachecache.second; ++i) 
+  if(range.first!=range.second) { 
+    for(cache_t::const_iterator i=range.first; i != range.second; ++i) 
       if(i->d_qtype == qt.getCode() || qt.getCode()==QType::ANY || 
          (qt.getCode()==QType::ADDR && (i->d_qtype == QType::A || i->d_qtype == QType::AAAA) )
          ) {     
@@ -138,9 +187,16 @@ int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<
         }
         if(res) {
           if(res->empty())
-            moveCacheItemToFront(d_cache, i);
+            moveCacheItemToFront(cache, i);
           else
-            moveCacheItemToBack(d_cache, i);
+            moveCacheItemToBack(cache, i);
+        }
+        if(prefetch && s_prefetchPercentage && ++i->d_hits >= s_prefetchHits) {
+          uint32_t earliest=i->getTTD();
+          if(earliest >= 1000000000 && earliest > (uint32_t)now && (uint64_t)(earliest - now) * 100 <= (uint64_t)i->d_origttl * s_prefetchPercentage) {
+            *prefetch=true;
+            i->d_hits=0; // one prefetch is enough, until the next one has been earned
+          }
         }
         if(qt.getCode()!=QType::ANY && qt.getCode()!=QType::ADDR) // normally if we have a hit, we are done
           break;
@@ -154,6 +210,30 @@ int MemRecursorCache::get(time_t now, const string &qname, const QType& qt, set<
 
 
  
+int MemRecursorCache::getStale(time_t now, const string &qname, const QType& qt, set<DNSResourceRecord>* res, uint32_t staleTTL)
+{
+  if(res)
+    res->clear();
+  if(!s_serveStaleExtension)
+    return -1;
+
+  MapCombo& mc=getMap(qname);
+  Lock l(getLock(mc));
+  cache_t::const_iterator i=mc.d_cache.find(tuple<string, uint16_t>(qname, qt.getCode()));
+  if(i == mc.d_cache.end())
+    return -1;
+
+  int found=0;
+  for(vector<StoredRecord>::const_iterator k=i->d_records.begin(); k != i->d_records.end(); ++k) {
+    if(k->d_ttd < 1000000000 || k->d_ttd > (uint32_t) now || k->d_ttd + (uint64_t)s_serveStaleExtension < (uint64_t) now)
+      continue; // never expires, still fresh, or too stale
+    found++;
+    if(res)
+      res->insert(String2DNSRR(qname, qt, k->d_string, now + staleTTL));
+  }
+  return found ? (int)staleTTL : -1;
+}
+
 bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const set<DNSResourceRecord>& content, const CacheEntry& stored)
 {
   if(!stored.d_auth) {
@@ -188,13 +268,17 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const set<DNSResou
 void MemRecursorCache::replace(time_t now, const string &qname, const QType& qt,  const set<DNSResourceRecord>& content, bool auth)
 {
   d_cachecachevalid=false;
+  MapCombo& mc=getMap(qname);
+  Lock l(getLock(mc));
+  cache_t& cache=mc.d_cache;
+
   tuple<string, uint16_t> key=make_tuple(qname, qt.getCode());
-  cache_t::iterator stored=d_cache.find(key);
+  cache_t::iterator stored=cache.find(key);
   uint32_t maxTTD=UINT_MAX;
 
   bool isNew=false;
-  if(stored == d_cache.end()) {
-    stored=d_cache.insert(CacheEntry(key,vector<StoredRecord>(), auth)).first;
+  if(stored == cache.end()) {
+    stored=cache.insert(CacheEntry(key,vector<StoredRecord>(), auth)).first;
     isNew=true;
   }
   pair<vector<StoredRecord>::iterator, vector<StoredRecord>::iterator> range;
@@ -285,32 +369,44 @@ void MemRecursorCache::replace(time_t now, const string &qname, const QType& qt,
   
   if(ce.d_records.capacity() != ce.d_records.size())
     vector<StoredRecord>(ce.d_records).swap(ce.d_records);
+
+  uint32_t earliest=ce.getTTD();
+  ce.d_origttl = earliest > (uint32_t) now ? earliest - now : 0;
+  ce.d_hits=0;
   
-  d_cache.replace(stored, ce);
+  cache.replace(stored, ce);
 }
 
 int MemRecursorCache::doWipeCache(const string& name, uint16_t qtype)
 {
   int count=0;
   d_cachecachevalid=false;
+  MapCombo& mc=getMap(name);
+  Lock l(getLock(mc));
+  cache_t& cache=mc.d_cache;
+
   pair<cache_t::iterator, cache_t::iterator> range;
   if(qtype==0xffff)
-    range=d_cache.equal_range(tie(name));
+    range=cache.equal_range(tie(name));
   else
-    range=d_cache.equal_range(tie(name, qtype));
+    range=cache.equal_range(tie(name, qtype));
 
   for(cache_t::const_iterator i=range.first; i != range.second; ) {
     count++;
-    d_cache.erase(i++);
+    cache.erase(i++);
   }
   return count;
 }
 
 bool MemRecursorCache::doAgeCache(time_t now, const string& name, uint16_t qtype, int32_t newTTL)
 {
-  cache_t::iterator iter = d_cache.find(tie(name, qtype));
+  MapCombo& mc=getMap(name);
+  Lock l(getLock(mc));
+  cache_t& cache=mc.d_cache;
+
+  cache_t::iterator iter = cache.find(tie(name, qtype));
   uint32_t maxTTD=std::numeric_limits<uint32_t>::min();
-  if(iter == d_cache.end()) {
+  if(iter == cache.end()) {
     return false;
   }
 
@@ -339,7 +435,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const string& name, uint16_t qtype
         j->d_ttd = newTTD;
     }
     
-    d_cache.replace(iter, ce);
+    cache.replace(iter, ce);
     return true;
   }
   return false;
@@ -374,21 +470,24 @@ uint64_t MemRecursorCache::doDump(int fd)
   if(!fp) { // dup probably failed
     return 0;
   }
-  fprintf(fp, "; main record cache dump from thread follows\n;\n");
+  fprintf(fp, d_shared ? "; main record cache dump, shared by all threads, follows\n;\n" : "; main record cache dump from thread follows\n;\n");
   typedef cache_t::nth_index<1>::type sequence_t;
-  sequence_t& sidx=d_cache.get<1>();
 
   uint64_t count=0;
   time_t now=time(0);
-  for(sequence_t::const_iterator i=sidx.begin(); i != sidx.end(); ++i) {
-    for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j != i->d_records.end(); ++j) {
-      count++;
-      try {
-        DNSResourceRecord rr=String2DNSRR(i->d_qname, QType(i->d_qtype), j->d_string, j->d_ttd - now);
-        fprintf(fp, "%s %d IN %s %s\n", rr.qname.c_str(), rr.ttl, rr.qtype.getName().c_str(), rr.content.c_str());
-      }
-      catch(...) {
-        fprintf(fp, "; error printing '%s'\n", i->d_qname.c_str());
+  for(maps_t::iterator mc=d_maps->begin(); mc != d_maps->end(); ++mc) {
+    Lock l(getLock(*mc));
+    sequence_t& sidx=mc->d_cache.get<1>();
+    for(sequence_t::const_iterator i=sidx.begin(); i != sidx.end(); ++i) {
+      for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j != i->d_records.end(); ++j) {
+        count++;
+        try {
+          DNSResourceRecord rr=String2DNSRR(i->d_qname, QType(i->d_qtype), j->d_string, j->d_ttd - now);
+          fprintf(fp, "%s %d IN %s %s\n", rr.qname.c_str(), rr.ttl, rr.qtype.getName().c_str(), rr.content.c_str());
+        }
+        catch(...) {
+          fprintf(fp, "; error printing '%s'\n", i->d_qname.c_str());
+        }
       }
     }
   }
@@ -396,11 +495,277 @@ uint64_t MemRecursorCache::doDump(int fd)
   return count;
 }
 
-void MemRecursorCache::doPrune(void)
+void MemRecursorCache::doPrune(unsigned int part, unsigned int parts)
 {
   d_cachecachevalid=false;
 
-  unsigned int maxCached=::arg().asNum("max-cache-entries") / g_numThreads;
-  pruneCollection(d_cache, maxCached);
+  unsigned int maxCached;
+  if(d_shared)
+    maxCached=max(::arg().asNum("max-cache-entries") / (unsigned int)d_maps->size(), 1U);
+  else
+    maxCached=::arg().asNum("max-cache-entries") / g_numThreads;
+
+  for(unsigned int n=part; n < d_maps->size(); n+=max(parts, 1U)) {
+    MapCombo& mc=(*d_maps)[n];
+    Lock l(getLock(mc));
+    pruneCollection(mc.d_cache, maxCached, 1000, s_serveStaleExtension);
+  }
+}
+
+
+/* Snapshots are a series of blocks, one for every thread that saved its caches. A block starts with
+   the magic and the time it was written, followed by the record cache, the negative cache and nsspeeds.
+   Each of these is a list of entries that start with a 1 byte, closed by a 0 byte. Numbers are in network order, 
+   strings are prefixed with their 16 bit length. As a ttd is absolute, loading needs no correction for the time passed. */
+static const char s_snapshotMagic[8]={'P','D','N','S','R','C','S','2'};
+
+namespace {
+class SnapshotWriter
+{
+public:
+  SnapshotWriter(FILE* fp) : d_fp(fp) {}
+  void put(const void* ptr, size_t len)
+  {
+    if(len && fwrite(ptr, 1, len, d_fp) != len)
+      throw runtime_error("Error writing cache snapshot: "+stringerror());
+  }
+  void put8(uint8_t val)
+  {
+    put(&val, 1);
+  }
+  void put16(uint16_t val)
+  {
+    val=htons(val);
+    put(&val, 2);
+  }
+  void put32(uint32_t val)
+  {
+    val=htonl(val);
+    put(&val, 4);
+  }
+  void putString(const string& str)
+  {
+    put16(str.size());
+    put(str.c_str(), str.size());
+  }
+private:
+  FILE* d_fp;
+};
+
+class SnapshotReader
+{
+public:
+  SnapshotReader(FILE* fp) : d_fp(fp) {}
+  void get(void* ptr, size_t len)
+  {
+    if(len && fread(ptr, 1, len, d_fp) != len)
+      throw runtime_error("cache snapshot is truncated");
+  }
+  uint8_t get8()
+  {
+    uint8_t ret;
+    get(&ret, 1);
+    return ret;
+  }
+  uint16_t get16()
+  {
+    uint16_t ret;
+    get(&ret, 2);
+    return ntohs(ret);
+  }
+  uint32_t get32()
+  {
+    uint32_t ret;
+    get(&ret, 4);
+    return ntohl(ret);
+  }
+  string getString()
+  {
+    string ret(get16(), '\0');
+    if(!ret.empty())
+      get(&ret[0], ret.size());
+    return ret;
+  }
+  bool atEnd()
+  {
+    int c=getc(d_fp);
+    if(c == EOF)
+      return true;
+    ungetc(c, d_fp);
+    return false;
+  }
+private:
+  FILE* d_fp;
+};
+}
+
+uint64_t MemRecursorCache::doSaveSnapshot(int fd)
+{
+  int ourfd=dup(fd);
+  FILE* fp=ourfd < 0 ? 0 : fdopen(ourfd, "w");
+  if(!fp) {
+    string err=stringerror();
+    if(ourfd >= 0)
+      close(ourfd);
+    throw runtime_error("Unable to open cache snapshot for writing: "+err);
+  }
+  uint64_t count=0;
+  SnapshotWriter sw(fp);
+  try {
+    sw.put(s_snapshotMagic, sizeof(s_snapshotMagic));
+    sw.put32(time(0));
+
+    for(maps_t::iterator mc=d_maps->begin(); mc != d_maps->end(); ++mc) {
+      Lock l(getLock(*mc));
+      for(cache_t::const_iterator i=mc->d_cache.begin(); i != mc->d_cache.end(); ++i) {
+        sw.put8(1);
+        sw.putString(i->d_qname);
+        sw.put16(i->d_qtype);
+        sw.put8(i->d_auth);
+        sw.put32(i->d_origttl);
+        sw.put16(i->d_records.size());
+        for(vector<StoredRecord>::const_iterator j=i->d_records.begin(); j != i->d_records.end(); ++j) {
+          sw.put32(j->d_ttd);
+          sw.putString(j->d_string);
+        }
+        count+=i->d_records.size();
+      }
+    }
+    sw.put8(0);
+
+    {
+      Lock l(t_sstorage->negcachelock);
+      for(SyncRes::negcache_t::const_iterator i=t_sstorage->negcache->begin(); i != t_sstorage->negcache->end(); ++i) {
+        sw.put8(1);
+        sw.putString(i->d_name);
+        sw.put16(i->d_qtype.getCode());
+        sw.putString(i->d_qname);
+        sw.put32(i->d_ttd);
+        count++;
+      }
+    }
+    sw.put8(0);
+
+    for(SyncRes::nsspeeds_t::const_iterator i=t_sstorage->nsSpeeds.begin(); i != t_sstorage->nsSpeeds.end(); ++i) {
+      sw.put8(1);
+      sw.putString(i->first);
+      const SyncRes::DecayingEwmaCollection::collection_t& coll=i->second.d_collection;
+      sw.put16(coll.size());
+      for(SyncRes::DecayingEwmaCollection::collection_t::const_iterator j=coll.begin(); j != coll.end(); ++j) {
+        const ComboAddress& ca=j->first;
+        sw.put8(ca.sin4.sin_family == AF_INET6 ? 6 : 4);
+        if(ca.sin4.sin_family == AF_INET6)
+          sw.put(ca.sin6.sin6_addr.s6_addr, 16);
+        else
+          sw.put(&ca.sin4.sin_addr.s_addr, 4);
+        sw.put16(ntohs(ca.sin4.sin_port));
+        float val=const_cast<DecayingEwma&>(j->second).peek();
+        uint32_t raw;
+        memcpy(&raw, &val, sizeof(raw));
+        sw.put32(raw);
+        sw.put32(j->second.lastGet());
+      }
+      count++;
+    }
+    sw.put8(0);
+  }
+  catch(...) {
+    fclose(fp);
+    throw;
+  }
+  if(fclose(fp)) // flushes what is still buffered
+    throw runtime_error("Error writing cache snapshot: "+stringerror());
+  return count;
 }
 
+uint64_t MemRecursorCache::doLoadSnapshot(int fd, time_t now)
+{
+  FILE* fp=fdopen(dup(fd), "r");
+  if(!fp)
+    throw runtime_error("Unable to open cache snapshot: "+stringerror());
+  uint64_t count=0;
+  SnapshotReader sr(fp);
+  try {
+    while(!sr.atEnd()) {
+      char magic[sizeof(s_snapshotMagic)];
+      sr.get(magic, sizeof(magic));
+      if(memcmp(magic, s_snapshotMagic, sizeof(magic)))
+        throw runtime_error("not a cache snapshot, or one of a different version");
+      sr.get32(); // when it was written
+
+      while(sr.get8()) {
+        string qname=sr.getString();
+        uint16_t qtype=sr.get16();
+        bool auth=sr.get8();
+        CacheEntry ce(make_tuple(qname, qtype), vector<StoredRecord>(), auth);
+        ce.d_origttl=sr.get32(); // so the entry can be prefetched again
+        for(uint16_t n=sr.get16(); n; --n) {
+          StoredRecord dr;
+          dr.d_ttd=sr.get32();
+          dr.d_string=sr.getString();
+          if(dr.d_ttd < 1000000000 || dr.d_ttd > (uint32_t) now) // see get()
+            ce.d_records.push_back(dr);
+        }
+        if(ce.d_records.empty())
+          continue;
+        MapCombo& mc=getMap(qname);
+        Lock l(getLock(mc));
+        if(mc.d_cache.insert(ce).second)
+          count+=ce.d_records.size();
+      }
+
+      while(sr.get8()) {
+        NegCacheEntry ne;
+        ne.d_name=sr.getString();
+        ne.d_qtype=sr.get16();
+        ne.d_qname=sr.getString();
+        ne.d_ttd=sr.get32();
+        if(ne.d_ttd <= (uint32_t)now)
+          continue;
+        Lock l(t_sstorage->negcachelock);
+        if(t_sstorage->negcache->insert(ne).second)
+          count++;
+      }
+
+      while(sr.get8()) {
+        SyncRes::DecayingEwmaCollection& coll=t_sstorage->nsSpeeds[sr.getString()];
+        for(uint16_t n=sr.get16(); n; --n) {
+          ComboAddress ca;
+          memset(&ca, 0, sizeof(ca));
+          if(sr.get8() == 6) {
+            ca.sin6.sin6_family=AF_INET6;
+            sr.get(ca.sin6.sin6_addr.s6_addr, 16);
+          }
+          else {
+            ca.sin4.sin_family=AF_INET;
+            sr.get(&ca.sin4.sin_addr.s_addr, 4);
+          }
+          ca.sin4.sin_port=htons(sr.get16());
+          uint32_t raw=sr.get32();
+          float val;
+          memcpy(&val, &raw, sizeof(val));
+          time_t lastget=sr.get32();
+
+          SyncRes::DecayingEwmaCollection::collection_t::const_iterator pos;
+          for(pos=coll.d_collection.begin(); pos != coll.d_collection.end(); ++pos)
+            if(pos->first == ca)
+              break;
+          if(pos == coll.d_collection.end()) {
+            DecayingEwma de;
+            de.restore(val, lastget);
+            coll.d_collection.push_back(make_pair(ca, de));
+          }
+        }
+        count++;
+      }
+    }
+  }
+  catch(...) {
+    d_cachecachevalid=false;
+    fclose(fp);
+    throw;
+  }
+  d_cachecachevalid=false;
+  fclose(fp);
+  return count;
+}
@@ -5,6 +5,7 @@
 #include "dns.hh"
 #include "qtype.hh"
 #include "misc.hh"
+#include "lock.hh"
 #include <iostream>
 
 #include <boost/utility.hpp>
@@ -22,27 +23,51 @@
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
+/** The record cache. Normally every thread has one of its own, but after makeShared() all
+    MemRecursorCache instances share a single cache, split into shards that each have a lock and their own
+    least recently used order. A name and all its types always live in the same shard.
+
+    The hit and miss counters, and the cache of the last equal_range, stay per instance. */
 class MemRecursorCache : public boost::noncopyable //  : public RecursorCache
 {
 public:
-  MemRecursorCache() : d_cachecachevalid(false)
+  MemRecursorCache();
+  //! from now on, new instances all use one cache of this many shards. Call this before starting threads
+  static void makeShared(unsigned int shards);
+  bool isShared() const
   {
-    cacheHits = cacheMisses = 0;
+    return d_shared;
   }
+
   unsigned int size();
   unsigned int bytes();
-  int get(time_t, const string &qname, const QType& qt, set<DNSResourceRecord>* res);
+  //! if prefetch is passed, it is set when the entry was hit often enough, and is close enough to expiry, to resolve it again
+  int get(time_t, const string &qname, const QType& qt, set<DNSResourceRecord>* res, bool* prefetch=0);
+
+  //! for serve-stale: like get(), but for records that expired less than s_serveStaleExtension seconds ago. They get a ttd of now+staleTTL
+  int getStale(time_t now, const string &qname, const QType& qt, set<DNSResourceRecord>* res, uint32_t staleTTL);
 
   int getDirect(time_t now, const char* qname, const QType& qt, uint32_t ttd[10], char* data[10], uint16_t len[10]);
   void replace(time_t, const string &qname, const QType& qt,  const set<DNSResourceRecord>& content, bool auth);
-  void doPrune(void);
+  //! prunes shards part, part+parts, part+2*parts, ... so threads can split the work on a shared cache
+  void doPrune(unsigned int part=0, unsigned int parts=1);
   void doSlash(int perc);
   uint64_t doDump(int fd);
   uint64_t doDumpNSSpeeds(int fd);
+  //! appends a binary snapshot of this cache, and of the negative cache and nsspeeds of this thread, to fd. Throws on error
+  uint64_t doSaveSnapshot(int fd);
+  //! reads all snapshots in fd, keeping what has not expired yet. Entries we already have are left alone
+  uint64_t doLoadSnapshot(int fd, time_t now);
 
   int doWipeCache(const string& name, uint16_t qtype=0xffff);
   bool doAgeCache(time_t now, const string& name, uint16_t qtype, int32_t newTTL);
   uint64_t cacheHits, cacheMisses;
+  //! prefetch when this percentage of the original TTL is left, 0 disables prefetching
+  static unsigned int s_prefetchPercentage;
+  //! and the entry was hit this many times since it was stored
+  static unsigned int s_prefetchHits;
+  //! expired records are kept, and can be served by getStale(), this many seconds after their TTL ran out. 0 disables serve-stale
+  static unsigned int s_serveStaleExtension;
 
 private:
   struct StoredRecord
@@ -66,7 +91,7 @@ private:
   struct CacheEntry
   {
     CacheEntry(const tuple<string, uint16_t>& key, const vector<StoredRecord>& records, bool auth) : 
-      d_qname(key.get<0>()), d_qtype(key.get<1>()), d_auth(auth), d_records(records)
+      d_qname(key.get<0>()), d_qtype(key.get<1>()), d_auth(auth), d_records(records), d_origttl(0), d_hits(0)
     {}
 
     typedef vector<StoredRecord> records_t;
@@ -86,6 +111,8 @@ private:
     uint16_t d_qtype;
     bool d_auth;
     records_t d_records;
+    uint32_t d_origttl; // the TTL the records had when they were stored
+    mutable uint32_t d_hits;
   };
 
   typedef multi_index_container<
@@ -103,7 +130,28 @@ private:
                >
   > cache_t;
 
-  cache_t d_cache;
+  struct MapCombo
+  {
+    ShardMutex d_mut;
+    cache_t d_cache;
+  };
+  typedef vector<MapCombo> maps_t;
+
+  MapCombo& getMap(const string& qname);
+  //! a private cache is not locked at all
+  pthread_mutex_t* getLock(MapCombo& mc)
+  {
+    if(!d_shared)
+      return 0;
+    return mc.d_mut;
+  }
+
+  maps_t d_ownmaps;
+  maps_t* d_maps;
+  bool d_shared;
+  static maps_t* s_sharedmaps;
+
+  // only used for a private cache, a shared one can change under us
   pair<cache_t::iterator, cache_t::iterator> d_cachecache;
   string d_cachedqname;
   bool d_cachecachevalid;
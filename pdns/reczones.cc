@@ -25,6 +25,13 @@
 #include "zoneparser-tng.hh"
 #include "logger.hh"
 #include "dnsrecords.hh"
+#include "dnsparser.hh"
+#include "dnswriter.hh"
+#include "dns_random.hh"
+#include "sstuff.hh"
+#include "lock.hh"
+#include <boost/scoped_ptr.hpp>
+#include <sys/stat.h>
 
 void primeHints(void)
 {
@@ -92,6 +99,270 @@ void primeHints(void)
   t_RC->replace(time(0),".", QType(QType::NS), nsset, true); // and stuff in the cache (auth)
 }
 
+/* The root mirror is a copy of the root zone, loaded from root-mirror-file or transferred from root-mirror-server,
+   and served as an auth-zone marked d_mirror so SyncRes hands out its delegations as referrals. Thread 0 checks for
+   a new version every SOA refresh interval. The check and the transfer run in a separate loader thread, so thread 0
+   keeps answering questions, and thread 0 hands the result to all threads once the loader is done. */
+struct RootMirrorVersion
+{
+  RootMirrorVersion() : d_serial(0), d_refresh(0), d_mtime(0) {}
+  uint32_t d_serial, d_refresh;
+  time_t d_mtime;
+};
+
+//! a check for a new root zone, filled in by thread 0 and the loader thread, and then read back by thread 0
+struct RootMirrorLoad
+{
+  RootMirrorLoad() : d_check(false), d_unchanged(false), d_ad(0) {}
+  string d_file, d_server;      //!< the settings when the load started, reload-zones might change them
+  bool d_check;                 //!< only load if the zone differs from d_version
+  RootMirrorVersion d_version;  //!< what we serve now, and after the load what was loaded
+  bool d_unchanged;
+  SyncRes::AuthDomain* d_ad;    //!< the new mirror, 0 if unchanged or on error
+  string d_error;
+};
+
+// all only touched by thread 0, or before the threads start
+static RootMirrorVersion s_rootMirrorVersion;
+static time_t s_rootMirrorNextCheck;
+static bool s_rootMirrorForce; //!< reload the zone on the next check, even if it did not change
+static RootMirrorLoad* s_rootMirrorLoading;
+
+static pthread_mutex_t s_rootMirrorLock = PTHREAD_MUTEX_INITIALIZER;
+static bool s_rootMirrorLoadDone; //!< set by the loader thread, protected by s_rootMirrorLock
+
+void* pleaseUseNewSDomainsMap(SyncRes::domainmap_t* newmap)
+{
+  t_sstorage->domainmap = newmap;
+  return 0;
+}
+
+//! sends a question over a fresh TCP connection to server, returns the socket to read the answers from
+static shared_ptr<Socket> sendTCPQuestion(const ComboAddress& server, const string& qname, uint16_t qtype)
+{
+  shared_ptr<Socket> sock(new Socket((AddressFamily)server.sin4.sin_family, Stream));
+  struct timeval tv;
+  tv.tv_sec=10;
+  tv.tv_usec=0;
+  setsockopt(sock->getHandle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(sock->getHandle(), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  sock->connect(server);
+
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->id=dns_random(0xffff);
+  uint16_t len=htons(packet.size());
+  string msg((const char*)&len, 2);
+  msg.append(packet.begin(), packet.end());
+  sock->writen(msg);
+  return sock;
+}
+
+static shared_ptr<MOADNSParser> readTCPAnswer(Socket& sock, const ComboAddress& server)
+{
+  uint16_t len;
+  readn2(sock.getHandle(), &len, 2);
+  len=ntohs(len);
+  string packet(len, '\0');
+  readn2(sock.getHandle(), &packet[0], len);
+  shared_ptr<MOADNSParser> mdp(new MOADNSParser(packet));
+  if(mdp->d_header.rcode)
+    throw PDNSException("root mirror server "+server.toStringWithPort()+" answered with rcode "+lexical_cast<string>(mdp->d_header.rcode));
+  return mdp;
+}
+
+static uint32_t getRootMirrorServerSerial(const string& serverName)
+{
+  ComboAddress server=parseIPAndPort(serverName, 53);
+  shared_ptr<Socket> sock=sendTCPQuestion(server, ".", QType::SOA);
+  shared_ptr<MOADNSParser> mdp=readTCPAnswer(*sock, server);
+  for(MOADNSParser::answers_t::const_iterator i=mdp->d_answers.begin(); i!=mdp->d_answers.end(); ++i) {
+    if(i->first.d_type == QType::SOA && i->first.d_place == DNSRecord::Answer) {
+      shared_ptr<SOARecordContent> soa=boost::dynamic_pointer_cast<SOARecordContent>(i->first.d_content);
+      if(soa)
+        return soa->d_st.serial;
+    }
+  }
+  throw PDNSException("root mirror server "+server.toStringWithPort()+" did not send a SOA record");
+}
+
+//! adds rr to ad, unless it is DNSSEC data we have no use for
+static void addMirrorRecord(SyncRes::AuthDomain& ad, DNSResourceRecord rr, RootMirrorVersion& version)
+{
+  if(rr.qtype.getCode() == QType::RRSIG || rr.qtype.getCode() == QType::NSEC)
+    return;
+  string tmp=DNSRR2String(rr);
+  rr=String2DNSRR(rr.qname, rr.qtype, tmp, rr.ttl);
+  if(rr.qtype.getCode() == QType::SOA && rr.qname == ".") {
+    vector<string> parts;
+    stringtok(parts, rr.content);
+    if(parts.size() >= 4) {
+      version.d_serial=atoi(parts[2].c_str());
+      version.d_refresh=atoi(parts[3].c_str());
+    }
+  }
+  if(rr.qtype.getCode() == QType::NS)
+    rr.content=toLower(rr.content);
+  ad.d_records.insert(rr);
+}
+
+//! fills ad with the root zone from fname or, if that is empty, from serverName. Throws if that does not work out
+static void loadRootMirror(SyncRes::AuthDomain& ad, const string& fname, const string& serverName, RootMirrorVersion& version)
+{
+  version=RootMirrorVersion();
+  ad.d_mirror=true;
+  if(!fname.empty()) {
+    struct stat st;
+    if(stat(fname.c_str(), &st) < 0)
+      throw PDNSException("Unable to stat root-mirror-file '"+fname+"': "+stringerror());
+    version.d_mtime=st.st_mtime;
+    L<<Logger::Warning<<"Loading root zone mirror from file '"<<fname<<"'"<<endl;
+    ZoneParserTNG zpt(fname, ".");
+    DNSResourceRecord rr;
+    while(zpt.get(rr))
+      addMirrorRecord(ad, rr, version);
+  }
+  else {
+    ComboAddress server=parseIPAndPort(serverName, 53);
+    L<<Logger::Warning<<"Transferring root zone mirror from "<<server.toStringWithPort()<<endl;
+    shared_ptr<Socket> sock=sendTCPQuestion(server, ".", QType::AXFR);
+    unsigned int soas=0;
+    while(soas < 2) {
+      shared_ptr<MOADNSParser> mdp=readTCPAnswer(*sock, server);
+      if(mdp->d_answers.empty())
+        throw PDNSException("root mirror server "+server.toStringWithPort()+" sent an empty AXFR message");
+      for(MOADNSParser::answers_t::const_iterator i=mdp->d_answers.begin(); i!=mdp->d_answers.end(); ++i) {
+        if(i->first.d_place != DNSRecord::Answer)
+          continue;
+        if(i->first.d_type == QType::SOA && ++soas == 2) // the closing SOA
+          break;
+        DNSResourceRecord rr;
+        rr.qtype=i->first.d_type;
+        rr.qname=i->first.d_label;
+        rr.ttl=i->first.d_ttl;
+        rr.content=i->first.d_content->getZoneRepresentation();
+        addMirrorRecord(ad, rr, version);
+      }
+    }
+  }
+
+  if(ad.d_records.find(make_tuple(string("."), QType(QType::SOA))) == ad.d_records.end() ||
+     ad.d_records.find(make_tuple(string("."), QType(QType::NS))) == ad.d_records.end())
+    throw PDNSException("root zone mirror has no SOA or NS records for the root");
+
+  version.d_refresh=max(version.d_refresh, 60U);
+  L<<Logger::Warning<<"Loaded "<<ad.d_records.size()<<" records of root zone serial "<<version.d_serial<<", checking for a new version in "<<version.d_refresh<<" seconds"<<endl;
+}
+
+//! the loader thread, does the blocking work of checkRootMirror
+static void* rootMirrorThread(void* ptr)
+{
+  RootMirrorLoad* load=(RootMirrorLoad*)ptr;
+  try {
+    if(load->d_check) {
+      if(!load->d_file.empty()) {
+        struct stat st;
+        load->d_unchanged = !stat(load->d_file.c_str(), &st) && st.st_mtime == load->d_version.d_mtime;
+      }
+      else
+        load->d_unchanged = getRootMirrorServerSerial(load->d_server) == load->d_version.d_serial;
+    }
+    if(!load->d_unchanged) {
+      load->d_ad=new SyncRes::AuthDomain();
+      loadRootMirror(*load->d_ad, load->d_file, load->d_server, load->d_version);
+    }
+  }
+  catch(std::exception& e) {
+    load->d_error=e.what();
+  }
+  catch(PDNSException& ae) {
+    load->d_error=ae.reason;
+  }
+  if(!load->d_error.empty()) {
+    delete load->d_ad;
+    load->d_ad=0;
+  }
+
+  Lock l(&s_rootMirrorLock);
+  s_rootMirrorLoadDone=true;
+  return 0;
+}
+
+//! picks up the result of a finished loader thread, and hands a new root zone to all threads
+static void finishRootMirrorLoad(time_t now)
+{
+  boost::scoped_ptr<RootMirrorLoad> load(s_rootMirrorLoading);
+  boost::scoped_ptr<SyncRes::AuthDomain> ad(load->d_ad);
+  s_rootMirrorLoading=0;
+  s_rootMirrorLoadDone=false;
+
+  if(!load->d_error.empty()) {
+    s_rootMirrorNextCheck=now + 300;
+    L<<Logger::Error<<"Unable to refresh root zone mirror, trying again in 300 seconds: "<<load->d_error<<endl;
+    return;
+  }
+  s_rootMirrorNextCheck=now + load->d_version.d_refresh;
+  if(load->d_unchanged)
+    return;
+
+  // reload-zones might have changed things while we were loading
+  SyncRes::domainmap_t* original=t_sstorage->domainmap;
+  SyncRes::domainmap_t::const_iterator current=original->find(".");
+  if((current != original->end() && !current->second.d_mirror) || load->d_file != ::arg()["root-mirror-file"] || load->d_server != ::arg()["root-mirror-server"])
+    return;
+
+  s_rootMirrorVersion=load->d_version;
+  SyncRes::domainmap_t* newDomainMap=new SyncRes::domainmap_t();
+  for(SyncRes::domainmap_t::const_iterator i=original->begin(); i != original->end(); ++i)
+    if(i->first != ".")
+      newDomainMap->insert(*i);
+  SyncRes::AuthDomain& root=(*newDomainMap)["."];
+  root.d_mirror=true;
+  root.d_records.swap(ad->d_records);
+  broadcastFunction(boost::bind(pleaseUseNewSDomainsMap, newDomainMap));
+  delete original;
+}
+
+/** called from housekeeping in thread 0. When the SOA refresh interval has passed, starts a loader thread that looks
+    for a new version of the root zone, by modification time for a file or by serial for a server, and loads it. */
+void checkRootMirror(time_t now)
+{
+  if(s_rootMirrorLoading) {
+    {
+      Lock l(&s_rootMirrorLock);
+      if(!s_rootMirrorLoadDone)
+        return;
+    }
+    finishRootMirrorLoad(now);
+    return;
+  }
+
+  if((::arg()["root-mirror-file"].empty() && ::arg()["root-mirror-server"].empty()) || now < s_rootMirrorNextCheck)
+    return;
+
+  SyncRes::domainmap_t::const_iterator current=t_sstorage->domainmap->find(".");
+  bool haveMirror = current != t_sstorage->domainmap->end() && current->second.d_mirror;
+  if(current != t_sstorage->domainmap->end() && !haveMirror)
+    return; // '.' is an auth-zone or a forward, which wins
+
+  RootMirrorLoad* load=new RootMirrorLoad();
+  load->d_file=::arg()["root-mirror-file"];
+  load->d_server=load->d_file.empty() ? ::arg()["root-mirror-server"] : "";
+  load->d_check=haveMirror && !s_rootMirrorForce;
+  load->d_version=s_rootMirrorVersion;
+
+  pthread_t tid;
+  if(pthread_create(&tid, 0, rootMirrorThread, (void*)load)) {
+    delete load;
+    s_rootMirrorNextCheck=now + 300;
+    L<<Logger::Error<<"Unable to start a thread to refresh the root zone mirror, trying again in 300 seconds: "<<stringerror()<<endl;
+    return;
+  }
+  pthread_detach(tid);
+  s_rootMirrorForce=false;
+  s_rootMirrorLoading=load;
+}
+
 static void makeNameToIPZone(SyncRes::domainmap_t* newMap, const string& hostname, const string& ip)
 {
   SyncRes::AuthDomain ad;
@@ -219,15 +490,11 @@ void convertServersForAD(const std::string& input, SyncRes::AuthDomain& ad, cons
 
 void* pleaseWipeNegCache()
 {
-  t_sstorage->negcache.clear();   
+  Lock l(t_sstorage->negcachelock);
+  t_sstorage->negcache->clear();
   return 0;
 }
 
-void* pleaseUseNewSDomainsMap(SyncRes::domainmap_t* newmap)
-{
-  t_sstorage->domainmap = newmap;
-  return 0;
-}
 
 string reloadAuthAndForwards()
 {
@@ -237,6 +504,8 @@ string reloadAuthAndForwards()
     L<<Logger::Warning<<"Reloading zones, purging data from cache"<<endl;
   
     for(SyncRes::domainmap_t::const_iterator i = t_sstorage->domainmap->begin(); i != t_sstorage->domainmap->end(); ++i) {
+      if(i->second.d_mirror) // mirrored data is what we would have cached anyhow
+        continue;
       for(SyncRes::AuthDomain::records_t::const_iterator j = i->second.d_records.begin(); j != i->second.d_records.end(); ++j) 
         broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, j->qname));
     }
@@ -251,11 +520,15 @@ string reloadAuthAndForwards()
     ::arg().preParseFile(configname.c_str(), "auth-zones");
     ::arg().preParseFile(configname.c_str(), "export-etc-hosts", "off");
     ::arg().preParseFile(configname.c_str(), "serve-rfc1918");
+    ::arg().preParseFile(configname.c_str(), "root-mirror-file");
+    ::arg().preParseFile(configname.c_str(), "root-mirror-server");
 
-    SyncRes::domainmap_t* newDomainMap = parseAuthAndForwards();
+    SyncRes::domainmap_t* newDomainMap = parseAuthAndForwards(original);
     
     // purge again - new zones need to blank out the cache
     for(SyncRes::domainmap_t::const_iterator i = newDomainMap->begin(); i != newDomainMap->end(); ++i) {
+      if(i->second.d_mirror)
+        continue;
       for(SyncRes::AuthDomain::records_t::const_iterator j = i->second.d_records.begin(); j != i->second.d_records.end(); ++j) 
         broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, j->qname));
     }
@@ -278,7 +551,7 @@ string reloadAuthAndForwards()
   return "reloading failed, see log\n";
 }
 
-SyncRes::domainmap_t* parseAuthAndForwards()
+SyncRes::domainmap_t* parseAuthAndForwards(const SyncRes::domainmap_t* previous)
 {
   TXTRecordContent::report();
   OPTRecordContent::report();
@@ -436,6 +709,31 @@ SyncRes::domainmap_t* parseAuthAndForwards()
       makeIPToNamesZone(newMap,parts);
     }
   }
+
+  if(!::arg()["root-mirror-file"].empty() || !::arg()["root-mirror-server"].empty()) {
+    if(newMap->count("."))
+      L<<Logger::Warning<<"Not loading the root zone mirror, '.' is already configured as an auth or forward zone"<<endl;
+    else if(previous && previous->count(".") && previous->find(".")->second.d_mirror) {
+      // keep serving what we have, and let the loader thread fetch the zone in the background
+      (*newMap)["."]=previous->find(".")->second;
+      s_rootMirrorForce=true;
+      s_rootMirrorNextCheck=0;
+    }
+    else {
+      try {
+        loadRootMirror((*newMap)["."], ::arg()["root-mirror-file"], ::arg()["root-mirror-file"].empty() ? ::arg()["root-mirror-server"] : "", s_rootMirrorVersion);
+        s_rootMirrorNextCheck=time(0) + s_rootMirrorVersion.d_refresh;
+      }
+      catch(std::exception& e) {
+        newMap->erase(".");
+        L<<Logger::Error<<"Unable to load root zone mirror, will query the root servers: "<<e.what()<<endl;
+      }
+      catch(PDNSException& ae) {
+        newMap->erase(".");
+        L<<Logger::Error<<"Unable to load root zone mirror, will query the root servers: "<<ae.reason<<endl;
+      }
+    }
+  }
   return newMap;
 }
 
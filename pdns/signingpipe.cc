@@ -68,7 +68,7 @@ catch(std::exception& e) {
 }
 
 ChunkedSigningPipe::ChunkedSigningPipe(const std::string& signerName, bool mustSign, const pdns::string& servers, unsigned int workers) 
-  : d_queued(0), d_outstanding(0), d_signer(signerName), d_maxchunkrecords(100), d_numworkers(workers), d_tids(d_numworkers),
+  : d_queued(0), d_outstanding(0), d_signer(signerName), d_maxchunkrecords(100), d_maxoutstanding(100*workers), d_numworkers(workers), d_tids(d_numworkers),
     d_mustSign(mustSign), d_final(false), d_submitted(0)
 {
   d_rrsetToSign = new rrset_t;
@@ -209,6 +209,11 @@ void ChunkedSigningPipe::sendRRSetToWorker() // it sounds so socialist!
   bool wantRead, wantWrite;
   
   wantWrite = !d_rrsetToSign->empty();
+  
+  // if the signers fall behind, stop feeding them until they catch up, so the backlog we hold stays bounded
+  while(wantWrite && d_outstanding >= d_maxoutstanding)
+    readSigned(waitForRW(true, false, -1).first);
+  
   wantRead = d_outstanding || wantWrite;  // if we wrote, we want to read
   
   pair<vector<int>, vector<int> > rwVect;
@@ -226,32 +231,7 @@ void ChunkedSigningPipe::sendRRSetToWorker() // it sounds so socialist!
   
   if(wantRead) {
     while(d_outstanding) {
-      chunk_t* chunk;
-      
-      BOOST_FOREACH(int fd, rwVect.first) {
-        if(d_eof.count(fd))
-          continue;
-        
-        while(d_outstanding) {
-          int res = readn(fd, &chunk, sizeof(chunk));
-          if(!res) {
-            d_eof.insert(fd);
-            break;
-          }
-          if(res < 0) {
-            if(errno != EAGAIN && errno != EINTR)
-              unixDie("Error reading signed chunk from thread");
-            else
-              break;
-          }
-          
-          --d_outstanding;
-          
-          addSignedToChunks(chunk);
-          
-          delete chunk;
-        }
-      }
+      readSigned(rwVect.first);
       if(!d_outstanding || !d_final)
         break;
       rwVect = waitForRW(1, 0, -1); // wait for something to happen  
@@ -269,6 +249,37 @@ void ChunkedSigningPipe::sendRRSetToWorker() // it sounds so socialist!
   
 }
 
+//! picks up whatever signed RRSETs the workers on fds have ready
+void ChunkedSigningPipe::readSigned(const vector<int>& fds)
+{
+  chunk_t* chunk;
+  
+  BOOST_FOREACH(int fd, fds) {
+    if(d_eof.count(fd))
+      continue;
+    
+    while(d_outstanding) {
+      int res = readn(fd, &chunk, sizeof(chunk));
+      if(!res) {
+        d_eof.insert(fd);
+        break;
+      }
+      if(res < 0) {
+        if(errno != EAGAIN && errno != EINTR)
+          unixDie("Error reading signed chunk from thread");
+        else
+          break;
+      }
+      
+      --d_outstanding;
+      
+      addSignedToChunks(chunk);
+      
+      delete chunk;
+    }
+  }
+}
+
 unsigned int ChunkedSigningPipe::getReady()
 {
    unsigned int sum=0; 
@@ -34,6 +34,7 @@ private:
   void dedupRRSet();
   void sendRRSetToWorker(); // dispatch RRSET to worker
   void addSignedToChunks(chunk_t* signedChunk);
+  void readSigned(const vector<int>& fds);
   pair<vector<int>, vector<int> > waitForRW(bool rd, bool wr, int seconds);
 
   void worker(int n, int fd);
@@ -44,6 +45,7 @@ private:
   string d_signer;
   
   chunk_t::size_type d_maxchunkrecords;
+  int d_maxoutstanding; //!< RRSETs we allow the workers to hold at once
   
   std::vector<int> d_sockets;
   std::set<int> d_eof;
@@ -0,0 +1,106 @@
+/*
+    PowerDNS Versatile Database Driven Nameserver
+    Copyright (C) 2014  PowerDNS.COM BV
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2
+    as published by the Free Software Foundation
+
+    Additionally, the license of this program contains a special
+    exception which allows to distribute the program in binary form when
+    it is linked against OpenSSL.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef PDNS_SPSCRING_HH
+#define PDNS_SPSCRING_HH
+
+#include <vector>
+#include <stdint.h>
+#include <boost/utility.hpp>
+
+/** Bounded ring between exactly one producer thread and one consumer thread, without locks or CAS.
+
+    The slots are allocated up front and handed out in place: the producer fills the slot it gets from
+    getWriteSlot() and then publish()es it, the consumer looks at getReadSlot() and release()s it when
+    done. The capacity is rounded up to a power of two.
+
+    publish() returns true if the ring was empty before, which is when a sleeping consumer needs a wakeup.
+    This is safe because the consumer re-checks for new items after every release(), and both sides put a
+    full barrier between their own store and their load of the other side's position: either the consumer
+    sees the new item, or the producer sees that everything before it was consumed. */
+template<typename T> class SPSCRing : public boost::noncopyable
+{
+public:
+  SPSCRing(size_t capacity) : d_head(0), d_tail(0)
+  {
+    size_t size=2;
+    while(size < capacity)
+      size<<=1;
+    d_mask=size-1;
+    d_slots.resize(size);
+  }
+
+  //! producer side, returns 0 if the ring is full
+  T* getWriteSlot()
+  {
+    if(d_head - d_tail > d_mask)
+      return 0;
+    return &d_slots[d_head & d_mask];
+  }
+
+  //! producer side, makes the slot from getWriteSlot() visible. Returns true if the consumer should be woken
+  bool publish()
+  {
+    size_t head=d_head;
+    __sync_synchronize(); // slot contents before the new head
+    d_head=head+1;
+    __sync_synchronize(); // new head before looking at the tail
+    return d_tail == head;
+  }
+
+  //! consumer side, returns 0 if the ring is empty
+  T* getReadSlot()
+  {
+    if(d_tail == d_head)
+      return 0;
+    __sync_synchronize(); // head before slot contents
+    return &d_slots[d_tail & d_mask];
+  }
+
+  //! consumer side, hands the slot from getReadSlot() back to the producer
+  void release()
+  {
+    __sync_synchronize(); // done with the slot before the producer can reuse it
+    d_tail=d_tail+1;
+    __sync_synchronize(); // new tail before the next look at the head
+  }
+
+  size_t size() const
+  {
+    return d_head - d_tail;
+  }
+
+  size_t capacity() const
+  {
+    return d_mask+1;
+  }
+
+private:
+  std::vector<T> d_slots;
+  size_t d_mask;
+  char d_pad0[64]; // keep producer and consumer off each other's cache line
+  volatile size_t d_head;
+  char d_pad1[64];
+  volatile size_t d_tail;
+  char d_pad2[64];
+};
+
+#endif
@@ -59,8 +59,11 @@ unsigned int SyncRes::s_nodelegated;
 unsigned int SyncRes::s_unreachables;
 bool SyncRes::s_doIPv6;
 bool SyncRes::s_nopacketcache;
+SyncRes::negcache_t* SyncRes::s_sharednegcache;
+pthread_mutex_t SyncRes::s_negcachelock = PTHREAD_MUTEX_INITIALIZER;
 
 string SyncRes::s_serverID;
+unsigned int SyncRes::s_serveStaleDeadlineMsec;
 SyncRes::LogMode SyncRes::s_lm;
 
 #define LOG(x) if(d_lm == Log) { L <<Logger::Warning << x; } else if(d_lm == Store) { d_trace << x; }
@@ -72,11 +75,19 @@ bool SyncRes::s_doAAAAAdditionalProcessing;
 
 SyncRes::SyncRes(const struct timeval& now) :  d_outqueries(0), d_tcpoutqueries(0), d_throttledqueries(0), d_timeouts(0), d_unreachables(0),
                                                  d_now(now),
-                                                 d_cacheonly(false), d_nocache(false),   d_doEDNS0(false), d_lm(s_lm)
+                                                 d_cacheonly(false), d_nocache(false),   d_doEDNS0(false), d_refresh(false), 
+                                                 d_staleDeadlinePassed(false), d_lm(s_lm)
                                                  
 { 
+  d_staleDeadline.tv_sec=d_staleDeadline.tv_usec=0;
   if(!t_sstorage) {
     t_sstorage = new StaticStorage();
+    if(s_sharednegcache) {
+      t_sstorage->negcache = s_sharednegcache;
+      t_sstorage->negcachelock = &s_negcachelock;
+    }
+    else
+      t_sstorage->negcache = new negcache_t();
   }
 }
 
@@ -126,15 +137,64 @@ int SyncRes::beginResolve(const string &qname, const QType &qtype, uint16_t qcla
   else if(qclass!=QClass::IN)
     return -1;
   
+  bool serveStale = MemRecursorCache::s_serveStaleExtension && !d_refresh && !d_cacheonly;
+  if(serveStale && s_serveStaleDeadlineMsec) {
+    d_staleQname=qname;
+    d_staleQtype=qtype;
+    struct timeval wait;
+    wait.tv_sec=s_serveStaleDeadlineMsec/1000;
+    wait.tv_usec=(s_serveStaleDeadlineMsec%1000)*1000;
+    d_staleDeadline=d_now + wait;
+  }
+
   set<GetBestNSAnswer> beenthere;
   int res=doResolve(qname, qtype, ret, 0, beenthere);
+
+  if(res==RCode::ServFail && serveStale && doStaleCheck(qname, qtype, ret)) {
+    g_stats.staleAnswers++;
+    res=0;
+    if(d_staleDeadlinePassed) // we never found out if the authoritative servers are back, do so in the background
+      d_prefetches.push_back(make_pair(qname, qtype));
+  }
+
   if(!res && s_doAdditionalProcessing)
     addCruft(qname, ret);
   return res;
 }
 
+/** RFC 8767: answer with records that expired less than serve-stale-extension seconds ago when resolving
+    failed or took too long. Only the exact type, or a CNAME, is looked for. */
+bool SyncRes::doStaleCheck(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret)
+{
+  set<DNSResourceRecord> stale;
+  if(t_RC->getStale(d_now.tv_sec, qname, qtype, &stale, s_serveStaleTTL) <= 0 &&
+     (qtype.getCode()==QType::CNAME || t_RC->getStale(d_now.tv_sec, qname, QType(QType::CNAME), &stale, s_serveStaleTTL) <= 0))
+    return false;
+
+  LOG(d_prefix<<qname<<": Resolving failed, answering with "<<stale.size()<<" stale records"<<endl);
+  ret.clear();
+  for(set<DNSResourceRecord>::const_iterator i=stale.begin(); i != stale.end(); ++i) {
+    DNSResourceRecord rr=*i;
+    rr.ttl-=d_now.tv_sec;
+    rr.d_place=DNSResourceRecord::ANSWER;
+    ret.push_back(rr);
+  }
+  return true;
+}
+
+//! true if the serve-stale deadline passed and there is stale data to answer with. Checks the cache only once
+bool SyncRes::staleDeadlinePassed()
+{
+  if(!d_staleDeadline.tv_sec || d_now < d_staleDeadline)
+    return false;
+  d_staleDeadline.tv_sec=0;
+  d_staleDeadlinePassed = t_RC->getStale(d_now.tv_sec, d_staleQname, d_staleQtype, 0, s_serveStaleTTL) > 0 ||
+    t_RC->getStale(d_now.tv_sec, d_staleQname, QType(QType::CNAME), 0, s_serveStaleTTL) > 0;
+  return d_staleDeadlinePassed;
+}
+
 //! This is the 'out of band resolver', in other words, the authoritative server
-bool SyncRes::doOOBResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int& res)
+bool SyncRes::doOOBResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int& res, bool* mirrorReferral)
 {
   string prefix;
   if(doLog()) {
@@ -153,6 +213,14 @@ bool SyncRes::doOOBResolve(const string &qname, const QType &qtype, vector<DNSRe
   LOG(prefix<<qname<<": auth storage has data, zone='"<<authdomain<<"'"<<endl);
   pair<AuthDomain::records_t::const_iterator, AuthDomain::records_t::const_iterator> range;
 
+  if(iter->second.d_mirror && doMirrorReferral(qname, qtype, iter->second, authdomain, ret)) {
+    LOG(prefix<<qname<<": mirror of '"<<authdomain<<"' has a delegation for this query, referring"<<endl);
+    if(mirrorReferral)
+      *mirrorReferral=true;
+    res=0;
+    return true;
+  }
+
   range=iter->second.d_records.equal_range(tie(qname)); // partial lookup
 
   ret.clear();
@@ -240,7 +308,7 @@ void SyncRes::doEDNSDumpAndClose(int fd)
   fprintf(fp,"IP Address\tMode\tMode last updated at\n");
 
   for(ednsstatus_t::const_iterator iter = t_sstorage->ednsstatus.begin(); iter != t_sstorage->ednsstatus.end(); ++iter) {
-    fprintf(fp, "%s\t%d\t%s", iter->first.toString().c_str(), (int)iter->second.mode, ctime(&iter->second.modeSetAt));
+    fprintf(fp, "%s\t%d\t%s", iter->address.toString().c_str(), (int)iter->mode, ctime(&iter->modeSetAt));
   }
 
   fclose(fp);
@@ -283,18 +351,18 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, i
     return asyncresolve(ip, domain, type, doTCP, sendRDQuery, 0, now, res);
   }
 
-  SyncRes::EDNSStatus* ednsstatus;
-  ednsstatus = &t_sstorage->ednsstatus[ip];
+  // we work on a copy, the entry may be expired while we wait for the answer
+  SyncRes::EDNSStatus ednsstatus=getEDNSStatus(ip);
 
-  if(ednsstatus->modeSetAt && ednsstatus->modeSetAt + 3600 < d_now.tv_sec) {
-    *ednsstatus=SyncRes::EDNSStatus();
+  if(ednsstatus.modeSetAt && ednsstatus.modeSetAt + 3600 < d_now.tv_sec) {
+    ednsstatus=SyncRes::EDNSStatus();
     //    cerr<<"Resetting EDNS Status for "<<ip.toString()<<endl);
   }
 
-  if(s_noEDNSPing && ednsstatus->mode == EDNSStatus::UNKNOWN)
-    ednsstatus->mode = EDNSStatus::EDNSNOPING;
+  if(s_noEDNSPing && ednsstatus.mode == EDNSStatus::UNKNOWN)
+    ednsstatus.mode = EDNSStatus::EDNSNOPING;
 
-  SyncRes::EDNSStatus::EDNSMode& mode=ednsstatus->mode;
+  SyncRes::EDNSStatus::EDNSMode& mode=ednsstatus.mode;
   SyncRes::EDNSStatus::EDNSMode oldmode = mode;
   int EDNSLevel=0;
 
@@ -316,6 +384,9 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, i
     ret=asyncresolve(ip, domain, type, doTCP, sendRDQuery, EDNSLevel, now, res);
     if(ret == 0 || ret < 0) {
       //      cerr<<"Transport error or timeout (ret="<<ret<<"), no change in mode"<<endl);
+      if(oldmode != mode) // we did downgrade before trying again
+        ednsstatus.modeSetAt=d_now.tv_sec;
+      storeEDNSStatus(ip, ednsstatus);
       return ret;
     }
 
@@ -329,7 +400,7 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, i
       }
       else {
         g_stats.ednsPingMatches++;
-        ednsstatus->modeSetAt=d_now.tv_sec; // only the very best mode self-perpetuates
+        ednsstatus.modeSetAt=d_now.tv_sec; // only the very best mode self-perpetuates
       }
     }
     else if(mode==EDNSStatus::UNKNOWN || mode==EDNSStatus::EDNSPINGOK || mode == EDNSStatus::EDNSIGNORANT ) {
@@ -372,14 +443,47 @@ int SyncRes::asyncresolveWrapper(const ComboAddress& ip, const string& domain, i
       }
     }
     if(oldmode != mode)
-      ednsstatus->modeSetAt=d_now.tv_sec;
+      ednsstatus.modeSetAt=d_now.tv_sec;
     //        cerr<<"Result: ret="<<ret<<", EDNS-level: "<<EDNSLevel<<", haveEDNS: "<<res->d_haveEDNS<<", EDNS-PING correct: "<<res->d_pingCorrect<<", new mode: "<<mode<<endl);  
     
+    storeEDNSStatus(ip, ednsstatus);
     return ret;
   }
+  if(oldmode != mode)
+    ednsstatus.modeSetAt=d_now.tv_sec;
+  storeEDNSStatus(ip, ednsstatus);
   return ret;
 }
 
+SyncRes::EDNSStatus SyncRes::getEDNSStatus(const ComboAddress& ip)
+{
+  ednsstatus_t::const_iterator i=t_sstorage->ednsstatus.find(ip);
+  if(i != t_sstorage->ednsstatus.end())
+    return *i;
+  return EDNSStatus();
+}
+
+// an entry that was never confirmed tells us nothing, and is not worth keeping
+void SyncRes::storeEDNSStatus(const ComboAddress& ip, EDNSStatus status)
+{
+  ednsstatus_t& table=t_sstorage->ednsstatus;
+  typedef ednsstatus_t::nth_index<1>::type bysetat_t;
+  bysetat_t& bysetat=table.get<1>();
+  for(int n=0; n < 2 && !bysetat.empty() && bysetat.begin()->modeSetAt + 3600 < d_now.tv_sec; ++n)
+    bysetat.erase(bysetat.begin());
+
+  status.address=ip;
+  ednsstatus_t::iterator i=table.find(ip);
+  if(!status.modeSetAt) {
+    if(i != table.end())
+      table.erase(i);
+  }
+  else if(i == table.end())
+    table.insert(status);
+  else
+    table.replace(i, status);
+}
+
 int SyncRes::doResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, set<GetBestNSAnswer>& beenthere)
 {
   string prefix;
@@ -395,7 +499,7 @@ int SyncRes::doResolve(const string &qname, const QType &qtype, vector<DNSResour
       LOG(prefix<<qname<<": Recursion not requested for '"<<qname<<"|"<<qtype.getName()<<"', peeking at auth/forward zones"<<endl);
       string authname(qname);
       domainmap_t::const_iterator iter=getBestAuthZone(&authname);
-      if(iter != t_sstorage->domainmap->end()) {
+      if(iter != t_sstorage->domainmap->end() && !iter->second.d_mirror) {
         const vector<ComboAddress>& servers = iter->second.d_servers;
         if(servers.empty()) {
           ret.clear();
@@ -421,7 +525,7 @@ int SyncRes::doResolve(const string &qname, const QType &qtype, vector<DNSResour
     if(doCNAMECacheCheck(qname,qtype,ret,depth,res)) // will reroute us if needed
       return res;
     
-    if(doCacheCheck(qname,qtype,ret,depth,res)) // we done
+    if(!(d_refresh && !depth) && doCacheCheck(qname,qtype,ret,depth,res)) // we done
       return res;
   }
 
@@ -579,6 +683,43 @@ void SyncRes::getBestNSFromCache(const string &qname, set<DNSResourceRecord>&bes
   }while(chopOffDotted(subdomain));
 }
 
+/** A mirrored zone holds the delegations and glue of the real one, so a name at or below a zone cut gets a referral,
+    with the glue in the additional section, like it would from the authoritative servers. NS and DS questions for
+    the cut itself are answered from the parent side data. */
+bool SyncRes::doMirrorReferral(const string &qname, const QType &qtype, const AuthDomain& ad, const string& authdomain, vector<DNSResourceRecord>&ret)
+{
+  string cut(qname);
+  do {
+    if(pdns_iequals(cut, authdomain))
+      return false;
+    pair<AuthDomain::records_t::const_iterator, AuthDomain::records_t::const_iterator> range;
+    range=ad.d_records.equal_range(make_tuple(cut, QType(QType::NS)));
+    if(range.first == range.second)
+      continue;
+    if(pdns_iequals(cut, qname) && (qtype.getCode()==QType::NS || qtype.getCode()==QType::DS))
+      return false;
+
+    ret.clear();
+    for(AuthDomain::records_t::const_iterator ns=range.first; ns != range.second; ++ns) {
+      DNSResourceRecord rr=*ns;
+      rr.d_place=DNSResourceRecord::AUTHORITY;
+      ret.push_back(rr);
+    }
+    for(AuthDomain::records_t::const_iterator ns=range.first; ns != range.second; ++ns) {
+      pair<AuthDomain::records_t::const_iterator, AuthDomain::records_t::const_iterator> glue=ad.d_records.equal_range(tie(ns->content));
+      for(AuthDomain::records_t::const_iterator g=glue.first; g != glue.second; ++g) {
+        if(g->qtype.getCode() != QType::A && g->qtype.getCode() != QType::AAAA)
+          continue;
+        DNSResourceRecord rr=*g;
+        rr.d_place=DNSResourceRecord::ADDITIONAL;
+        ret.push_back(rr);
+      }
+    }
+    return true;
+  } while(chopOffDotted(cut));
+  return false;
+}
+
 SyncRes::domainmap_t::const_iterator SyncRes::getBestAuthZone(string* qname)
 {
   SyncRes::domainmap_t::const_iterator ret;
@@ -597,6 +738,21 @@ string SyncRes::getBestNSNamesFromCache(const string &qname, set<string, CIStrin
   string authdomain(qname);
   
   domainmap_t::const_iterator iter=getBestAuthZone(&authdomain);
+  if(iter!=t_sstorage->domainmap->end() && iter->second.d_mirror) {
+    // a mirror stands in for the nameservers of its zone only, delegations below it that we know about are used as usual
+    set<DNSResourceRecord> bestns;
+    getBestNSFromCache(subdomain, bestns, flawedNSSet, depth, beenthere);
+    if(!bestns.empty() && moreSpecificThan(bestns.begin()->qname, authdomain)) {
+      for(set<DNSResourceRecord>::const_iterator k=bestns.begin();k!=bestns.end();++k) {
+        nsset.insert(k->content);
+        if(k==bestns.begin())
+          subdomain=k->qname;
+      }
+      return subdomain;
+    }
+    nsset.insert(string());
+    return authdomain;
+  }
   if(iter!=t_sstorage->domainmap->end()) {
     if( iter->second.d_servers.empty() )
       nsset.insert(string()); // this gets picked up in doResolveAt, if empty it means "we are auth", otherwise it denotes a forward
@@ -675,39 +831,43 @@ bool SyncRes::doCacheCheck(const string &qname, const QType &qtype, vector<DNSRe
   uint32_t sttl=0;
   //  cout<<"Lookup for '"<<qname<<"|"<<qtype.getName()<<"'\n";
   
-  pair<negcache_t::const_iterator, negcache_t::const_iterator> range=t_sstorage->negcache.equal_range(tie(qname));
-  negcache_t::iterator ni;
-  for(ni=range.first; ni != range.second; ni++) {
-    // we have something
-    if(ni->d_qtype.getCode() == 0 || ni->d_qtype == qtype) {
-      res=0;
-      if((uint32_t)d_now.tv_sec < ni->d_ttd) {
-        sttl=ni->d_ttd - d_now.tv_sec;
-        if(ni->d_qtype.getCode()) {
-          LOG(prefix<<qname<<": "<<qtype.getName()<<" is negatively cached via '"<<ni->d_qname<<"' for another "<<sttl<<" seconds"<<endl);
-          res = RCode::NoError;
+  {
+    Lock nl(t_sstorage->negcachelock);
+    negcache_t& negcache=*t_sstorage->negcache;
+    pair<negcache_t::const_iterator, negcache_t::const_iterator> range=negcache.equal_range(tie(qname));
+    negcache_t::iterator ni;
+    for(ni=range.first; ni != range.second; ni++) {
+      // we have something
+      if(ni->d_qtype.getCode() == 0 || ni->d_qtype == qtype) {
+        res=0;
+        if((uint32_t)d_now.tv_sec < ni->d_ttd) {
+          sttl=ni->d_ttd - d_now.tv_sec;
+          if(ni->d_qtype.getCode()) {
+            LOG(prefix<<qname<<": "<<qtype.getName()<<" is negatively cached via '"<<ni->d_qname<<"' for another "<<sttl<<" seconds"<<endl);
+            res = RCode::NoError;
+          }
+          else {
+            LOG(prefix<<qname<<": Entire record '"<<qname<<"', is negatively cached via '"<<ni->d_qname<<"' for another "<<sttl<<" seconds"<<endl);
+            res= RCode::NXDomain; 
+          }
+          giveNegative=true;
+          sqname=ni->d_qname;
+          sqt=QType::SOA;
+          moveCacheItemToBack(negcache, ni);
+          break;
         }
         else {
-          LOG(prefix<<qname<<": Entire record '"<<qname<<"', is negatively cached via '"<<ni->d_qname<<"' for another "<<sttl<<" seconds"<<endl);
-          res= RCode::NXDomain; 
+          LOG(prefix<<qname<<": Entire record '"<<qname<<"' or type was negatively cached, but entry expired"<<endl);
+          moveCacheItemToFront(negcache, ni);
         }
-        giveNegative=true;
-        sqname=ni->d_qname;
-        sqt=QType::SOA;
-        moveCacheItemToBack(t_sstorage->negcache, ni);
-        break;
-      }
-      else {
-        LOG(prefix<<qname<<": Entire record '"<<qname<<"' or type was negatively cached, but entry expired"<<endl);
-        moveCacheItemToFront(t_sstorage->negcache, ni);
       }
     }
   }
 
   set<DNSResourceRecord> cset;
-  bool found=false, expired=false;
+  bool found=false, expired=false, prefetch=false;
 
-  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset) > 0) {
+  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, d_refresh ? 0 : &prefetch) > 0) {
     LOG(prefix<<sqname<<": Found cache hit for "<<sqt.getName()<<": ");
     for(set<DNSResourceRecord>::const_iterator j=cset.begin();j!=cset.end();++j) {
       LOG(j->content);
@@ -732,6 +892,10 @@ bool SyncRes::doCacheCheck(const string &qname, const QType &qtype, vector<DNSRe
     if(found && !expired) {
       if(!giveNegative)
         res=0;
+      if(prefetch && !giveNegative) {
+        LOG(prefix<<sqname<<": Popular and about to expire, will prefetch"<<endl);
+        d_prefetches.push_back(make_pair(sqname, sqt));
+      }
       return true;
     }
     else
@@ -860,9 +1024,10 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
       LWResult lwr;
       if(tns->empty()) {
         LOG(prefix<<qname<<": Domain is out-of-band"<<endl);
-        doOOBResolve(qname, qtype, lwr.d_result, depth, lwr.d_rcode);
+        bool mirrorReferral=false;
+        doOOBResolve(qname, qtype, lwr.d_result, depth, lwr.d_rcode, &mirrorReferral);
         lwr.d_tcbit=false;
-        lwr.d_aabit=true;
+        lwr.d_aabit=!mirrorReferral; // the root servers don't set aa on a delegation either, so it does not overwrite child data in the cache
       }
       else {
         LOG(prefix<<qname<<": Trying to resolve NS '"<<*tns<< "' ("<<1+tns-rnameservers.begin()<<"/"<<(unsigned int)rnameservers.size()<<")"<<endl);
@@ -917,6 +1082,10 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
             s_dontqueries++;
             continue;
           }
+          else if(d_staleDeadlinePassed || staleDeadlinePassed()) {
+            LOG(prefix<<qname<<": taking too long, giving up so stale data can be served"<<endl);
+            return -1;
+          }
           else {
             s_outqueries++; d_outqueries++;
           TryTCP:
@@ -990,6 +1159,7 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
         //        cout<<"msec: "<<lwr.d_usec/1000.0<<", "<<g_avgLatency/1000.0<<'\n';
 
         t_sstorage->nsSpeeds[*tns].submit(*remoteIP, lwr.d_usec, &d_now);
+        submitOutgoingLatency(*remoteIP, lwr.d_usec);
       }
 
       typedef map<pair<string, QType>, set<DNSResourceRecord>, TCacheComp > tcache_t;
@@ -1070,7 +1240,10 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
           ne.d_name=qname;
           ne.d_qtype=QType(0); // this encodes 'whole record'
           
-          replacing_insert(t_sstorage->negcache, ne);
+          {
+            Lock nl(t_sstorage->negcachelock);
+            replacing_insert(*t_sstorage->negcache, ne);
+          }
           
           negindic=true;
         }
@@ -1117,7 +1290,8 @@ int SyncRes::doResolveAt(set<string, CIStringCompare> nameservers, string auth,
             ne.d_name=qname;
             ne.d_qtype=qtype;
             if(qtype.getCode()) {  // prevents us from blacking out a whole domain
-              replacing_insert(t_sstorage->negcache, ne);
+              Lock nl(t_sstorage->negcachelock);
+              replacing_insert(*t_sstorage->negcache, ne);
             }
             negindic=true;
           }
@@ -18,6 +18,8 @@
 #include <boost/tuple/tuple.hpp>
 #include <boost/optional.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/functional/hash.hpp>
 #include "mtasker.hh"
 #include "iputils.hh"
 
@@ -36,33 +38,25 @@ struct NegCacheEntry
 };
 
 
-template<class Thing> class Throttle : public boost::noncopyable
+/** Throttles Things for a while, or for a number of tries. Lookups are hashed, and every call also removes up to
+    two expired entries, oldest first, so the table stays as small as what is actually throttled without
+    ever having to be cleaned in one go. */
+template<class Thing, class Hash=boost::hash<Thing> > class Throttle : public boost::noncopyable
 {
 public:
   Throttle()
   {
     d_limit=3;
     d_ttl=60;
-    d_last_clean=time(0);
   }
   bool shouldThrottle(time_t now, const Thing& t)
   {
-    if(now > d_last_clean + 300 ) {
-
-      d_last_clean=now;
-      for(typename cont_t::iterator i=d_cont.begin();i!=d_cont.end();) {
-        if( i->second.ttd < now) {
-          d_cont.erase(i++);
-        }
-        else
-          ++i;
-      }
-    }
+    expire(now);
 
     typename cont_t::iterator i=d_cont.find(t);
     if(i==d_cont.end())
       return false;
-    if(now > i->second.ttd || i->second.count-- < 0) {
+    if(now > i->ttd || i->count-- < 0) {
       d_cont.erase(i);
       return false;
     }
@@ -71,14 +65,16 @@ public:
   }
   void throttle(time_t now, const Thing& t, unsigned int ttl=0, unsigned int tries=0) 
   {
+    expire(now);
+
     typename cont_t::iterator i=d_cont.find(t);
-    entry e={ now+(ttl ? ttl : d_ttl), tries ? tries : d_limit};
+    entry e={ t, now+(ttl ? ttl : d_ttl), tries ? tries : d_limit};
 
     if(i==d_cont.end()) {
-      d_cont[t]=e;
+      d_cont.insert(e);
     } 
-    else if(i->second.ttd > e.ttd || (i->second.count) < e.count) 
-      d_cont[t]=e;
+    else if(i->ttd > e.ttd || (i->count) < e.count) 
+      d_cont.replace(i, e);
   }
   
   unsigned int size()
@@ -86,15 +82,29 @@ public:
     return (unsigned int)d_cont.size();
   }
 private:
+  void expire(time_t now)
+  {
+    typedef typename cont_t::template nth_index<1>::type byttd_t;
+    byttd_t& byttd=d_cont.template get<1>();
+    for(int n=0; n < 2 && !byttd.empty() && byttd.begin()->ttd < now; ++n)
+      byttd.erase(byttd.begin());
+  }
+
   int d_limit;
   int d_ttl;
-  time_t d_last_clean;
   struct entry 
   {
+    Thing thing;
     time_t ttd;
-    int count;
+    mutable int count;
   };
-  typedef map<Thing,entry> cont_t;
+  typedef multi_index_container<
+    entry,
+    indexed_by <
+      hashed_unique<member<entry, Thing, &entry::thing>, Hash>,
+      ordered_non_unique<member<entry, time_t, &entry::ttd> >
+    >
+  > cont_t;
   cont_t d_cont;
 };
 
@@ -166,6 +176,20 @@ public:
     return limit > d_lastget.tv_sec;
   }
 
+  //! for cache snapshots, the value is decayed from here by the next get()
+  time_t lastGet() const
+  {
+    return d_lastget.tv_sec;
+  }
+
+  void restore(float val, time_t lastget)
+  {
+    d_last.tv_sec = d_lastget.tv_sec = lastget;
+    d_last.tv_usec = d_lastget.tv_usec = 0;
+    d_val = val;
+    d_needinit = false;
+  }
+
 private:
   struct timeval d_last;          // stores time
   struct timeval d_lastget;       // stores time
@@ -211,6 +235,19 @@ public:
     d_nocache=state;
   }
 
+  //! resolve the question itself without looking in the cache, to refresh what is there
+  void setRefresh(bool state=true)
+  {
+    d_refresh=state;
+  }
+
+  typedef vector<pair<string, QType> > prefetches_t;
+  //! cache hits that were popular and close enough to expiry to be resolved again in the background
+  const prefetches_t& getPrefetches() const
+  {
+    return d_prefetches;
+  }
+
   void setDoEDNS0(bool state=true)
   {
     d_doEDNS0=state;
@@ -314,20 +351,35 @@ public:
   struct EDNSStatus
   {
     EDNSStatus() : mode(UNKNOWN), modeSetAt(0), EDNSPingHitCount(0) {}
+    ComboAddress address;
     enum EDNSMode { CONFIRMEDPINGER=-1, UNKNOWN=0, EDNSNOPING=1, EDNSPINGOK=2, EDNSIGNORANT=3, NOEDNS=4 } mode;
     time_t modeSetAt;
     int EDNSPingHitCount;
   };
 
-  typedef map<ComboAddress, EDNSStatus> ednsstatus_t;
+  // like the Throttle, the oldest entries are expired a few at a time, after an hour the mode is found out again
+  typedef multi_index_container<
+    EDNSStatus,
+    indexed_by <
+      hashed_unique<member<EDNSStatus, ComboAddress, &EDNSStatus::address>, ComboAddressHash>,
+      ordered_non_unique<member<EDNSStatus, time_t, &EDNSStatus::modeSetAt> >
+    >
+  > ednsstatus_t;
+  EDNSStatus getEDNSStatus(const ComboAddress& ip);
+  void storeEDNSStatus(const ComboAddress& ip, EDNSStatus status);
 
   static bool s_noEDNSPing;
   static bool s_noEDNS;
 
   struct AuthDomain
   {
+    AuthDomain() : d_rdForward(false), d_mirror(false)
+    {}
+
     vector<ComboAddress> d_servers;
     bool d_rdForward;
+    //! a copy of a zone we are not authoritative for, like the root mirror. Its delegations are used as referrals
+    bool d_mirror;
     typedef multi_index_container <
       DNSResourceRecord,
       indexed_by < 
@@ -347,7 +399,17 @@ public:
   typedef map<string, AuthDomain, CIStringCompare> domainmap_t;
   
 
-  typedef Throttle<tuple<ComboAddress,string,uint16_t> > throttle_t;
+  struct ThrottleKeyHash : public std::unary_function<tuple<ComboAddress,string,uint16_t>, size_t>
+  {
+    size_t operator()(const tuple<ComboAddress,string,uint16_t>& key) const
+    {
+      size_t seed=ComboAddressHash()(key.get<0>());
+      boost::hash_combine(seed, key.get<1>());
+      boost::hash_combine(seed, key.get<2>());
+      return seed;
+    }
+  };
+  typedef Throttle<tuple<ComboAddress,string,uint16_t>, ThrottleKeyHash> throttle_t;
   
   struct timeval d_now;
   static unsigned int s_maxnegttl;
@@ -356,10 +418,19 @@ public:
   static unsigned int s_packetcacheservfailttl;
   static bool s_nopacketcache;
   static string s_serverID;
+  //! with serve-stale, give up resolving after this long if there is stale data to answer with. 0 means never
+  static unsigned int s_serveStaleDeadlineMsec;
+  //! the TTL stale records are served with, as suggested by RFC 8767
+  static const unsigned int s_serveStaleTTL=30;
   
   
+  //! set before threads start, to have them share a negative cache
+  static negcache_t* s_sharednegcache;
+  static pthread_mutex_t s_negcachelock;
+
   struct StaticStorage {
-    negcache_t negcache;    
+    negcache_t* negcache;         //!< our own, or s_sharednegcache
+    pthread_mutex_t* negcachelock; //!< only set if the negcache is shared
     nsspeeds_t nsSpeeds;
     ednsstatus_t ednsstatus;
     throttle_t throttle;
@@ -371,13 +442,16 @@ private:
   int doResolveAt(set<string, CIStringCompare> nameservers, string auth, bool flawedNSSet, const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret,
         	  int depth, set<GetBestNSAnswer>&beenthere);
   int doResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, set<GetBestNSAnswer>& beenthere);
-  bool doOOBResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res);
+  bool doOOBResolve(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res, bool* mirrorReferral=0);
+  bool doMirrorReferral(const string &qname, const QType &qtype, const AuthDomain& ad, const string& authdomain, vector<DNSResourceRecord>&ret);
   domainmap_t::const_iterator getBestAuthZone(string* qname);
   bool doCNAMECacheCheck(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res);
   bool doCacheCheck(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret, int depth, int &res);
   void getBestNSFromCache(const string &qname, set<DNSResourceRecord>&bestns, bool* flawedNSSet, int depth, set<GetBestNSAnswer>& beenthere);
   void addCruft(const string &qname, vector<DNSResourceRecord>& ret);
   string getBestNSNamesFromCache(const string &qname,set<string, CIStringCompare>& nsset, bool* flawedNSSet, int depth, set<GetBestNSAnswer>&beenthere);
+  bool doStaleCheck(const string &qname, const QType &qtype, vector<DNSResourceRecord>&ret);
+  bool staleDeadlinePassed();
   void addAuthorityRecords(const string& qname, vector<DNSResourceRecord>& ret, int depth);
 
   inline vector<string> shuffleInSpeedOrder(set<string, CIStringCompare> &nameservers, const string &prefix);
@@ -390,6 +464,13 @@ private:
   bool d_cacheonly;
   bool d_nocache;
   bool d_doEDNS0;
+  bool d_refresh;
+  prefetches_t d_prefetches;
+  //! what beginResolve was asked, and when to give up on it in favour of stale data. A zero deadline is not armed
+  string d_staleQname;
+  QType d_staleQtype;
+  struct timeval d_staleDeadline;
+  bool d_staleDeadlinePassed;
   static LogMode s_lm;
   LogMode d_lm;
 
@@ -498,8 +579,12 @@ struct RecursorStats
   uint64_t spoofCount;
   uint64_t resourceLimits;
   uint64_t overCapacityDrops;
+  uint64_t prefetches;
   uint64_t ipv6queries;
   uint64_t chainResends;
+  uint64_t coalescedQueries;
+  uint64_t questionRingFull;
+  uint64_t staleAnswers;
   uint64_t nsSetInvalidations;
   uint64_t ednsPingMatches;
   uint64_t ednsPingMismatches;
@@ -555,17 +640,21 @@ extern RecursorStats g_stats;
 extern unsigned int g_numThreads;
 
 std::string reloadAuthAndForwards();
+void checkRootMirror(time_t now);
 ComboAddress parseIPAndPort(const std::string& input, uint16_t port);
 ComboAddress getQueryLocalAddress(int family, uint16_t port);
 typedef boost::function<void*(void)> pipefunc_t;
 void broadcastFunction(const pipefunc_t& func, bool skipSelf = false);
 void distributeAsyncFunction(const pipefunc_t& func);
+void asyncFunctionToThread(unsigned int target, const pipefunc_t& func);
 
 int directResolve(const std::string& qname, const QType& qtype, int qclass, vector<DNSResourceRecord>& ret);
 
 template<class T> T broadcastAccFunction(const boost::function<T*()>& func, bool skipSelf=false);
+uint64_t cacheAccFunction(const boost::function<uint64_t*()>& func);
 
-SyncRes::domainmap_t* parseAuthAndForwards();
+//! with previous, the domain map we replace, a root zone mirror in it is kept until a fresh copy is loaded in the background
+SyncRes::domainmap_t* parseAuthAndForwards(const SyncRes::domainmap_t* previous=0);
 
 uint64_t* pleaseGetNsSpeedsSize();
 uint64_t* pleaseGetCacheSize();
@@ -576,6 +665,13 @@ uint64_t* pleaseGetConcurrentQueries();
 uint64_t* pleaseGetThrottleSize();
 uint64_t* pleaseGetPacketCacheHits();
 uint64_t* pleaseGetPacketCacheSize();
+uint64_t* pleaseGetHousekeepingUsec();
+class LatencyHistogram;
+//! which is packetcache, cache, resolve, outgoing or the IP address of an authoritative server
+LatencyHistogram* pleaseGetLatencyHistogram(const std::string& which);
+void submitOutgoingLatency(const ComboAddress& server, uint64_t usec);
+struct RecursorLuaStats;
+RecursorLuaStats* pleaseGetLuaStats();
 uint64_t* pleaseWipeCache(const std::string& canon);
 uint64_t* pleaseWipeAndCountNegCache(const std::string& canon);
 
@@ -50,6 +50,9 @@
 #include "communicator.hh"
 #include "namespaces.hh"
 #include "signingpipe.hh"
+#include "mplexer.hh"
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 extern PacketCache PC;
 extern StatBag S;
 
@@ -63,6 +66,64 @@ Semaphore *TCPNameserver::d_connectionroom_sem;
 PacketHandler *TCPNameserver::s_P; 
 int TCPNameserver::s_timeout;
 NetmaskGroup TCPNameserver::d_ng;
+vector<TCPEventThread*> TCPNameserver::s_eventThreads;
+int TCPNameserver::s_axfrPipe[2];
+int TCPNameserver::s_questionPipe[2];
+unsigned int TCPNameserver::s_pipelineDepth;
+AtomicCounter TCPNameserver::s_inflight;
+
+struct TCPConnectionState
+{
+  TCPConnectionState(int fd) : d_fd(fd), d_writing(false), d_holding(false), d_ttd(0), d_inflight(0), d_closed(false), d_stalled(false)
+  {}
+
+  int d_fd;
+  ComboAddress d_remote;
+  string d_inbuf;  //!< data read, but not yet processed as a question
+  string d_outbuf; //!< answers not yet written
+  bool d_writing;  //!< if we are on the write list of the multiplexer, instead of the read list
+  bool d_holding;  //!< on neither list, we don't read more questions until the ones we have can be processed
+  time_t d_ttd;    //!< moment after which we give up on this connection if nothing happens
+  shared_ptr<DNSPacket> d_axfr; //!< the AXFR or IXFR question to hand to the AXFR threads
+  unsigned int d_inflight; //!< questions handed to the pipeline threads that have not come back yet
+  bool d_closed;   //!< answers still in flight for a closed connection get dropped
+  bool d_stalled;  //!< held because the pipeline threads had no room for its next question, on d_stalled of its thread
+};
+
+typedef shared_ptr<TCPConnectionState> TCPConnectionStatePtr;
+
+struct TCPEventThread
+{
+  int d_pipe[2];       //!< new connections
+  int d_answerPipe[2]; //!< TCPQuestions answered by the pipeline threads
+  FDMultiplexer* d_fdm;
+  map<int, TCPConnectionStatePtr> d_conns;
+  vector<TCPConnectionStatePtr> d_stalled; //!< connections to retry once questions can be handed off again
+};
+
+//! a pipelined question, travels from an event thread to a pipeline thread and back
+struct TCPQuestion
+{
+  TCPEventThread* d_thr;
+  TCPConnectionStatePtr d_conn; //!< only ever touched by d_thr
+  shared_ptr<DNSPacket> d_packet;
+  string d_answer;
+  bool d_ok;
+};
+
+static FDMultiplexer* getMultiplexer()
+{
+  for(FDMultiplexer::FDMultiplexermap_t::const_iterator i = FDMultiplexer::getMultiplexerMap().begin();
+      i != FDMultiplexer::getMultiplexerMap().end(); ++i) {
+    try {
+      return i->second();
+    }
+    catch(FDMultiplexerException &fe) {
+      L<<Logger::Error<<"Non-fatal error initializing possible multiplexer ("<<fe.what()<<"), falling back"<<endl;
+    }
+  }
+  throw PDNSException("No working multiplexer found for the TCP event threads");
+}
 
 void TCPNameserver::go()
 {
@@ -75,6 +136,33 @@ void TCPNameserver::go()
     L<<Logger::Error<<Logger::NTLog<<"TCP server is unable to launch backends - will try again when questions come in"<<endl;
     L<<Logger::Error<<"TCP server is unable to launch backends - will try again when questions come in: "<<ae.reason<<endl;
   }
+  int eventThreads=::arg().asNum("tcp-event-threads");
+  if(eventThreads > 0) {
+    if(pipe(s_axfrPipe) < 0)
+      unixDie("Creating pipe for the TCP AXFR threads");
+    pthread_t tid;
+    // event threads never touch a backend, every question goes to the pipeline threads
+    s_pipelineDepth=max(::arg().asNum("tcp-pipeline-depth"), 1);
+    int pipelineThreads=max(::arg().asNum("tcp-pipeline-threads"), 1);
+    if(pipe(s_questionPipe) < 0)
+      unixDie("Creating pipe for the TCP pipeline threads");
+    Utility::setNonBlocking(s_questionPipe[1]);
+    for(int n=0; n < pipelineThreads; ++n)
+      pthread_create(&tid, 0, pipelineThread, 0);
+    for(int n=0; n < eventThreads; ++n) {
+      TCPEventThread* thr=new TCPEventThread;
+      if(pipe(thr->d_pipe) < 0 || pipe(thr->d_answerPipe) < 0)
+        unixDie("Creating pipes for a TCP event thread");
+      thr->d_fdm=getMultiplexer();
+      s_eventThreads.push_back(thr);
+      pthread_create(&tid, 0, eventThread, static_cast<void *>(thr));
+    }
+    L<<Logger::Warning<<"Launched "<<eventThreads<<" TCP event threads, using the "<<s_eventThreads[0]->d_fdm->getName()<<" multiplexer"<<endl;
+
+    for(int n=0; n < ::arg().asNum("tcp-axfr-threads"); ++n)
+      pthread_create(&tid, 0, axfrThread, 0);
+  }
+
   pthread_create(&d_tid, 0, launcher, static_cast<void *>(this));
 }
 
@@ -173,9 +261,8 @@ void connectWithTimeout(int fd, struct sockaddr* remote, size_t socklen)
   ;
 }
 
-void TCPNameserver::sendPacket(shared_ptr<DNSPacket> p, int outsock)
+static void accountAnswer(shared_ptr<DNSPacket> p)
 {
-
   /* Query statistics */
   if(p->qtype.getCode()!=QType::AXFR && p->qtype.getCode()!=QType::IXFR) {
     if(p->d.aa) {
@@ -186,10 +273,22 @@ void TCPNameserver::sendPacket(shared_ptr<DNSPacket> p, int outsock)
       S.ringAccount("remotes-unauth",p->getRemote());
     }
   }
+}
 
-  uint16_t len=htons(p->getString().length());
-  string buffer((const char*)&len, 2);
-  buffer.append(p->getString());
+//! appends packet to out, prefixed with its length as TCP wants it
+static void appendWithLength(string& out, const string& packet)
+{
+  uint16_t len=htons(packet.length());
+  out.append((const char*)&len, 2);
+  out.append(packet);
+}
+
+void TCPNameserver::sendPacket(shared_ptr<DNSPacket> p, int outsock)
+{
+  accountAnswer(p);
+
+  string buffer;
+  appendWithLength(buffer, p->getString());
   writenWithTimeout(outsock, buffer.c_str(), buffer.length());
 }
 
@@ -203,7 +302,8 @@ catch(NetworkError& ae) {
   throw NetworkError("Error reading DNS data from TCP client "+remote.toString()+": "+ae.what());
 }
 
-static void proxyQuestion(shared_ptr<DNSPacket> packet)
+//! asks the recursor over TCP, and returns its answer
+static string proxyQuestion(shared_ptr<DNSPacket> packet)
 {
   int sock=socket(AF_INET, SOCK_STREAM, 0);
   
@@ -221,7 +321,7 @@ static void proxyQuestion(shared_ptr<DNSPacket> packet)
     connectWithTimeout(sock, (struct sockaddr*)&recursor, recursor.getSocklen());
     const string &buffer=packet->getString();
     
-    uint16_t len=htons(buffer.length()), slen;
+    uint16_t len=htons(buffer.length());
     
     writenWithTimeout(sock, &len, 2);
     writenWithTimeout(sock, buffer.c_str(), buffer.length());
@@ -231,18 +331,71 @@ static void proxyQuestion(shared_ptr<DNSPacket> packet)
 
     char answer[len];
     readnWithTimeout(sock, answer, len);
-
-    slen=htons(len);
-    writenWithTimeout(packet->getSocket(), &slen, 2);
-    
-    writenWithTimeout(packet->getSocket(), answer, len);
+    close(sock);
+    return string(answer, len);
   }
   catch(NetworkError& ae) {
     close(sock);
     throw NetworkError("While proxying a question to recursor "+st.host+": " +ae.what());
   }
-  close(sock);
-  return;
+}
+
+/** Answers a question that is not an AXFR or IXFR, from the PacketCache, the backend or the recursor. The answer
+    is appended to out, prefixed with its length. Returns false if there is no answer, the connection should be 
+    dropped then. P gets launched if needed, and is only used with lock held, pass a null lock if P is ours alone.
+    Throws for backend trouble, which means P needs cycling. */
+bool TCPNameserver::answerQuestion(shared_ptr<DNSPacket> packet, string& out, bool logDNSQueries, PacketHandler*& P, pthread_mutex_t* lock)
+{
+  shared_ptr<DNSPacket> reply; 
+  shared_ptr<DNSPacket> cached= shared_ptr<DNSPacket>(new DNSPacket);
+  if(logDNSQueries)  {
+    string remote;
+    if(packet->hasEDNSSubnet()) 
+      remote = packet->getRemote() + "<-" + packet->getRealRemote().toString();
+    else
+      remote = packet->getRemote();
+    L << Logger::Notice<<"TCP Remote "<< remote <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() << 
+    "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
+  }
+
+  if(!packet->d.rd && packet->couldBeCached() && PC.get(packet.get(), cached.get())) { // short circuit - does the PacketCache recognize this question?
+    if(logDNSQueries)
+      L<<"packetcache HIT"<<endl;
+    cached->setRemote(&packet->d_remote);
+    cached->d.id=packet->d.id;
+    cached->d.rd=packet->d.rd; // copy in recursion desired bit 
+    cached->commitD(); // commit d to the packet                        inlined
+
+    accountAnswer(cached);
+    appendWithLength(out, cached->getString()); // presigned, don't do it again
+    S.inc("tcp-answers");
+    return true;
+  }
+  if(logDNSQueries)
+      L<<"packetcache MISS"<<endl;  
+  {
+    Lock l(lock);
+    if(!P) {
+      L<<Logger::Error<<"TCP server is without backend connections, launching"<<endl;
+      P=new PacketHandler;
+    }
+    bool shouldRecurse;
+
+    reply=shared_ptr<DNSPacket>(P->questionOrRecurse(packet.get(), &shouldRecurse)); // we really need to ask the backend :-)
+
+    if(shouldRecurse) {
+      appendWithLength(out, proxyQuestion(packet));
+      return true;
+    }
+  }
+
+  if(!reply)  // unable to write an answer?
+    return false;
+    
+  S.inc("tcp-answers");
+  accountAnswer(reply);
+  appendWithLength(out, reply->getString());
+  return true;
 }
 
 void *TCPNameserver::doConnection(void *data)
@@ -292,54 +445,11 @@ void *TCPNameserver::doConnection(void *data)
         continue;
       }
 
-      shared_ptr<DNSPacket> reply; 
-      shared_ptr<DNSPacket> cached= shared_ptr<DNSPacket>(new DNSPacket);
-      if(logDNSQueries)  {
-        string remote;
-        if(packet->hasEDNSSubnet()) 
-          remote = packet->getRemote() + "<-" + packet->getRealRemote().toString();
-        else
-          remote = packet->getRemote();
-        L << Logger::Notice<<"TCP Remote "<< remote <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() << 
-        "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
-      }
-
-
-      if(!packet->d.rd && packet->couldBeCached() && PC.get(packet.get(), cached.get())) { // short circuit - does the PacketCache recognize this question?
-        if(logDNSQueries)
-          L<<"packetcache HIT"<<endl;
-        cached->setRemote(&packet->d_remote);
-        cached->d.id=packet->d.id;
-        cached->d.rd=packet->d.rd; // copy in recursion desired bit 
-        cached->commitD(); // commit d to the packet                        inlined
-
-        sendPacket(cached, fd); // presigned, don't do it again
-        S.inc("tcp-answers");
-        continue;
-      }
-      if(logDNSQueries)
-          L<<"packetcache MISS"<<endl;  
-      {
-        Lock l(&s_plock);
-        if(!s_P) {
-          L<<Logger::Error<<"TCP server is without backend connections, launching"<<endl;
-          s_P=new PacketHandler;
-        }
-        bool shouldRecurse;
-
-        reply=shared_ptr<DNSPacket>(s_P->questionOrRecurse(packet.get(), &shouldRecurse)); // we really need to ask the backend :-)
-
-        if(shouldRecurse) {
-          proxyQuestion(packet);
-          continue;
-        }
-      }
-
-      if(!reply)  // unable to write an answer?
+      string answer;
+      if(!answerQuestion(packet, answer, logDNSQueries, s_P, &s_plock))
         break;
-        
-      S.inc("tcp-answers");
-      sendPacket(reply, fd);
+
+      writenWithTimeout(fd, answer.c_str(), answer.length());
     }
   }
   catch(DBException &e) {
@@ -373,6 +483,367 @@ void *TCPNameserver::doConnection(void *data)
 }
 
 
+/* Event driven operation. Connections travel between the acceptor, the event threads and the AXFR threads as
+   raw TCPConnectionState pointers written over pipes. Whoever reads one off a pipe owns it from then on. */
+
+//! hands a connection to an event thread, round robin
+void TCPNameserver::handoffConnection(TCPConnectionState *conn)
+{
+  static AtomicCounter counter;
+  TCPEventThread* thr=s_eventThreads[counter++ % s_eventThreads.size()];
+  if(write(thr->d_pipe[1], &conn, sizeof(conn)) != sizeof(conn))
+    unixDie("Handing a TCP connection to an event thread");
+}
+
+void TCPNameserver::closeConnection(TCPEventThread *thr, TCPConnectionStatePtr conn)
+{
+  conn->d_closed=true;
+  if(conn->d_writing)
+    thr->d_fdm->removeWriteFD(conn->d_fd);
+  else if(!conn->d_holding)
+    thr->d_fdm->removeReadFD(conn->d_fd);
+  thr->d_conns.erase(conn->d_fd);
+  Utility::closesocket(conn->d_fd);
+  d_connectionroom_sem->post();
+}
+
+//! stop reading from a connection that has a complete question we can't process yet, so its input buffer can't grow without bound
+void TCPNameserver::holdConnection(TCPEventThread *thr, TCPConnectionStatePtr conn)
+{
+  if(!conn->d_holding) {
+    thr->d_fdm->removeReadFD(conn->d_fd);
+    conn->d_holding=true;
+  }
+}
+
+void TCPNameserver::resumeConnection(TCPEventThread *thr, TCPConnectionStatePtr conn)
+{
+  if(conn->d_holding) {
+    thr->d_fdm->addReadFD(conn->d_fd, boost::bind(&TCPNameserver::handleConnectionIO, _1, _2, thr), conn);
+    conn->d_holding=false;
+  }
+}
+
+/* Event threads and pipeline threads write to each other's pipes. If both pipes could fill up, each side could block
+   on the other for good. So the number of questions out at the pipeline threads is capped well below what a pipe
+   holds, which means the answer pipes never fill up, and the question pipe is written to without blocking */
+bool TCPNameserver::queueQuestion(TCPEventThread *thr, TCPConnectionStatePtr conn, shared_ptr<DNSPacket> packet)
+{
+  if(++s_inflight > s_maxInflight) {
+    --s_inflight;
+    return false;
+  }
+  TCPQuestion* question=new TCPQuestion;
+  question->d_thr=thr;
+  question->d_conn=conn;
+  question->d_packet=packet;
+  question->d_ok=false;
+  if(write(s_questionPipe[1], &question, sizeof(question)) != sizeof(question)) {
+    if(errno != EAGAIN)
+      unixDie("Handing a TCP question to a pipeline thread");
+    delete question;
+    --s_inflight;
+    return false;
+  }
+  return true;
+}
+
+//! holds a connection whose next question could not be queued, retryStalled picks it up again
+void TCPNameserver::stallConnection(TCPEventThread *thr, TCPConnectionStatePtr conn)
+{
+  holdConnection(thr, conn);
+  if(!conn->d_stalled) {
+    conn->d_stalled=true;
+    thr->d_stalled.push_back(conn);
+  }
+}
+
+void TCPNameserver::retryStalled(TCPEventThread *thr)
+{
+  vector<TCPConnectionStatePtr> stalled;
+  stalled.swap(thr->d_stalled);
+  BOOST_FOREACH(TCPConnectionStatePtr& conn, stalled) {
+    conn->d_stalled=false;
+    if(conn->d_closed)
+      continue;
+    boost::any param(conn);
+    handleConnectionIO(conn->d_fd, param, thr);
+  }
+}
+
+/* Writes what it can, queues the complete questions in the input buffer for the pipeline threads, and then 
+   moves the connection to the read or the write list of the multiplexer as needed, or takes it off both while 
+   it waits for answers from the pipeline threads */
+void TCPNameserver::processConnection(TCPEventThread *thr, TCPConnectionStatePtr conn)
+{
+  for(;;) {
+    while(!conn->d_outbuf.empty()) {
+      int ret=write(conn->d_fd, conn->d_outbuf.c_str(), conn->d_outbuf.length());
+      if(ret < 0) {
+        if(errno != EAGAIN)
+          throw NetworkError("Writing data: "+stringerror());
+        if(!conn->d_writing) {
+          if(!conn->d_holding)
+            thr->d_fdm->removeReadFD(conn->d_fd);
+          conn->d_holding=false;
+          thr->d_fdm->addWriteFD(conn->d_fd, boost::bind(&TCPNameserver::handleConnectionIO, _1, _2, thr), conn);
+          conn->d_writing=true;
+        }
+        return;
+      }
+      conn->d_outbuf.erase(0, ret);
+      conn->d_ttd=time(0)+s_timeout;
+    }
+
+    if(conn->d_writing) {
+      thr->d_fdm->removeWriteFD(conn->d_fd);
+      conn->d_writing=false;
+      conn->d_holding=true; // on neither list now, resumeConnection or holdConnection below settles it
+    }
+
+    if(conn->d_inbuf.length() < 2) {
+      resumeConnection(thr, conn);
+      return;
+    }
+    uint16_t pktlen=((unsigned char)conn->d_inbuf[0])*256 + (unsigned char)conn->d_inbuf[1];
+    if(conn->d_inbuf.length() < 2U + pktlen) {
+      resumeConnection(thr, conn);
+      return;
+    }
+
+    if(conn->d_inflight >= s_pipelineDepth) {
+      holdConnection(thr, conn);
+      return; // we'll be back when an answer comes in
+    }
+
+    shared_ptr<DNSPacket> packet(new DNSPacket);
+    packet->setRemote(&conn->d_remote);
+    packet->d_tcp=true;
+    packet->setSocket(conn->d_fd);
+    if(packet->parse(conn->d_inbuf.c_str()+2, pktlen) < 0)
+      throw NetworkError("Unparseable question from TCP client "+conn->d_remote.toString());
+
+    bool isAXFR=(packet->qtype.getCode()==QType::AXFR || packet->qtype.getCode()==QType::IXFR);
+    if(isAXFR && conn->d_inflight) {
+      holdConnection(thr, conn);
+      return; // the connection can only move to an AXFR thread once all its answers are in
+    }
+
+    if(!isAXFR && !queueQuestion(thr, conn, packet)) {
+      stallConnection(thr, conn);
+      return; // the pipeline threads are full, we try again when answers come back
+    }
+
+    conn->d_inbuf.erase(0, 2+pktlen);
+    S.inc("tcp-queries");
+
+    if(isAXFR) {
+      // off to the AXFR threads, which will hand the connection back to us when they are done
+      if(!conn->d_holding)
+        thr->d_fdm->removeReadFD(conn->d_fd);
+      thr->d_conns.erase(conn->d_fd);
+      TCPConnectionState* axfrconn=new TCPConnectionState(*conn);
+      axfrconn->d_axfr=packet;
+      if(write(s_axfrPipe[1], &axfrconn, sizeof(axfrconn)) != sizeof(axfrconn))
+        unixDie("Handing a TCP connection to an AXFR thread");
+      return;
+    }
+
+    conn->d_inflight++; // queued above
+  }
+}
+
+void TCPNameserver::handleAnswer(int fd, boost::any& parameter, TCPEventThread *thr)
+{
+  TCPQuestion* ptr;
+  if(read(fd, &ptr, sizeof(ptr)) != sizeof(ptr))
+    unixDie("Reading a TCP answer from the pipe");
+  boost::scoped_ptr<TCPQuestion> question(ptr);
+  --s_inflight;
+
+  TCPConnectionStatePtr conn=question->d_conn;
+  conn->d_inflight--;
+  if(!conn->d_closed) {
+    if(!question->d_ok) {
+      L<<Logger::Info<<"Unable to answer question from TCP client "<<conn->d_remote.toString()<<", closing connection"<<endl;
+      closeConnection(thr, conn);
+    }
+    else {
+      conn->d_outbuf.append(question->d_answer);
+      boost::any param(conn);
+      handleConnectionIO(conn->d_fd, param, thr); // writes the answer, and picks up questions we were holding back
+    }
+  }
+  retryStalled(thr);
+}
+
+void TCPNameserver::handleConnectionIO(int fd, boost::any& parameter, TCPEventThread *thr)
+{
+  TCPConnectionStatePtr conn=boost::any_cast<TCPConnectionStatePtr>(parameter); // parameter dies when we switch lists
+  try {
+    if(!conn->d_writing && !conn->d_holding) {
+      char buffer[4096];
+      int ret=read(fd, buffer, sizeof(buffer));
+      if(ret < 0 && errno != EAGAIN)
+        throw NetworkError("Reading data: "+stringerror());
+      if(!ret) { // EOF
+        closeConnection(thr, conn);
+        return;
+      }
+      if(ret > 0) {
+        conn->d_inbuf.append(buffer, ret);
+        conn->d_ttd=time(0)+s_timeout;
+      }
+    }
+    processConnection(thr, conn);
+  }
+  catch(PDNSException &ae) {
+    L<<Logger::Error<<"TCP connection from "<<conn->d_remote.toString()<<" closed because of error: "<<ae.reason<<endl;
+    closeConnection(thr, conn);
+  }
+  catch(NetworkError &e) {
+    L<<Logger::Info<<"TCP connection from "<<conn->d_remote.toString()<<" closed because of network error: "<<e.what()<<endl;
+    closeConnection(thr, conn);
+  }
+  catch(std::exception &e) {
+    L<<Logger::Error<<"TCP connection from "<<conn->d_remote.toString()<<" closed because of STL error: "<<e.what()<<endl;
+    closeConnection(thr, conn);
+  }
+}
+
+void TCPNameserver::handleNewConnection(int fd, boost::any& parameter, TCPEventThread *thr)
+{
+  TCPConnectionState* ptr;
+  if(read(fd, &ptr, sizeof(ptr)) != sizeof(ptr))
+    unixDie("Reading a new TCP connection from the pipe");
+
+  TCPConnectionStatePtr conn(ptr);
+  conn->d_writing=false;
+  conn->d_holding=false;
+  conn->d_axfr.reset();
+  conn->d_ttd=time(0)+s_timeout;
+  thr->d_conns[conn->d_fd]=conn;
+  thr->d_fdm->addReadFD(conn->d_fd, boost::bind(&TCPNameserver::handleConnectionIO, _1, _2, thr), conn);
+
+  boost::any param(conn);
+  handleConnectionIO(conn->d_fd, param, thr); // there might be questions left over from before an AXFR
+}
+
+void *TCPNameserver::eventThread(void *data)
+{
+  TCPEventThread* thr=static_cast<TCPEventThread*>(data);
+  try {
+    thr->d_fdm->addReadFD(thr->d_pipe[0], boost::bind(&TCPNameserver::handleNewConnection, _1, _2, thr));
+    thr->d_fdm->addReadFD(thr->d_answerPipe[0], boost::bind(&TCPNameserver::handleAnswer, _1, _2, thr));
+
+    struct timeval now;
+    time_t lastScan=0;
+    for(;;) {
+      thr->d_fdm->run(&now);
+
+      if(now.tv_sec == lastScan)
+        continue;
+      lastScan=now.tv_sec;
+
+      retryStalled(thr); // in case the room was made by answers for other event threads
+
+      vector<TCPConnectionStatePtr> expired;
+      for(map<int, TCPConnectionStatePtr>::const_iterator i=thr->d_conns.begin(); i!=thr->d_conns.end(); ++i)
+        if(i->second->d_ttd < now.tv_sec && !i->second->d_inflight && !i->second->d_stalled) // not when it waits for us
+          expired.push_back(i->second);
+
+      BOOST_FOREACH(TCPConnectionStatePtr& conn, expired) {
+        L<<Logger::Info<<"Timeout on TCP connection from "<<conn->d_remote.toString()<<endl;
+        closeConnection(thr, conn);
+      }
+    }
+  }
+  catch(FDMultiplexerException &fe) {
+    L<<Logger::Error<<"TCP event thread dying because of multiplexer error: "<<fe.what()<<endl;
+  }
+  catch(PDNSException &AE) {
+    L<<Logger::Error<<"TCP event thread dying because of fatal error: "<<AE.reason<<endl;
+  }
+  exit(1); // take rest of server with us
+}
+
+void *TCPNameserver::axfrThread(void *data)
+{
+  for(;;) {
+    TCPConnectionState* conn;
+    if(read(s_axfrPipe[0], &conn, sizeof(conn)) != sizeof(conn))
+      unixDie("Reading a TCP connection for AXFR from the pipe");
+
+    try {
+      if(doAXFR(conn->d_axfr->qdomain, conn->d_axfr, conn->d_fd)) 
+        S.inc("tcp-answers");  
+      handoffConnection(conn);
+      continue;
+    }
+    catch(DBException &e) {
+      Lock l(&s_plock);
+      delete s_P;
+      s_P = 0;
+
+      L<<Logger::Error<<"TCP AXFR thread unable to answer a question because of a backend error, cycling"<<endl;
+    }
+    catch(PDNSException &ae) {
+      Lock l(&s_plock);
+      delete s_P;
+      s_P = 0; // on next call, backend will be recycled
+      L<<Logger::Error<<"TCP nameserver had error, cycling backend: "<<ae.reason<<endl;
+    }
+    catch(NetworkError &e) {
+      L<<Logger::Info<<"TCP AXFR to "<<conn->d_remote.toString()<<" failed because of network error: "<<e.what()<<endl;
+    }
+    catch(std::exception &e) {
+      L<<Logger::Error<<"TCP AXFR to "<<conn->d_remote.toString()<<" failed because of STL error: "<<e.what()<<endl;
+    }
+    Utility::closesocket(conn->d_fd);
+    delete conn;
+    d_connectionroom_sem->post();
+  }
+  return 0;
+}
+
+//! answers pipelined questions, with a PacketHandler of its own
+void *TCPNameserver::pipelineThread(void *data)
+{
+  PacketHandler* P=0;
+  bool logDNSQueries= ::arg().mustDo("log-dns-queries");
+
+  for(;;) {
+    TCPQuestion* question;
+    if(read(s_questionPipe[0], &question, sizeof(question)) != sizeof(question))
+      unixDie("Reading a TCP question from the pipe");
+
+    try {
+      question->d_ok=answerQuestion(question->d_packet, question->d_answer, logDNSQueries, P, 0); // P is ours alone
+    }
+    catch(DBException &e) {
+      delete P;
+      P = 0;
+      L<<Logger::Error<<"TCP pipeline thread unable to answer a question because of a backend error, cycling"<<endl;
+    }
+    catch(PDNSException &ae) {
+      delete P;
+      P = 0; // on next call, backend will be recycled
+      L<<Logger::Error<<"TCP pipeline thread had error, cycling backend: "<<ae.reason<<endl;
+    }
+    catch(NetworkError &e) {
+      L<<Logger::Info<<"TCP pipeline thread unable to answer a question because of network error: "<<e.what()<<endl;
+    }
+    catch(std::exception &e) {
+      L<<Logger::Error<<"TCP pipeline thread unable to answer a question because of STL error: "<<e.what()<<endl;
+    }
+
+    // this can't block, as there are never more than s_maxInflight questions out
+    if(write(question->d_thr->d_answerPipe[1], &question, sizeof(question)) != sizeof(question))
+      unixDie("Handing a TCP answer back to an event thread");
+  }
+  return 0;
+}
+
 // call this method with s_plock held!
 bool TCPNameserver::canDoAXFR(shared_ptr<DNSPacket> q)
 {
@@ -490,6 +961,115 @@ namespace {
     ret->d_tcp = true;
     return ret;
   }
+
+  /** Writes the body of an AXFR straight into wire format, packing records into compressed messages
+      of about MaxMessage bytes and sending each one out as soon as it is full. Keeps the TSIG chain 
+      going if the question was signed. This saves us a DNSPacket and a copy of every record. */
+  class AXFRWriter : public boost::noncopyable
+  {
+  public:
+    AXFRWriter(shared_ptr<DNSPacket> q, int outsock, const string& tsigkeyname, const string& tsigsecret, const TSIGRecordContent& trc)
+      : d_records(0), d_q(q), d_outsock(outsock), d_tsigkeyname(tsigkeyname), d_tsigsecret(tsigsecret), d_trc(trc), d_inmessage(0)
+    {
+      startMessage();
+    }
+
+    void addRecords(vector<DNSResourceRecord>& rrs)
+    {
+      for(vector<DNSResourceRecord>::iterator rr=rrs.begin(); rr != rrs.end(); ++rr) {
+        if(d_inmessage && d_pw->size() >= MaxMessage)
+          flush();
+        // same content massaging as DNSPacket::wrapup
+        if(rr->qtype.getCode()==QType::MX || rr->qtype.getCode()==QType::SRV)
+          rr->content = lexical_cast<string>(rr->priority) + " " + rr->content;
+        if(!rr->content.empty() && rr->qtype.getCode()==QType::TXT && rr->content[0]!='"')
+          rr->content="\""+rr->content+"\"";
+        if(rr->content.empty())
+          rr->content=".";
+
+        shared_ptr<DNSRecordContent> drc(DNSRecordContent::mastermake(rr->qtype.getCode(), 1, rr->content));
+        if(!addRecord(*rr, drc)) {
+          flush();
+          if(!addRecord(*rr, drc))
+            throw PDNSException("Record '"+rr->qname+"|"+rr->qtype.getName()+"' is too large for an AXFR message");
+        }
+      }
+    }
+
+    //! sends out what we have, if anything
+    void flush()
+    {
+      if(!d_inmessage)
+        return;
+      if(!d_tsigkeyname.empty()) {
+        string previous=d_trc.d_mac;
+        addTSIG(*d_pw, &d_trc, d_tsigkeyname, d_tsigsecret, previous, true);
+      }
+
+      string buffer;
+      appendWithLength(buffer, string((const char*)&d_packet[0], d_packet.size()));
+      writenWithTimeout(d_outsock, buffer.c_str(), buffer.length());
+      S.deposit("axfr-records", d_inmessage);
+      d_records+=d_inmessage;
+      startMessage();
+    }
+
+    //! the MAC of the last message we sent, for the next one in the TSIG chain
+    const string& getMAC() const
+    {
+      return d_trc.d_mac;
+    }
+
+    uint64_t d_records;
+  private:
+    enum { MaxMessage = 16000 }; // compression pointers can't point beyond 16384 anyhow
+    enum { MaxWire = 65535 - 1024 }; // what the TCP length prefix can say, minus room for the TSIG record
+
+    //! returns false, and leaves the message as it was, if the record does not fit in this message
+    bool addRecord(const DNSResourceRecord& rr, shared_ptr<DNSRecordContent> drc)
+    {
+      d_pw->startRecord(rr.qname, rr.qtype.getCode(), rr.ttl, rr.qclass, DNSPacketWriter::ANSWER);
+      drc->toPacket(*d_pw);
+      if(d_pw->size() > MaxWire) {
+        d_pw->rollback();
+        return false;
+      }
+      d_pw->commit();
+      d_inmessage++;
+      return true;
+    }
+
+    void startMessage()
+    {
+      d_pw.reset(); // it refers to d_packet
+      d_pw.reset(new DNSPacketWriter(d_packet, d_q->qdomain, d_q->qtype.getCode(), d_q->qclass, d_q->d.opcode));
+      dnsheader* dh=d_pw->getHeader();
+      dh->id=d_q->d.id;
+      dh->qr=1;
+      dh->aa=1;
+      dh->rd=d_q->d.rd;
+      d_inmessage=0;
+    }
+
+    shared_ptr<DNSPacket> d_q;
+    int d_outsock;
+    string d_tsigkeyname, d_tsigsecret;
+    TSIGRecordContent d_trc;
+    vector<uint8_t> d_packet;
+    boost::scoped_ptr<DNSPacketWriter> d_pw;
+    unsigned int d_inmessage;
+  };
+
+  //! passes whatever the signing pipe has ready on to the AXFRWriter
+  void drainSigningPipe(ChunkedSigningPipe& csp, AXFRWriter& aw, bool final=false)
+  {
+    for(;;) {
+      vector<DNSResourceRecord> chunk=csp.getChunk(final);
+      if(chunk.empty())
+        break;
+      aw.addRecords(chunk);
+    }
+  }
 }
 
 
@@ -594,7 +1174,7 @@ int TCPNameserver::doAXFR(const string &target, shared_ptr<DNSPacket> q, int out
   sendPacket(outpacket, outsock);
   
   trc.d_mac = outpacket->d_trc.d_mac;
-  outpacket = getFreshAXFRPacket(q);
+  AXFRWriter aw(q, outsock, tsigkeyname, tsigsecret, trc);
   
   ChunkedSigningPipe csp(target, securedZone, "", ::arg().asNum("signing-threads"));
   
@@ -648,6 +1228,7 @@ int TCPNameserver::doAXFR(const string &target, shared_ptr<DNSPacket> q, int out
   // now start list zone
   if(!(sd.db->list(target, sd.domain_id))) {  
     L<<Logger::Error<<"Backend signals error condition"<<endl;
+    outpacket = getFreshAXFRPacket(q);
     outpacket->setRcode(2); // 'SERVFAIL'
     sendPacket(outpacket,outsock);
     return 0;
@@ -693,20 +1274,8 @@ int TCPNameserver::doAXFR(const string &target, shared_ptr<DNSPacket> q, int out
     if(rr.qtype.getCode() == QType::SOA)
       continue; // skip SOA - would indicate end of AXFR
 
-    if(csp.submit(rr)) {
-      for(;;) {
-        outpacket->getRRS() = csp.getChunk();
-        if(!outpacket->getRRS().empty()) {
-          if(!tsigkeyname.empty()) 
-            outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-          sendPacket(outpacket, outsock);
-          trc.d_mac=outpacket->d_trc.d_mac;
-          outpacket=getFreshAXFRPacket(q);
-        }
-        else
-          break;
-      }
-    }
+    if(csp.submit(rr))
+      drainSigningPipe(csp, aw);
   }
   /*
   udiff=dt.udiffNoReset();
@@ -744,20 +1313,8 @@ int TCPNameserver::doAXFR(const string &target, shared_ptr<DNSPacket> q, int out
           rr.qtype = QType::NSEC3;
           rr.d_place = DNSResourceRecord::ANSWER;
           rr.auth=true;
-          if(csp.submit(rr)) {
-            for(;;) {
-              outpacket->getRRS() = csp.getChunk();
-              if(!outpacket->getRRS().empty()) {
-                if(!tsigkeyname.empty())
-                  outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-                sendPacket(outpacket, outsock);
-                trc.d_mac=outpacket->d_trc.d_mac;
-                outpacket=getFreshAXFRPacket(q);
-              }
-              else
-                break;
-            }
-          }
+          if(csp.submit(rr))
+            drainSigningPipe(csp, aw);
         }
       }
     }
@@ -779,20 +1336,8 @@ int TCPNameserver::doAXFR(const string &target, shared_ptr<DNSPacket> q, int out
       rr.qtype = QType::NSEC;
       rr.d_place = DNSResourceRecord::ANSWER;
       rr.auth=true;
-      if(csp.submit(rr)) {
-        for(;;) {
-          outpacket->getRRS() = csp.getChunk();
-          if(!outpacket->getRRS().empty()) {
-            if(!tsigkeyname.empty())
-              outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); 
-            sendPacket(outpacket, outsock);
-            trc.d_mac=outpacket->d_trc.d_mac;
-            outpacket=getFreshAXFRPacket(q);
-          }
-          else
-            break;
-        }
-      }
+      if(csp.submit(rr))
+        drainSigningPipe(csp, aw);
     }
   }
   /*
@@ -801,22 +1346,16 @@ int TCPNameserver::doAXFR(const string &target, shared_ptr<DNSPacket> q, int out
   cerr<<"Outstanding: "<<csp.d_outstanding<<", "<<csp.d_queued - csp.d_signed << endl;
   cerr<<"Ready for consumption: "<<csp.getReady()<<endl;
   * */
-  for(;;) { 
-    outpacket->getRRS() = csp.getChunk(true); // flush the pipe
-    if(!outpacket->getRRS().empty()) {
-      if(!tsigkeyname.empty())
-        outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); // first answer is 'normal'
-      sendPacket(outpacket, outsock);
-      trc.d_mac=outpacket->d_trc.d_mac;
-      outpacket=getFreshAXFRPacket(q);
-    }
-    else 
-      break;
-  }
+  drainSigningPipe(csp, aw, true); // flush the pipe
+  aw.flush();
+  trc.d_mac=aw.getMAC();
   
   udiff=dt.udiffNoReset();
   if(securedZone) 
     L<<Logger::Info<<"Done signing: "<<csp.d_signed/(udiff/1000000.0)<<" sigs/s, "<<endl;
+  unsigned int rate=udiff ? (unsigned int)(aw.d_records*1000000/udiff) : 0;
+  S.set("axfr-records-per-second", rate);
+  L<<Logger::Info<<"AXFR of domain '"<<target<<"' sent "<<aw.d_records<<" records, "<<rate<<" records/s"<<endl;
   
   DLOG(L<<"Done writing out records"<<endl);
   /* and terminate with yet again the SOA record */
@@ -969,7 +1508,20 @@ void TCPNameserver::thread()
             if(room<1)
               L<<Logger::Warning<<Logger::NTLog<<"Limit of simultaneous TCP connections reached - raise max-tcp-connections"<<endl;
 
-            if(pthread_create(&tid, 0, &doConnection, reinterpret_cast<void*>(fd))) {
+            if(!s_eventThreads.empty()) {
+              TCPConnectionState* conn=new TCPConnectionState(fd);
+              socklen_t remotelen=sizeof(conn->d_remote);
+              if(getpeername(fd, (struct sockaddr *)&conn->d_remote, &remotelen) < 0) {
+                L<<Logger::Error<<"Received question from socket which had no remote address, dropping ("<<stringerror()<<")"<<endl;
+                Utility::closesocket(fd);
+                delete conn;
+                d_connectionroom_sem->post();
+                continue;
+              }
+              Utility::setNonBlocking(fd);
+              handoffConnection(conn);
+            }
+            else if(pthread_create(&tid, 0, &doConnection, reinterpret_cast<void*>(fd))) {
               L<<Logger::Error<<"Error creating thread: "<<stringerror()<<endl;
               d_connectionroom_sem->post();
             }
@@ -28,6 +28,7 @@
 #include "packethandler.hh"
 #include <vector>
 #include <boost/shared_ptr.hpp>
+#include <boost/any.hpp>
 #include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -41,6 +42,17 @@
 
 #include "namespaces.hh"
 
+struct TCPConnectionState;
+struct TCPEventThread;
+struct TCPQuestion;
+
+/** Answers questions over TCP. By default every connection gets its own thread. With tcp-event-threads set, 
+    connections are instead spread over that many threads, each serving many connections from an FDMultiplexer. 
+    AXFR and IXFR are slow and blocking, so event threads hand connections that ask for them to a separate pool 
+    of tcp-axfr-threads, which hands the connection back once the transfer is done.
+
+    Event threads only do I/O: they hand every question to tcp-pipeline-threads backend threads, reading up to 
+    tcp-pipeline-depth questions per connection ahead. Answers are written in the order they complete. */
 class TCPNameserver
 {
 public:
@@ -55,7 +67,30 @@ private:
   static int doAXFR(const string &target, boost::shared_ptr<DNSPacket> q, int outsock);
   static bool canDoAXFR(boost::shared_ptr<DNSPacket> q);
   static void *doConnection(void *data);
+  static bool answerQuestion(boost::shared_ptr<DNSPacket> packet, string& out, bool logDNSQueries, PacketHandler*& P, pthread_mutex_t* lock);
   static void *launcher(void *data);
+
+  static void *eventThread(void *data);
+  static void *axfrThread(void *data);
+  static void *pipelineThread(void *data);
+  static void handoffConnection(TCPConnectionState *conn);
+  static void processConnection(TCPEventThread *thr, boost::shared_ptr<TCPConnectionState> conn);
+  static void closeConnection(TCPEventThread *thr, boost::shared_ptr<TCPConnectionState> conn);
+  static void holdConnection(TCPEventThread *thr, boost::shared_ptr<TCPConnectionState> conn);
+  static void resumeConnection(TCPEventThread *thr, boost::shared_ptr<TCPConnectionState> conn);
+  static bool queueQuestion(TCPEventThread *thr, boost::shared_ptr<TCPConnectionState> conn, boost::shared_ptr<DNSPacket> packet);
+  static void stallConnection(TCPEventThread *thr, boost::shared_ptr<TCPConnectionState> conn);
+  static void retryStalled(TCPEventThread *thr);
+  static void handleNewConnection(int fd, boost::any& parameter, TCPEventThread *thr);
+  static void handleConnectionIO(int fd, boost::any& parameter, TCPEventThread *thr);
+  static void handleAnswer(int fd, boost::any& parameter, TCPEventThread *thr);
+  static vector<TCPEventThread*> s_eventThreads;
+  static int s_axfrPipe[2];
+  static int s_questionPipe[2];
+  static unsigned int s_pipelineDepth;
+  static AtomicCounter s_inflight; //!< questions out at the pipeline threads, over all event threads
+  static const unsigned int s_maxInflight=1024; //!< a pipe holds at least 16KB, 2048 pointers, on the systems we run on
+
   void thread(void);
   static pthread_mutex_t s_plock;
   static PacketHandler *s_P;
@@ -0,0 +1,132 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include "../modules/bindbackend/bindbackend2.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(bind2compactstore_cc)
+
+// owner names as the bind backend stores them: lowercase, label reversed and relative to the zone
+static void addRecord(recordstorage_t& records, const string& qname, uint16_t qtype, const string& content, const string& hash="")
+{
+  Bind2DNSRecord bdr;
+  bdr.qname=labelReverse(toLower(qname));
+  bdr.qtype=qtype;
+  bdr.content=content;
+  bdr.nsec3hash=hash;
+  bdr.ttl=3600;
+  bdr.priority=qtype==QType::MX ? 10 : 0;
+  bdr.auth=qtype!=QType::NS || qname.empty();
+  records.insert(bdr);
+}
+
+static void fillZone(recordstorage_t& records)
+{
+  addRecord(records, "", QType::SOA, "ns1.example.com. hostmaster.example.com. 1 3600 600 86400 3600", "a1");
+  addRecord(records, "", QType::NS, "ns1.example.com.", "a1");
+  addRecord(records, "", QType::MX, "mail.example.com.", "a1");
+  addRecord(records, "www", QType::A, "192.0.2.1", "c3");
+  addRecord(records, "www", QType::A, "192.0.2.2", "c3");
+  addRecord(records, "www", QType::AAAA, "2001:db8::1", "c3");
+  addRecord(records, "mail", QType::A, "192.0.2.3", "0f");
+  addRecord(records, "a.b.deep", QType::TXT, "\"x\"", "77");
+  addRecord(records, "sub", QType::NS, "ns.sub.example.com.");
+  addRecord(records, "zzz", QType::A, "192.0.2.4", "ff"); // sorts last
+}
+
+BOOST_AUTO_TEST_CASE(test_Bind2CompactStoreRoundTrip) {
+  recordstorage_t records;
+  fillZone(records);
+  Bind2CompactStore store(records.begin(), records.end());
+
+  BOOST_CHECK_EQUAL(store.numRecords(), records.size());
+  BOOST_CHECK_EQUAL(store.numNames(), 6U);
+  BOOST_CHECK_EQUAL(store.firstRecord(store.numNames()), store.numRecords()); // the sentinel
+
+  // every record comes back as it went in, in the same order, with the records of a name together
+  uint32_t name=0, record=0;
+  BOOST_FOREACH(const Bind2DNSRecord& bdr, records) {
+    while(store.firstRecord(name+1) <= record)
+      ++name;
+    BOOST_CHECK_EQUAL(store.getName(name), bdr.qname);
+    BOOST_CHECK_EQUAL(store.getHash(name), bdr.nsec3hash);
+    const Bind2CompactStore::Record& r=store.getRecord(record);
+    BOOST_CHECK_EQUAL(r.qtype, bdr.qtype);
+    BOOST_CHECK_EQUAL(r.ttl, bdr.ttl);
+    BOOST_CHECK_EQUAL(r.priority, bdr.priority);
+    BOOST_CHECK_EQUAL(r.auth, bdr.auth);
+    BOOST_CHECK_EQUAL(r.hashed, !bdr.nsec3hash.empty());
+    BOOST_CHECK_EQUAL(store.getContent(record), bdr.content);
+    ++record;
+  }
+  BOOST_CHECK_EQUAL(record, store.numRecords());
+  BOOST_CHECK_EQUAL(name, store.numNames()-1);
+  BOOST_CHECK(store.memoryUsage() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_Bind2CompactStoreLookup) {
+  recordstorage_t records;
+  fillZone(records);
+  Bind2CompactStore store(records.begin(), records.end());
+
+  // the backend lowercases and label reverses questions before it looks, so any case finds the name
+  uint32_t name;
+  BOOST_CHECK(store.find(labelReverse(toLower("WWW")), name));
+  BOOST_CHECK_EQUAL(store.getName(name), "www");
+  BOOST_CHECK_EQUAL(store.firstRecord(name+1) - store.firstRecord(name), 3U);
+  BOOST_CHECK(store.find(labelReverse(toLower("A.b.DEEP")), name));
+  BOOST_CHECK_EQUAL(store.getName(name), "deep b a");
+  BOOST_CHECK(!store.find("WWW", name)); // the store itself compares exactly
+  BOOST_CHECK(!store.find("ww", name));
+  BOOST_CHECK(!store.find("www ", name));
+  BOOST_CHECK(!store.find("deep b", name)); // an empty non-terminal has no records here
+
+  // the first and the last name
+  BOOST_CHECK(store.find("", name));
+  BOOST_CHECK_EQUAL(name, 0U);
+  BOOST_CHECK_EQUAL(store.firstRecord(name), 0U);
+  BOOST_CHECK_EQUAL(store.firstRecord(name+1), 3U);
+  BOOST_CHECK(store.find("zzz", name));
+  BOOST_CHECK_EQUAL(name, store.numNames()-1);
+  BOOST_CHECK_EQUAL(store.getContent(store.numRecords()-1), "192.0.2.4"); // runs to the end of the content
+
+  // upperBound at and beyond both ends
+  BOOST_CHECK_EQUAL(store.upperBound(""), 1U);
+  BOOST_CHECK_EQUAL(store.upperBound("a"), 1U);
+  BOOST_CHECK_EQUAL(store.getName(store.upperBound("mail")), "sub");
+  BOOST_CHECK_EQUAL(store.upperBound("zzz"), store.numNames());
+  BOOST_CHECK_EQUAL(store.upperBound("zzzz"), store.numNames());
+}
+
+BOOST_AUTO_TEST_CASE(test_Bind2CompactStoreHashes) {
+  recordstorage_t records;
+  fillZone(records);
+  Bind2CompactStore store(records.begin(), records.end());
+
+  BOOST_CHECK_EQUAL(store.numHashed(), 5U); // the delegation has no hash
+  for(uint32_t pos=1; pos < store.numHashed(); ++pos)
+    BOOST_CHECK(store.getHash(store.getHashed(pos-1)) < store.getHash(store.getHashed(pos)));
+  BOOST_CHECK_EQUAL(store.getHash(store.getHashed(0)), "0f");
+  BOOST_CHECK_EQUAL(store.getHash(store.getHashed(store.numHashed()-1)), "ff");
+
+  BOOST_CHECK_EQUAL(store.hashUpperBound(""), 0U);
+  BOOST_CHECK_EQUAL(store.hashUpperBound("0f"), 1U);
+  BOOST_CHECK_EQUAL(store.hashUpperBound("fe"), store.numHashed()-1);
+  BOOST_CHECK_EQUAL(store.hashUpperBound("ff"), store.numHashed());
+}
+
+BOOST_AUTO_TEST_CASE(test_Bind2CompactStoreEmpty) {
+  recordstorage_t records;
+  Bind2CompactStore store(records.begin(), records.end());
+  uint32_t name;
+  BOOST_CHECK_EQUAL(store.numNames(), 0U);
+  BOOST_CHECK_EQUAL(store.numRecords(), 0U);
+  BOOST_CHECK_EQUAL(store.numHashed(), 0U);
+  BOOST_CHECK(!store.find("", name));
+  BOOST_CHECK_EQUAL(store.upperBound("www"), 0U);
+  BOOST_CHECK_EQUAL(store.hashUpperBound("00"), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,95 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include "histogram.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(test_histogram_hh)
+
+// submits usec to an empty histogram and returns the bucket it ended up in
+static unsigned int bucketOf(uint64_t usec)
+{
+  LatencyHistogram lh;
+  lh.submit(usec);
+  for(unsigned int n=0; n < LatencyHistogram::NumBuckets; ++n)
+    if(lh.getBucket(n))
+      return n;
+  return LatencyHistogram::NumBuckets;
+}
+
+// a value belongs in the first bucket whose upper bound is above it
+static void checkBucket(uint64_t usec)
+{
+  unsigned int n=bucketOf(usec);
+  BOOST_REQUIRE(n < LatencyHistogram::NumBuckets);
+  BOOST_CHECK_MESSAGE(usec < LatencyHistogram::upperBound(n) || n == LatencyHistogram::NumBuckets-1, usec);
+  if(n)
+    BOOST_CHECK_MESSAGE(usec >= LatencyHistogram::upperBound(n-1), usec);
+}
+
+BOOST_AUTO_TEST_CASE(test_histogram_small) {
+  for(unsigned int n=0; n < 4; ++n) {
+    BOOST_CHECK_EQUAL(bucketOf(n), n); // one bucket per usec
+    BOOST_CHECK_EQUAL(LatencyHistogram::upperBound(n), n+1U);
+  }
+  BOOST_CHECK_EQUAL(bucketOf(4), 4U);
+  BOOST_CHECK_EQUAL(bucketOf(7), 7U);
+  BOOST_CHECK_EQUAL(bucketOf(8), 8U);
+  BOOST_CHECK_EQUAL(bucketOf(9), 8U); // from here on, buckets are wider than 1 usec
+  BOOST_CHECK_EQUAL(bucketOf(10), 9U);
+  BOOST_CHECK_EQUAL(LatencyHistogram::upperBound(8), 10U);
+
+  for(uint64_t usec=0; usec < 100000; ++usec)
+    checkBucket(usec);
+}
+
+BOOST_AUTO_TEST_CASE(test_histogram_powers) {
+  for(unsigned int power=2; power < 64; ++power) {
+    uint64_t val=1ULL << power;
+    checkBucket(val-1);
+    checkBucket(val);
+    checkBucket(val+1);
+    checkBucket(val + val/4 - 1); // the edges of the sub buckets
+    checkBucket(val + val/4);
+  }
+  checkBucket(~(uint64_t)0);
+
+  // the last bounded bucket ends at 2^29, everything from there goes in the last one
+  BOOST_CHECK_EQUAL(LatencyHistogram::upperBound(LatencyHistogram::NumBuckets-2), 1ULL << 29);
+  BOOST_CHECK_EQUAL(bucketOf((1ULL << 29) - 1), (unsigned int)LatencyHistogram::NumBuckets-2);
+  BOOST_CHECK_EQUAL(bucketOf(1ULL << 29), (unsigned int)LatencyHistogram::NumBuckets-1);
+  BOOST_CHECK_EQUAL(bucketOf(~(uint64_t)0), (unsigned int)LatencyHistogram::NumBuckets-1);
+  BOOST_CHECK_EQUAL(LatencyHistogram::upperBound(LatencyHistogram::NumBuckets-1), ~(uint64_t)0);
+
+  // no bucket is wider than a quarter of its lower bound
+  for(unsigned int n=5; n < LatencyHistogram::NumBuckets-1; ++n) {
+    uint64_t lower=LatencyHistogram::upperBound(n-1), upper=LatencyHistogram::upperBound(n);
+    BOOST_CHECK(upper > lower);
+    BOOST_CHECK(upper - lower <= lower/4);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_histogram_percentile) {
+  LatencyHistogram lh;
+  BOOST_CHECK_EQUAL(lh.percentile(50), 0U);
+
+  for(unsigned int n=0; n < 90; ++n)
+    lh.submit(1);
+  for(unsigned int n=0; n < 10; ++n)
+    lh.submit(1000);
+  BOOST_CHECK_EQUAL(lh.count(), 100U);
+  BOOST_CHECK_EQUAL(lh.percentile(50), 2U);
+  BOOST_CHECK_EQUAL(lh.percentile(89), 2U);
+  BOOST_CHECK_EQUAL(lh.percentile(90), LatencyHistogram::upperBound(bucketOf(1000)));
+  BOOST_CHECK_EQUAL(lh.percentile(100), LatencyHistogram::upperBound(bucketOf(1000)));
+
+  LatencyHistogram other;
+  other.submit(1ULL << 40);
+  lh+=other;
+  BOOST_CHECK_EQUAL(lh.count(), 101U);
+  BOOST_CHECK_EQUAL(lh.getBucket(LatencyHistogram::NumBuckets-1), 1U);
+  BOOST_CHECK_EQUAL(lh.percentile(100), ~(uint64_t)0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
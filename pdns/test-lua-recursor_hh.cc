@@ -0,0 +1,56 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include "lua-recursor.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(lua_recursor_hh)
+
+BOOST_AUTO_TEST_CASE(test_RecursorHookFilterSuffixes) {
+  RecursorHookFilter filter;
+  ComboAddress remote("192.0.2.1");
+  QType a(QType::A);
+  BOOST_CHECK(filter.match(remote, "www.example.com.", a)); // no filter, everything goes
+
+  filter.d_suffixes.insert("example.com");
+  BOOST_CHECK(filter.match(remote, "example.com.", a));
+  BOOST_CHECK(filter.match(remote, "example.com", a));
+  BOOST_CHECK(filter.match(remote, "www.example.com.", a));
+  BOOST_CHECK(filter.match(remote, "a.b.WWW.Example.COM.", a));
+  BOOST_CHECK(!filter.match(remote, "badexample.com.", a)); // only at label boundaries
+  BOOST_CHECK(!filter.match(remote, "example.com.evil.", a));
+  BOOST_CHECK(!filter.match(remote, "com.", a));
+  BOOST_CHECK(!filter.match(remote, ".", a));
+  BOOST_CHECK(!filter.match(remote, "", a));
+
+  filter.d_suffixes.insert("org");
+  BOOST_CHECK(filter.match(remote, "example.org.", a));
+  BOOST_CHECK(!filter.match(remote, "example.net.", a));
+
+  filter.d_suffixes.insert(""); // the root matches everything
+  BOOST_CHECK(filter.match(remote, "example.net.", a));
+  BOOST_CHECK(filter.match(remote, ".", a));
+}
+
+BOOST_AUTO_TEST_CASE(test_RecursorHookFilterNetmasksQTypes) {
+  RecursorHookFilter filter;
+  filter.d_netmasks.addMask("10.0.0.0/8");
+  filter.d_netmasks.addMask("2001:db8::/32");
+  BOOST_CHECK(filter.match(ComboAddress("10.1.2.3"), "example.com.", QType(QType::A)));
+  BOOST_CHECK(filter.match(ComboAddress("2001:db8::1"), "example.com.", QType(QType::A)));
+  BOOST_CHECK(!filter.match(ComboAddress("192.0.2.1"), "example.com.", QType(QType::A)));
+
+  filter.d_qtypes.insert(QType::AAAA);
+  filter.d_qtypes.insert(QType::MX);
+  BOOST_CHECK(filter.match(ComboAddress("10.1.2.3"), "example.com.", QType(QType::AAAA)));
+  BOOST_CHECK(filter.match(ComboAddress("10.1.2.3"), "example.com.", QType(QType::MX)));
+  BOOST_CHECK(!filter.match(ComboAddress("10.1.2.3"), "example.com.", QType(QType::A)));
+  BOOST_CHECK(!filter.match(ComboAddress("192.0.2.1"), "example.com.", QType(QType::AAAA))); // all conditions must hold
+
+  filter.d_suffixes.insert("example.com");
+  BOOST_CHECK(filter.match(ComboAddress("10.1.2.3"), "www.example.com.", QType(QType::MX)));
+  BOOST_CHECK(!filter.match(ComboAddress("10.1.2.3"), "www.example.net.", QType(QType::MX)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
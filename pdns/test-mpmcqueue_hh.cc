@@ -0,0 +1,79 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include "mpmcqueue.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(test_mpmcqueue_hh)
+
+BOOST_AUTO_TEST_CASE(test_mpmcqueue_fifo) {
+  MPMCQueue<int> q(5);
+  BOOST_CHECK_EQUAL(q.capacity(), 8U);
+
+  int val;
+  BOOST_CHECK(!q.pop(val));
+  for(int n=0; n < 8; ++n)
+    BOOST_CHECK(q.push(n));
+  BOOST_CHECK(!q.push(8));
+  BOOST_CHECK_EQUAL(q.size(), 8U);
+
+  for(int n=0; n < 8; ++n) {
+    BOOST_CHECK(q.pop(val));
+    BOOST_CHECK_EQUAL(val, n);
+  }
+  BOOST_CHECK(!q.pop(val));
+  BOOST_CHECK_EQUAL(q.size(), 0U);
+
+  // wrap around a few times
+  for(int n=0; n < 100; ++n) {
+    BOOST_CHECK(q.push(n));
+    BOOST_CHECK(q.pop(val));
+    BOOST_CHECK_EQUAL(val, n);
+  }
+}
+
+static MPMCQueue<unsigned int> s_q(64);
+static const unsigned int s_perThread=100000;
+
+static void* producer(void*)
+{
+  for(unsigned int n=1; n <= s_perThread; ++n)
+    while(!s_q.push(n))
+      sched_yield(); // the other side may need our CPU to make room
+  return 0;
+}
+
+static void* consumer(void* arg)
+{
+  unsigned long sum=0;
+  for(unsigned int n=0; n < s_perThread; ++n) {
+    unsigned int val;
+    while(!s_q.pop(val))
+      sched_yield();
+    sum+=val;
+  }
+  *(unsigned long*)arg=sum;
+  return 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_mpmcqueue_threads) {
+  pthread_t producers[4], consumers[4];
+  unsigned long sums[4];
+  for(int n=0; n < 4; ++n) {
+    pthread_create(&consumers[n], 0, consumer, &sums[n]);
+    pthread_create(&producers[n], 0, producer, 0);
+  }
+  unsigned long total=0;
+  for(int n=0; n < 4; ++n) {
+    pthread_join(producers[n], 0);
+    pthread_join(consumers[n], 0);
+    total+=sums[n];
+  }
+  BOOST_CHECK_EQUAL(total, 4UL*s_perThread*(s_perThread+1)/2);
+  BOOST_CHECK_EQUAL(s_q.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,36 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include <boost/assign/list_of.hpp>
+#include "packetcache.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(packetcache_cc)
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheShardLimits) {
+  PacketCache pc(64);
+  BOOST_CHECK_EQUAL(pc.numShards(), 64U);
+
+  vector<unsigned int> maxes=assign::list_of(1)(7)(63)(64)(65)(1000)(1000000);
+  BOOST_FOREACH(unsigned int maxEntries, maxes) {
+    pc.setMaxEntries(maxEntries);
+    unsigned int sum=0, used=0;
+    for(unsigned int n=0; n < pc.numShards(); ++n) {
+      unsigned int shardMax=pc.maxShardEntries(n);
+      BOOST_CHECK(shardMax <= maxEntries / 64 + 1);
+      sum+=shardMax;
+      if(shardMax)
+        used++;
+    }
+    BOOST_CHECK_EQUAL(sum, maxEntries);
+    BOOST_CHECK_EQUAL(used, min(maxEntries, 64U)); // every shard in use can hold something
+  }
+
+  pc.setMaxEntries(0);
+  for(unsigned int n=0; n < pc.numShards(); ++n)
+    BOOST_CHECK_EQUAL(pc.maxShardEntries(n), UINT_MAX);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
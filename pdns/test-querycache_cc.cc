@@ -0,0 +1,46 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include <boost/lexical_cast.hpp>
+#include "querycache.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(querycache_cc)
+
+BOOST_AUTO_TEST_CASE(test_QueryCacheShardLimits) {
+  QueryCache qc(16);
+  for(unsigned int maxEntries=1; maxEntries < 100; ++maxEntries) {
+    qc.setMaxEntries(maxEntries);
+    unsigned int sum=0;
+    for(unsigned int n=0; n < 16; ++n)
+      sum+=qc.maxShardEntries(n);
+    BOOST_CHECK_EQUAL(sum, maxEntries);
+  }
+  qc.setMaxEntries(0);
+  BOOST_CHECK_EQUAL(qc.maxShardEntries(0), UINT_MAX);
+}
+
+BOOST_AUTO_TEST_CASE(test_QueryCacheLimit) {
+  QueryCache qc(16);
+  qc.setMaxEntries(100);
+
+  QueryCache::records_t rrs(new vector<DNSResourceRecord>(1));
+  for(unsigned int n=0; n < 1000; ++n)
+    qc.insert("host"+lexical_cast<string>(n)+".example.com", QType(QType::A), 1, rrs, 3600);
+  BOOST_CHECK_EQUAL(qc.size(), 100U); // every shard got more than its share, and kept its share
+
+  qc.cleanup(); // nothing expired, so nothing to remove
+  BOOST_CHECK_EQUAL(qc.size(), 100U);
+
+  // the most recently inserted names are still there, in any case
+  QueryCache::records_t found;
+  BOOST_CHECK(qc.get("HOST999.example.com", QType(QType::A), 1, found));
+  BOOST_CHECK(found == rrs);
+  BOOST_CHECK(!qc.get("host999.example.com", QType(QType::AAAA), 1, found));
+
+  qc.insert("expired.example.com", QType(QType::A), 1, rrs, 0); // a ttl of 0 is not cached
+  BOOST_CHECK(!qc.get("expired.example.com", QType(QType::A), 1, found));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,100 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include "recpacketcache.hh"
+#include "dnswriter.hh"
+#include "dnsparser.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(recpacketcache_cc)
+
+static string makeQuery(const string& qname, uint16_t qtype, uint16_t id, bool rd=true, int ednsSize=0)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->id=htons(id);
+  pw.getHeader()->rd=rd;
+  if(ednsSize) {
+    pw.addOpt(ednsSize, 0, 0);
+    pw.commit();
+  }
+  return string(packet.begin(), packet.end());
+}
+
+static string makeResponse(const string& qname, uint16_t qtype, uint16_t id, uint32_t address, uint32_t ttl)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->id=htons(id);
+  pw.getHeader()->rd=1;
+  pw.getHeader()->qr=1;
+  pw.startRecord(qname, QType::A, ttl);
+  pw.xfr32BitInt(address);
+  pw.commit();
+  return string(packet.begin(), packet.end());
+}
+
+BOOST_AUTO_TEST_CASE(test_RecPacketCacheHitMissExpire) {
+  RecursorPacketCache rpc;
+  const string* answer=0;
+  time_t now=1000000;
+
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery("www.example.com", QType::A, 1), now, &answer));
+  rpc.insertResponsePacket(makeResponse("www.example.com", QType::A, 1, 0xc0000201, 60), 0, now, 60);
+  BOOST_CHECK_EQUAL(rpc.size(), 1U);
+
+  // a hit gets the ID and the qname case of the query patched in
+  string query=makeQuery("WWW.Example.com", QType::A, 4242);
+  BOOST_REQUIRE(rpc.getResponsePacket(query, now, &answer));
+  MOADNSParser mdp(*answer);
+  BOOST_CHECK_EQUAL(mdp.d_header.id, htons(4242));
+  BOOST_CHECK_EQUAL(mdp.d_qname, "WWW.Example.com.");
+  BOOST_REQUIRE_EQUAL(mdp.d_answers.size(), 1U);
+  BOOST_CHECK_EQUAL(mdp.d_answers[0].first.d_ttl, 60U);
+  BOOST_CHECK_EQUAL(rpc.d_hits, 1U);
+
+  // anything else about the question makes it a miss
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery("www.example.com", QType::AAAA, 1), now, &answer));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery("www.example.net", QType::A, 1), now, &answer));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery("ww.example.com", QType::A, 1), now, &answer));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery("www.example.com", QType::A, 1, false), now, &answer));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery("www.example.com", QType::A, 1, true, 4096), now, &answer));
+  BOOST_CHECK_EQUAL(rpc.d_misses, 6U);
+
+  // the TTLs age with every hit, until the entry expires
+  BOOST_REQUIRE(rpc.getResponsePacket(query, now+50, &answer));
+  MOADNSParser aged(*answer);
+  BOOST_REQUIRE_EQUAL(aged.d_answers.size(), 1U);
+  BOOST_CHECK_EQUAL(aged.d_answers[0].first.d_ttl, 10U);
+  BOOST_CHECK(!rpc.getResponsePacket(query, now+60, &answer));
+
+  // an EDNS query only finds an answer cached for the same buffer size
+  rpc.insertResponsePacket(makeResponse("www.example.com", QType::A, 1, 0xc0000201, 60), 4096, now, 60);
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery("www.example.com", QType::A, 1, true, 4096), now, &answer));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery("www.example.com", QType::A, 1, true, 1232), now, &answer));
+
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache("www.example.com."), 2);
+  BOOST_CHECK_EQUAL(rpc.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_RecPacketCacheCollision) {
+  // the questions for these two names, of the same length, have the same FNV-1a hash
+  const string first("host1816628.example.com"), second("host2354066.example.com");
+  RecursorPacketCache rpc;
+  const string* answer=0;
+  time_t now=1000000;
+
+  rpc.insertResponsePacket(makeResponse(first, QType::A, 1, 0xc0000201, 60), 0, now, 60);
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(second, QType::A, 2), now, &answer));
+
+  rpc.insertResponsePacket(makeResponse(second, QType::A, 1, 0xc0000202, 60), 0, now, 60);
+  BOOST_CHECK_EQUAL(rpc.size(), 2U);
+
+  BOOST_REQUIRE(rpc.getResponsePacket(makeQuery(first, QType::A, 3), now, &answer));
+  BOOST_CHECK(*answer == makeResponse(first, QType::A, 3, 0xc0000201, 60));
+  BOOST_REQUIRE(rpc.getResponsePacket(makeQuery(second, QType::A, 4), now, &answer));
+  BOOST_CHECK(*answer == makeResponse(second, QType::A, 4, 0xc0000202, 60));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
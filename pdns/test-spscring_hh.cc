@@ -0,0 +1,79 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#include <boost/test/unit_test.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include "spscring.hh"
+
+using namespace boost;
+
+BOOST_AUTO_TEST_SUITE(test_spscring_hh)
+
+BOOST_AUTO_TEST_CASE(test_spscring_fifo) {
+  SPSCRing<int> r(5);
+  BOOST_CHECK_EQUAL(r.capacity(), 8U);
+  BOOST_CHECK(!r.getReadSlot());
+
+  for(int n=0; n < 8; ++n) {
+    int* slot=r.getWriteSlot();
+    BOOST_REQUIRE(slot);
+    *slot=n;
+    BOOST_CHECK_EQUAL(r.publish(), n==0); // only the first one needs a wakeup
+  }
+  BOOST_CHECK(!r.getWriteSlot());
+  BOOST_CHECK_EQUAL(r.size(), 8U);
+
+  for(int n=0; n < 8; ++n) {
+    int* slot=r.getReadSlot();
+    BOOST_REQUIRE(slot);
+    BOOST_CHECK_EQUAL(*slot, n);
+    r.release();
+  }
+  BOOST_CHECK(!r.getReadSlot());
+
+  // wrap around a few times, every publish into an empty ring wants a wakeup
+  for(int n=0; n < 100; ++n) {
+    *r.getWriteSlot()=n;
+    BOOST_CHECK(r.publish());
+    BOOST_CHECK_EQUAL(*r.getReadSlot(), n);
+    r.release();
+  }
+}
+
+static SPSCRing<unsigned int> s_r(64);
+static const unsigned int s_count=1000000;
+
+static void* producer(void*)
+{
+  for(unsigned int n=1; n <= s_count; ++n) {
+    unsigned int* slot;
+    while(!(slot=s_r.getWriteSlot()))
+      sched_yield(); // the consumer may need our CPU to make room
+    *slot=n;
+    s_r.publish();
+  }
+  return 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_spscring_threads) {
+  pthread_t p;
+  pthread_create(&p, 0, producer, 0);
+  unsigned int expected=1;
+  bool ordered=true;
+  while(expected <= s_count) {
+    unsigned int* slot=s_r.getReadSlot();
+    if(!slot) {
+      sched_yield();
+      continue;
+    }
+    if(*slot != expected)
+      ordered=false;
+    expected++;
+    s_r.release();
+  }
+  pthread_join(p, 0);
+  BOOST_CHECK(ordered);
+  BOOST_CHECK_EQUAL(s_r.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
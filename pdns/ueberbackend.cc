@@ -19,9 +19,6 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
-
 #include "packetcache.hh"
 #include "utility.hh"
 
@@ -45,7 +42,6 @@
 #include "dnspacket.hh"
 #include "logger.hh"
 #include "statbag.hh"
-#include <boost/serialization/vector.hpp>
 
 
 extern StatBag S;
@@ -264,14 +260,16 @@ bool UeberBackend::getSOA(const string &domain, SOAData &sd, DNSPacket *p)
   d_question.zoneId=-1;
     
   if(sd.db!=(DNSBackend *)-1) {
-    int cstat=cacheHas(d_question,d_answers);
+    QueryCache::records_t cached;
+    int cstat=cacheHas(d_question,cached);
     if(cstat==0) { // negative
       return false;
     }
-    else if(cstat==1 && !d_answers.empty()) {
-      fillSOAData(d_answers[0].content,sd);
-      sd.domain_id=d_answers[0].domain_id;
-      sd.ttl=d_answers[0].ttl;
+    else if(cstat==1 && !cached->empty()) {
+      const DNSResourceRecord& rr=cached->front();
+      fillSOAData(rr.content,sd);
+      sd.domain_id=rr.domain_id;
+      sd.ttl=rr.ttl;
       sd.db=0;
       return true;
     }
@@ -348,7 +346,7 @@ void UeberBackend::cleanup()
 #undef PC
 
 // returns -1 for miss, 0 for negative match, 1 for hit
-int UeberBackend::cacheHas(const Question &q, vector<DNSResourceRecord> &rrs)
+int UeberBackend::cacheHas(const Question &q, QueryCache::records_t &rrs)
 {
   extern PacketCache PC;
   static unsigned int *qcachehit=S.getPointer("query-cache-hit");
@@ -362,22 +360,16 @@ int UeberBackend::cacheHas(const Question &q, vector<DNSResourceRecord> &rrs)
     return -1;
   }
 
-  string content;
   //  L<<Logger::Warning<<"looking up: '"<<q.qname+"'|N|"+q.qtype.getName()+"|"+itoa(q.zoneId)<<endl;
 
-  bool ret=PC.getEntry(q.qname, q.qtype, PacketCache::QUERYCACHE, content, q.zoneId);   // think about lowercasing here
+  bool ret=PC.queryCache().get(q.qname, q.qtype, q.zoneId, rrs);
   if(!ret) {
     (*qcachemiss)++;
     return -1;
   }
   (*qcachehit)++;
-  if(content.empty()) // negatively cached
+  if(!rrs) // negatively cached
     return 0;
-  
-  std::istringstream istr(content);
-  boost::archive::binary_iarchive boa(istr, boost::archive::no_header);
-  rrs.clear();
-  boa >> rrs;
   return 1;
 }
 
@@ -388,10 +380,11 @@ void UeberBackend::addNegCache(const Question &q)
   if(!negqueryttl)
     return;
   // we should also not be storing negative answers if a pipebackend does scopeMask, but we can't pass a negative scopeMask in an empty set!
-  PC.insert(q.qname, q.qtype, PacketCache::QUERYCACHE, "", negqueryttl, q.zoneId);
+  PC.queryCache().insert(q.qname, q.qtype, q.zoneId, QueryCache::records_t(), negqueryttl);
 }
 
-void UeberBackend::addCache(const Question &q, const vector<DNSResourceRecord> &rrs)
+/* takes the contents of rrs, leaving it empty */
+void UeberBackend::addCache(const Question &q, vector<DNSResourceRecord> &rrs)
 {
   extern PacketCache PC;
   static unsigned int queryttl=::arg().asNum("query-cache-ttl");
@@ -401,19 +394,17 @@ void UeberBackend::addCache(const Question &q, const vector<DNSResourceRecord> &
     return;
   
   //  L<<Logger::Warning<<"inserting: "<<q.qname+"|N|"+q.qtype.getName()+"|"+itoa(q.zoneId)<<endl;
-  std::ostringstream ostr;
-  boost::archive::binary_oarchive boa(ostr, boost::archive::no_header);
-
   cachettl = queryttl;
-  BOOST_FOREACH(DNSResourceRecord rr, rrs) {
-    if (rr.ttl < queryttl)
+  BOOST_FOREACH(const DNSResourceRecord& rr, rrs) {
+    if (rr.ttl < cachettl)
       cachettl = rr.ttl;
     if (rr.scopeMask)
       return;
   }
 
-  boa << rrs;
-  PC.insert(q.qname, q.qtype, PacketCache::QUERYCACHE, ostr.str(), cachettl, q.zoneId);
+  boost::shared_ptr<vector<DNSResourceRecord> > stored(new vector<DNSResourceRecord>());
+  stored->swap(rrs);
+  PC.queryCache().insert(q.qname, q.qtype, q.zoneId, stored, cachettl);
 }
 
 void UeberBackend::alsoNotifies(const string &domain, set<string> *ips)
@@ -464,7 +455,8 @@ void UeberBackend::lookup(const QType &qtype,const string &qname, DNSPacket *pkt
     d_question.qtype=qtype;
     d_question.qname=qname;
     d_question.zoneId=zoneId;
-    int cstat=cacheHas(d_question, d_answers);
+    d_cachedanswers.reset();
+    int cstat=cacheHas(d_question, d_cachedanswers);
     if(cstat<0) { // nothing
       d_negcached=d_cached=false;
       d_answers.clear(); 
@@ -478,7 +470,7 @@ void UeberBackend::lookup(const QType &qtype,const string &qname, DNSPacket *pkt
     else {
       d_negcached=false;
       d_cached=true;
-      d_cachehandleiter = d_answers.begin();
+      d_cachehandleiter = d_cachedanswers->begin();
     }
   }
 
@@ -499,8 +491,8 @@ bool UeberBackend::get(DNSResourceRecord &rr)
   }
 
   if(d_cached) {
-    if(d_cachehandleiter != d_answers.end()) {
-      rr=*d_cachehandleiter++;;
+    if(d_cachehandleiter != d_cachedanswers->end()) {
+      rr=*d_cachehandleiter++;
       return true;
     }
     return false;
@@ -40,6 +40,7 @@
 #include <boost/utility.hpp>
 #include "dnspacket.hh"
 #include "dnsbackend.hh"
+#include "querycache.hh"
 
 #include "namespaces.hh"
 
@@ -156,11 +157,12 @@ private:
     int zoneId;
   }d_question;
   vector<DNSResourceRecord> d_answers;
+  QueryCache::records_t d_cachedanswers; //!< shared with the query cache, so never modify
   vector<DNSResourceRecord>::const_iterator d_cachehandleiter;
 
-  int cacheHas(const Question &q, vector<DNSResourceRecord> &rrs);
+  int cacheHas(const Question &q, QueryCache::records_t &rrs);
   void addNegCache(const Question &q);
-  void addCache(const Question &q, const vector<DNSResourceRecord> &rrs);
+  void addCache(const Question &q, vector<DNSResourceRecord> &rrs);
   
   static pthread_mutex_t d_mut;
   static pthread_cond_t d_cond;